@@ -0,0 +1,356 @@
+// How protoc-gen-objcservice and protoc-gen-objcjson scale with the size of
+// a schema.  Builds synthetic .proto files in a DescriptorPool, the way
+// PluginMain does with what protoc sends, and calls each generator on them
+// directly with the output kept in memory.  Run with `make bench`,
+// optionally passing the number of messages per file:
+//
+//   build/generator_bench 5000
+//
+// Three shapes of file:
+//   wide     messages of 100 fields each
+//   deep     chains of messages nested 8 levels deep, 10 fields each
+//   methods  messages of 10 fields, and a method for every two of them
+//
+// Time and allocations are per 1000 messages, nested ones included.  The
+// last two columns are totals for the whole file: the size of the generated
+// sources, and the peak RSS of the process.  Each generator runs in its own
+// process, so that is what a plugin handed just that file needs, start-up
+// and the descriptors included.  It isn't divided by the message count,
+// since that fixed part would make small files look worse than they are.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "json_generator.h"
+#include "service_generator.h"
+#include "google/protobuf/dx_options.pb.h"
+
+using namespace google::protobuf;
+
+// Everything allocated with new in the process, the generators' strings
+// and Printer buffers included.
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  allocated_bytes += size;
+  void* p = malloc(size > 0 ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Keeps the generated files in memory.  There are no files from
+// protoc-gen-objc to insert into, so insertions are appended instead.
+class MemoryContext : public compiler::GeneratorContext {
+ public:
+  virtual io::ZeroCopyOutputStream* Open(const std::string& filename) {
+    return new io::StringOutputStream(&files_[filename]);
+  }
+
+  virtual io::ZeroCopyOutputStream* OpenForInsert(
+      const std::string& filename, const std::string& insertion_point) {
+    return Open(filename);
+  }
+
+  size_t bytes() const {
+    size_t total = 0;
+    for (std::map<std::string, std::string>::const_iterator it =
+             files_.begin(); it != files_.end(); ++it) {
+      total += it->second.size();
+    }
+    return total;
+  }
+
+ private:
+  std::map<std::string, std::string> files_;
+};
+
+// Field `i` of a synthetic message, cycling through the kinds of field the
+// JSON generator treats differently.  `message_type` is the type for
+// message fields.
+static void AddField(DescriptorProto* message, int i,
+                     const std::string& message_type) {
+  FieldDescriptorProto* field = message->add_field();
+  field->set_name("field_" + std::to_string(i));
+  field->set_number(i + 1);
+  field->set_label(FieldDescriptorProto::LABEL_OPTIONAL);
+  switch (i % 14) {
+    case 0: field->set_type(FieldDescriptorProto::TYPE_INT32); break;
+    case 1: field->set_type(FieldDescriptorProto::TYPE_INT64); break;
+    case 2: field->set_type(FieldDescriptorProto::TYPE_UINT32); break;
+    case 3: field->set_type(FieldDescriptorProto::TYPE_DOUBLE); break;
+    case 4: field->set_type(FieldDescriptorProto::TYPE_FLOAT); break;
+    case 5: field->set_type(FieldDescriptorProto::TYPE_BOOL); break;
+    case 6: field->set_type(FieldDescriptorProto::TYPE_STRING); break;
+    case 7: field->set_type(FieldDescriptorProto::TYPE_BYTES); break;
+    case 8:
+      field->set_type(FieldDescriptorProto::TYPE_ENUM);
+      field->set_type_name(".bench.Kind");
+      break;
+    case 9:
+      field->set_type(FieldDescriptorProto::TYPE_MESSAGE);
+      field->set_type_name(message_type);
+      break;
+    case 10:
+      field->set_label(FieldDescriptorProto::LABEL_REPEATED);
+      field->set_type(FieldDescriptorProto::TYPE_INT32);
+      break;
+    case 11:
+      field->set_label(FieldDescriptorProto::LABEL_REPEATED);
+      field->set_type(FieldDescriptorProto::TYPE_STRING);
+      break;
+    case 12:
+      field->set_label(FieldDescriptorProto::LABEL_REPEATED);
+      field->set_type(FieldDescriptorProto::TYPE_DOUBLE);
+      field->mutable_options()->SetExtension(dx_json_packed, true);
+      break;
+    case 13:
+      field->set_label(FieldDescriptorProto::LABEL_REPEATED);
+      field->set_type(FieldDescriptorProto::TYPE_MESSAGE);
+      field->set_type_name(".bench.Entry");
+      field->mutable_options()->SetExtension(dx_map_key, "key");
+      field->mutable_options()->SetExtension(dx_map_val, "value");
+      break;
+  }
+}
+
+static void AddFields(DescriptorProto* message, int count,
+                      const std::string& message_type) {
+  for (int i = 0; i < count; i++) {
+    AddField(message, i, message_type);
+  }
+}
+
+// The enum and map entry every file refers to.
+static FileDescriptorProto NewFile(const std::string& name) {
+  FileDescriptorProto file;
+  file.set_name(name);
+  file.set_package("bench");
+  file.add_dependency("google/protobuf/dx_options.proto");
+
+  EnumDescriptorProto* kind = file.add_enum_type();
+  kind->set_name("Kind");
+  kind->add_value()->set_name("KIND_A");
+  kind->mutable_value(0)->set_number(0);
+  kind->add_value()->set_name("KIND_B");
+  kind->mutable_value(1)->set_number(1);
+
+  DescriptorProto* entry = file.add_message_type();
+  entry->set_name("Entry");
+  FieldDescriptorProto* key = entry->add_field();
+  key->set_name("key");
+  key->set_number(1);
+  key->set_label(FieldDescriptorProto::LABEL_OPTIONAL);
+  key->set_type(FieldDescriptorProto::TYPE_STRING);
+  FieldDescriptorProto* value = entry->add_field();
+  value->set_name("value");
+  value->set_number(2);
+  value->set_label(FieldDescriptorProto::LABEL_OPTIONAL);
+  value->set_type(FieldDescriptorProto::TYPE_INT64);
+  return file;
+}
+
+// Message i refers to message i - 1, so the files have no cycles.
+static std::string PreviousMessage(int i) {
+  return i == 0 ? ".bench.Entry" : ".bench.Message" + std::to_string(i - 1);
+}
+
+static FileDescriptorProto WideFile(int messages) {
+  FileDescriptorProto file = NewFile("wide.proto");
+  for (int i = 0; i < messages; i++) {
+    DescriptorProto* message = file.add_message_type();
+    message->set_name("Message" + std::to_string(i));
+    AddFields(message, 100, PreviousMessage(i));
+  }
+  return file;
+}
+
+static FileDescriptorProto DeepFile(int messages) {
+  const int kDepth = 8;
+  FileDescriptorProto file = NewFile("deep.proto");
+  for (int i = 0; i < messages / kDepth; i++) {
+    DescriptorProto* message = file.add_message_type();
+    message->set_name("Message" + std::to_string(i));
+    std::string type = ".bench." + message->name();
+    for (int level = 1; level < kDepth; level++) {
+      DescriptorProto* nested = message->add_nested_type();
+      nested->set_name("Level" + std::to_string(level));
+      AddFields(message, 10, type + "." + nested->name());
+      message = nested;
+      type += "." + nested->name();
+    }
+    AddFields(message, 10, ".bench.Entry");
+  }
+  return file;
+}
+
+// Alternates GETs with a path variable and cached responses, and POSTs
+// with retries, 50 methods to a service.
+static FileDescriptorProto MethodsFile(int messages) {
+  FileDescriptorProto file = NewFile("methods.proto");
+  for (int i = 0; i < messages; i++) {
+    DescriptorProto* message = file.add_message_type();
+    message->set_name("Message" + std::to_string(i));
+    AddFields(message, 10, PreviousMessage(i));
+  }
+  ServiceDescriptorProto* service = NULL;
+  for (int i = 0; i < messages / 2; i++) {
+    if (i % 50 == 0) {
+      service = file.add_service();
+      service->set_name("Service" + std::to_string(i / 50));
+    }
+    MethodDescriptorProto* method = service->add_method();
+    method->set_name("Method" + std::to_string(i));
+    method->set_input_type(".bench.Message" + std::to_string(2 * i));
+    method->set_output_type(".bench.Message" + std::to_string(2 * i + 1));
+    DXMethodOptions* options =
+        method->mutable_options()->MutableExtension(dx_method_options);
+    if (i % 2 == 0) {
+      options->set_http_method("GET");
+      options->set_path("/things/:thingId/method" + std::to_string(i));
+      options->set_cache_ttl_ms(1000);
+      options->set_dedupe(true);
+    } else {
+      options->set_http_method("POST");
+      options->set_path("/method" + std::to_string(i));
+      options->set_max_retries(2);
+    }
+  }
+  return file;
+}
+
+static int CountMessages(const Descriptor* message) {
+  int count = 1;
+  for (int i = 0; i < message->nested_type_count(); i++) {
+    count += CountMessages(message->nested_type(i));
+  }
+  return count;
+}
+
+static long PeakRSSKB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// Builds `proto` and runs `generator` on it three times, reporting the
+// fastest run's time, allocations and output together.  Meant to run in a
+// process of its own.
+static int Run(const char* shape, const char* name,
+               const compiler::CodeGenerator& generator,
+               const FileDescriptorProto& proto) {
+  DescriptorPool pool;
+  FileDescriptorProto descriptor_proto;
+  FileDescriptorProto::descriptor()->file()->CopyTo(&descriptor_proto);
+  pool.BuildFile(descriptor_proto);
+  FileDescriptorProto options_proto;
+  DXMethodOptions::descriptor()->file()->CopyTo(&options_proto);
+  pool.BuildFile(options_proto);
+  const FileDescriptor* file = pool.BuildFile(proto);
+  if (file == NULL) {
+    fprintf(stderr, "%s: can't build %s\n", name, proto.name().c_str());
+    return 1;
+  }
+  int messages = 0;
+  for (int i = 0; i < file->message_type_count(); i++) {
+    messages += CountMessages(file->message_type(i));
+  }
+
+  typedef std::chrono::steady_clock Clock;
+  double best = 0;
+  size_t run_allocations = 0;
+  size_t run_bytes = 0;
+  size_t output = 0;
+  for (int run = 0; run < 3; run++) {
+    MemoryContext context;
+    std::string error;
+    size_t allocations_before = allocations;
+    size_t bytes_before = allocated_bytes;
+    Clock::time_point start = Clock::now();
+    if (!generator.Generate(file, "", &context, &error)) {
+      fprintf(stderr, "%s: %s\n", name, error.c_str());
+      return 1;
+    }
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    if (run == 0 || seconds < best) {
+      best = seconds;
+      run_allocations = allocations - allocations_before;
+      run_bytes = allocated_bytes - bytes_before;
+      output = context.bytes();
+    }
+  }
+
+  double thousands = messages / 1000.0;
+  printf("%-8s %-12s %8d %10.1f %12.0f %11.1f %10.1f %8.1f\n", shape, name,
+         messages, best * 1e3 / thousands, run_allocations / thousands,
+         run_bytes / thousands / 1e6, output / 1e6, PeakRSSKB() / 1024.0);
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  int messages = argc > 1 ? atoi(argv[1]) : 1000;
+  if (messages < 8) {
+    fprintf(stderr, "usage: %s [messages, at least 8]\n", argv[0]);
+    return 1;
+  }
+
+  struct Shape {
+    const char* name;
+    FileDescriptorProto (*build)(int messages);
+  };
+  const Shape shapes[] = {
+    {"wide", WideFile},
+    {"deep", DeepFile},
+    {"methods", MethodsFile},
+  };
+
+  printf("%-8s %-12s %8s %10s %12s %11s %10s %8s\n", "shape", "generator",
+         "messages", "ms/1k", "allocs/1k", "MB alloc/1k", "MB output",
+         "peak MB");
+  fflush(stdout);
+  int status = 0;
+  for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+    FileDescriptorProto proto = shapes[i].build(messages);
+    for (int g = 0; g < 2; g++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        objcservice::MyCodeGenerator service;
+        objcjson::MyCodeGenerator json;
+        _exit(g == 0 ? Run(shapes[i].name, "objcservice", service, proto)
+                     : Run(shapes[i].name, "objcjson", json, proto));
+      }
+      int child_status = 1;
+      if (pid < 0 || waitpid(pid, &child_status, 0) < 0 ||
+          !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+        status = 1;
+      }
+    }
+  }
+  return status;
+}
@@ -0,0 +1,112 @@
+// Throughput of dx::Transcoder against the reflection-based JSON in
+// libprotobuf, on a GetBalanceResponse from example.proto.  Run with
+// `make bench`, optionally passing the number of repeated elements:
+//
+//   build/transcoder_bench 1000
+//
+// The reflection numbers include parsing into and serializing from a
+// message object, since that's what converting through reflection costs.
+// Its JSON differs a little (maps and dx_json_packed fields come out as
+// arrays), so the sizes aren't exactly the same.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <string>
+
+#include <google/protobuf/util/json_util.h>
+
+#include "DXTranscoder.h"
+#include "example.pb.h"
+
+using com::example::GetBalanceResponse;
+
+static GetBalanceResponse MakeResponse(int n) {
+  GetBalanceResponse response;
+  response.mutable_primary_account()->set_account_type(com::example::SAVINGS);
+  response.mutable_primary_account()->set_balance(1234.56);
+  response.set_total_balance(98765.4321);
+  response.set_buf(std::string(256, '\x7f'));
+  for (int i = 0; i < n; i++) {
+    response.add_names("account holder \"" + std::to_string(i) + "\"");
+    response.add_ids(i * 7919);
+    GetBalanceResponse::AccountBalance* balance = response.add_balances();
+    balance->set_account_type(i % 2 ? com::example::SAVINGS
+                                    : com::example::CHECKING);
+    balance->set_balance(i * 0.25);
+    GetBalanceResponse::Limit* limit = response.add_limits();
+    limit->set_name("limit" + std::to_string(i));
+    limit->set_amount(i * 100);
+    response.add_history(i / 3.0);
+  }
+  return response;
+}
+
+// Runs `f` for about a second and prints how fast it went over `bytes` of
+// input per call.
+template <class F>
+static void Measure(const char* name, size_t bytes, F f) {
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  long iterations = 0;
+  double seconds;
+  do {
+    for (int i = 0; i < 16; i++) {
+      f();
+    }
+    iterations += 16;
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (seconds < 1);
+  printf("%-28s %10.0f ns/op %9.1f MB/s\n", name, seconds * 1e9 / iterations,
+         bytes * iterations / seconds / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 100;
+  std::string error;
+  std::unique_ptr<dx::Transcoder> transcoder =
+      dx::Transcoder::Create(GetBalanceResponse::descriptor(), &error);
+  if (transcoder == nullptr) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  std::string wire = MakeResponse(n).SerializeAsString();
+  std::string json;
+  dx::Arena arena;
+  if (!transcoder->WireToJSON(wire, &json, &arena, &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  std::string reflection_json;
+  GetBalanceResponse message;
+  message.ParseFromString(wire);
+  google::protobuf::util::MessageToJsonString(message, &reflection_json);
+  printf("%d elements: %zu bytes of protobuf, %zu of JSON (%zu through "
+         "reflection)\n\n", n, wire.size(), json.size(),
+         reflection_json.size());
+
+  std::string out;
+  Measure("wire -> JSON, transcoder", wire.size(), [&]() {
+    out.clear();
+    transcoder->WireToJSON(wire, &out, &arena, &error);
+  });
+  Measure("wire -> JSON, reflection", wire.size(), [&]() {
+    out.clear();
+    GetBalanceResponse m;
+    m.ParseFromString(wire);
+    google::protobuf::util::MessageToJsonString(m, &out);
+  });
+  Measure("JSON -> wire, transcoder", json.size(), [&]() {
+    out.clear();
+    transcoder->JSONToWire(json, &out, &arena, &error);
+  });
+  Measure("JSON -> wire, reflection", reflection_json.size(), [&]() {
+    GetBalanceResponse m;
+    google::protobuf::util::JsonStringToMessage(reflection_json, &m);
+    out.clear();
+    m.SerializeToString(&out);
+  });
+  return 0;
+}
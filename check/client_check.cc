@@ -0,0 +1,172 @@
+// Sends pipelined calls through dx::Pipeline to a dx::StandinServer and
+// checks what each side saw: a GET and a POST on one connection, a pooled
+// connection the server has since closed, a pipeline used again after
+// Run(), and a server that refuses protobuf bodies.  Run with `make check`.
+
+#include <stdio.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DXClient.h"
+#include "DXStandinServer.h"
+#include "example.pb.h"
+
+using com::example::GetBalanceRequest;
+using com::example::GetBalanceResponse;
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                            \
+      failures++;                                                \
+    }                                                            \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                 \
+  do {                                                                 \
+    if ((a) != (b)) {                                                  \
+      fprintf(stderr, "%s:%d: failed: %s == %s\n  got: %s\n", __FILE__, \
+              __LINE__, #a, #b, std::string(a).c_str());               \
+      failures++;                                                      \
+    }                                                                  \
+  } while (0)
+
+// Answers GETs with JSON and POSTs with protobuf, echoing the user id, and
+// with 415 for protobuf bodies if `refuse_protobuf`.  Requests are kept in
+// `seen`, which is only read once the responses are in.
+struct Backend {
+  std::mutex mu;
+  bool refuse_protobuf = false;
+  std::vector<dx::StandinServer::Request> seen;
+
+  void Handle(const dx::StandinServer::Request& request,
+              dx::StandinServer::Response* response) {
+    std::lock_guard<std::mutex> lock(mu);
+    seen.push_back(request);
+    if (request.method == "GET") {
+      response->content_type = dx::kJSONContentType;
+      response->body = "{\"totalBalance\":1.5,\"names\":[\"a\",\"b\"]}";
+      return;
+    }
+    GetBalanceRequest in;
+    if (request.content_type == dx::kProtobufContentType) {
+      if (refuse_protobuf) {
+        response->status = 415;
+        return;
+      }
+      in.ParseFromString(request.body);
+    } else {
+      std::string error;
+      std::string wire;
+      dx::TranscoderFor(GetBalanceRequest::descriptor(), &error)
+          ->JSONToWire(request.body, &wire, nullptr, &error);
+      in.ParseFromString(wire);
+    }
+    GetBalanceResponse out;
+    out.add_names(in.user_id());
+    out.SerializeToString(&response->body);
+  }
+};
+
+int main() {
+  Backend backend;
+  dx::StandinServer server(
+      [&backend](const dx::StandinServer::Request& request,
+                 dx::StandinServer::Response* response) {
+        backend.Handle(request, response);
+      });
+  std::string error;
+  if (!server.Start(&error)) {
+    fprintf(stderr, "can't start server: %s\n", error.c_str());
+    return 1;
+  }
+  int port = server.port();
+  dx::ConnectionPool pool;
+
+  // A GET with the fields DXQueryString() writes specially, and a POST,
+  // back to back on one connection.
+  GetBalanceResponse query;
+  query.mutable_primary_account()->set_account_type(com::example::SAVINGS);
+  query.add_names("x y");
+  query.add_names("z");
+  GetBalanceResponse::Limit* limit = query.add_limits();
+  limit->set_name("daily");
+  limit->set_amount(5);
+  query.add_history(1);
+  GetBalanceRequest post;
+  post.set_user_id("u1");
+  GetBalanceResponse get_response, post_response;
+  dx::Status get_status, post_status;
+  dx::Pipeline pipeline(&pool, server.address());
+  pipeline.Add("GET", "/q", &query, &get_response, &get_status, false);
+  pipeline.Add("POST", "/p", &post, &post_response, &post_status, true);
+  CHECK(pipeline.Run().ok());
+  CHECK(get_status.ok());
+  CHECK(post_status.ok());
+  CHECK(get_response.total_balance() == 1.5);
+  CHECK(get_response.names_size() == 2);
+  CHECK(post_response.names_size() == 1 && post_response.names(0) == "u1");
+  CHECK(server.connections() == 1);
+  CHECK(backend.seen.size() == 2);
+  if (backend.seen.size() == 2) {
+    CHECK_EQ(backend.seen[0].path,
+             "/q?history=AAAAAAAA8D8%3D&limits=%7B%22daily%22:5%7D"
+             "&names=x%20y&names=z"
+             "&primaryAccount=%7B%22accountType%22:1%7D");
+    CHECK_EQ(backend.seen[1].content_type, dx::kProtobufContentType);
+  }
+
+  // The pipeline takes more calls after Run(), and JSON bodies.
+  post.set_user_id("u2");
+  pipeline.Add("POST", "/p", &post, &post_response, &post_status, false);
+  CHECK(pipeline.Run().ok());
+  CHECK(post_status.ok());
+  CHECK(post_response.names(0) == "u2");
+  CHECK_EQ(backend.seen.back().content_type, dx::kJSONContentType);
+  CHECK_EQ(backend.seen.back().body, "{\"userId\":\"u2\"}");
+  CHECK(server.connections() == 1);
+
+  // The pooled connection goes stale when the server restarts; the
+  // pipeline sends again on a new one.
+  server.Stop();
+  if (!server.Start(&error, port)) {
+    fprintf(stderr, "can't restart server: %s\n", error.c_str());
+    return 1;
+  }
+  post.set_user_id("u3");
+  pipeline.Add("GET", "/q", &query, &get_response, &get_status, false);
+  pipeline.Add("POST", "/p", &post, &post_response, &post_status, true);
+  CHECK(pipeline.Run().ok());
+  CHECK(get_status.ok());
+  CHECK(post_status.ok());
+  CHECK(post_response.names(0) == "u3");
+
+  // A 415 resends the body as JSON, and later calls skip protobuf.
+  backend.refuse_protobuf = true;
+  size_t before = backend.seen.size();
+  post.set_user_id("u4");
+  pipeline.Add("POST", "/p", &post, &post_response, &post_status, true);
+  CHECK(pipeline.Run().ok());
+  CHECK(post_status.ok() && post_status.code == 200);
+  CHECK(post_response.names(0) == "u4");
+  CHECK(backend.seen.size() == before + 2);
+  CHECK(pool.RefusesProtobuf(server.address()));
+  pipeline.Add("POST", "/p", &post, &post_response, &post_status, true);
+  CHECK(pipeline.Run().ok());
+  CHECK(backend.seen.size() == before + 3);
+  CHECK_EQ(backend.seen.back().content_type, dx::kJSONContentType);
+  CHECK_EQ(backend.seen.back().path, "/p");
+
+  server.Stop();
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("client checks passed\n");
+  return 0;
+}
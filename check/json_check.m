@@ -0,0 +1,63 @@
+// Parses JSON of the wrong shape into the classes generated for
+// example.proto and checks that it fails with an error instead of throwing.
+// Run with `make check-objc`, which needs clang and Foundation.
+
+#import <Foundation/Foundation.h>
+
+#import "DXJSONRuntime.h"
+#import "Example.pb.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                            \
+      failures++;                                                \
+    }                                                            \
+  } while (0)
+
+static NSData *JSON(NSString *s) {
+  return [s dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+static FFGetBalanceResponse *Parse(NSString *s, NSError **error) {
+  *error = nil;
+  return [FFGetBalanceResponse parseFromJSONData:JSON(s) error:error];
+}
+
+int main() {
+  @autoreleasepool {
+    NSError *err;
+    FFGetBalanceResponse *res;
+
+    // A number among strings fails the parse; -addNames:nil would throw.
+    res = Parse(@"{\"names\":[\"a\",1]}", &err);
+    CHECK(res == nil);
+    CHECK(err != nil);
+
+    // So does a bad base64 string.
+    res = Parse(@"{\"buf\":\"@@\"}", &err);
+    CHECK(res == nil && err != nil);
+
+    // Nulls are skipped, not added.
+    res = Parse(@"{\"names\":[\"a\",null,\"b\"]}", &err);
+    CHECK(res != nil && err == nil);
+    CHECK(res.namesArray.count == 2);
+    CHECK([[res namesAtIndex:1] isEqualToString:@"b"]);
+
+    // A lazy repeated field with a number among its messages decodes to an
+    // empty array and records the error, instead of throwing on first use.
+    res = Parse(@"{\"balances\":[{\"accountType\":1},7]}", &err);
+    CHECK(res != nil && err == nil);
+    CHECK(res.lazyBalances.count == 0);
+    CHECK(DXLazyDecodeError(res) != nil);
+  }
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("json checks passed\n");
+  return 0;
+}
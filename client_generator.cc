@@ -0,0 +1,439 @@
+// Protobuf compiler for C++ service clients, for backends calling the same
+// services as the Objective-C clients.  Builds on the C++ classes from
+// protoc's --cpp_out.
+
+#include <stdio.h>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include "runtime.h"
+#include "util.h"
+#include "google/protobuf/dx_options.pb.h"  // for method options
+
+using namespace google::protobuf;
+using namespace google::protobuf::compiler;
+
+// Settings from the plugin parameter, e.g. --cppclient_out=runtime=false:.
+struct GeneratorOptions {
+  GeneratorOptions()
+      : binary_wire_format(false), emit_runtime(true), loadgen(false) {}
+
+  // Default for POST methods that don't set dx_method_options.wire_format,
+  // as with --objcservice_out=wire_format=binary:.
+  bool binary_wire_format;
+
+  // Write DXClient.h/.cc, DXTranscoder.h/.cc and DXStandinServer.h/.cc;
+  // pass runtime=false if they're already in the tree, e.g. from
+  // --cpprouter_out.
+  bool emit_runtime;
+
+  // loadgen=true: also write <file>.loadgen.cc, a load generator for the
+  // file's services, and DXLoadGen.h/.cc for it.
+  bool loadgen;
+};
+
+// The class protoc's C++ generator makes for `descriptor`.
+static string CppClassName(const Descriptor* descriptor) {
+  const string& package = descriptor->file()->package();
+  string name = descriptor->full_name().substr(
+      package.empty() ? 0 : package.size() + 1);
+  for (int i = 0; i < name.size(); i++) {
+    if (name[i] == '.') {
+      name[i] = '_';
+    }
+  }
+  return package.empty() ? "::" + name
+                         : "::" + CppNamespace(package) + "::" + name;
+}
+
+// The client class this plugin makes for `descriptor`.
+static string CppClassName(const ServiceDescriptor* descriptor) {
+  const string& package = descriptor->file()->package();
+  return package.empty() ? "::" + descriptor->name() + "Client"
+      : "::" + CppNamespace(package) + "::" + descriptor->name() + "Client";
+}
+
+// Generate one method of a client.
+class MethodGenerator {
+ public:
+  MethodGenerator(const MethodDescriptor* descriptor,
+                  const GeneratorOptions& generator_options,
+                  string* error)
+      : descriptor_(descriptor), error_(error) {
+    DXMethodOptions options =
+        descriptor_->options().GetExtension(dx_method_options);
+    // Which body the Objective-C client sends; see service_generator.cc.
+    bool binary = options.has_wire_format()
+        ? options.wire_format() == DXMethodOptions::BINARY
+        : generator_options.binary_wire_format &&
+              options.http_method() == "POST";
+    vars_["protobuf"] = binary ? "true" : "false";
+    vars_["method_name"] = descriptor->name();
+    vars_["service"] = descriptor->service()->name();
+    vars_["client"] = CppClassName(descriptor->service());
+    vars_["input_class"] = CppClassName(descriptor->input_type());
+    vars_["output_class"] = CppClassName(descriptor->output_type());
+    vars_["http_method"] = options.http_method();
+    vars_["path"] = options.path();
+    ParsePath(options.path(), &path_parts_, &method_args_);
+  }
+
+  // `pipelined` is the form on the Pipeline class, which takes a status
+  // and returns nothing.
+  void MethodSignature(io::Printer* p, const string& prefix, bool pipelined) {
+    p->Print(pipelined ? "void " : "dx::Status ");
+    vars_["prefix"] = prefix;
+    p->Print(vars_, "$prefix$$method_name$(const $input_class$& request");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print(", std::string_view $var$", "var", method_args_[i]);
+    }
+    p->Print(vars_, ", $output_class$* response");
+    if (pipelined) {
+      p->Print(", dx::Status* status");
+    }
+    p->Print(")");
+  }
+
+  void GenerateHeader(io::Printer* p, bool pipelined) {
+    p->Print(vars_, "// $http_method$ $path$\n");
+    MethodSignature(p, "", pipelined);
+    p->Print(";\n\n");
+  }
+
+  // The blocking form is a pipeline of one.
+  void GenerateImpl(io::Printer* p, const string& client) {
+    if (!Validate()) {
+      return;
+    }
+    MethodSignature(p, client + "::", false);
+    p->Print(vars_,
+             " {\n"
+             "  Pipeline pipeline(this);\n"
+             "  dx::Status status;\n"
+             "  pipeline.$method_name$(request");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print(", $var$", "var", method_args_[i]);
+    }
+    p->Print(", response, &status);\n"
+             "  pipeline.Run();\n"
+             "  return status;\n"
+             "}\n\n");
+  }
+
+  // Builds the path as the Objective-C client does, into a buffer kept by
+  // the pipeline, and encodes the request into the connection's buffer:
+  // in the query string for GETs, else in the body with the method's
+  // wire_format.
+  void GeneratePipelineImpl(io::Printer* p, const string& client) {
+    if (!Validate()) {
+      return;
+    }
+    MethodSignature(p, client + "::Pipeline::", true);
+    p->Print(" {\n");
+    p->Indent();
+    p->Print("path_.clear();\n");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print("path_ += \"$pp$\";\n", "pp", path_parts_[i]);
+      p->Print("path_ += $v$;\n", "v", method_args_[i]);
+    }
+    if (path_parts_.size() > method_args_.size()) {
+      p->Print("path_ += \"$pp$\";\n", "pp", path_parts_.back());
+    }
+    p->Print(vars_,
+             "pipeline_.Add(\"$http_method$\", path_, &request, response,"
+             " status, $protobuf$);\n");
+    p->Outdent();
+    p->Print("}\n\n");
+  }
+
+  // The LoadMethod::call for this method, which calls it through the
+  // generated client with the path variables from `args`.
+  void GenerateLoadCall(io::Printer* p) {
+    if (!Validate()) {
+      return;
+    }
+    p->Print(vars_,
+             "dx::Status $service$_$method_name$(const std::string& address,\n"
+             "    dx::ConnectionPool* pool,\n"
+             "    const google::protobuf::Message& request,\n"
+             "    const std::vector<std::string>& args) {\n"
+             "  $client$ client(address, pool);\n"
+             "  $output_class$ response;\n"
+             "  return client.$method_name$(\n"
+             "      static_cast<const $input_class$&>(request)");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print(", args[$i$]", "i", SimpleItoa(i));
+    }
+    p->Print(", &response);\n"
+             "}\n\n");
+  }
+
+  void GenerateLoadMethod(io::Printer* p) {
+    if (!Validate()) {
+      return;
+    }
+    p->Print(vars_,
+             "{\"$service$.$method_name$\", \"$http_method$\", \"$path$\",\n"
+             " &$input_class$::default_instance(),\n"
+             " &$output_class$::default_instance(),\n"
+             " $service$_$method_name$},\n");
+  }
+
+ private:
+  bool Validate() {
+    if (!descriptor_->options().HasExtension(dx_method_options)) {
+      error_->assign("Error: can't generate method " +
+                     descriptor_->full_name() + ", doesn't have options set");
+      return false;
+    }
+    if (vars_["http_method"] != "GET" && vars_["http_method"] != "POST") {
+      error_->assign("Invalid http method");
+      return false;
+    }
+    return true;
+  }
+
+  const MethodDescriptor* descriptor_;
+  string* error_;
+  map<string, string> vars_;
+  vector<string> path_parts_;
+  vector<string> method_args_;
+};
+
+// Generate code for a service.
+class ServiceGenerator {
+ public:
+  ServiceGenerator(const ServiceDescriptor* descriptor,
+                   const GeneratorOptions& options,
+                   string* error)
+      : descriptor_(descriptor), options_(options), error_(error) {
+    vars_["service"] = descriptor->name();
+    vars_["client"] = descriptor->name() + "Client";
+    vars_["indent"] = string(descriptor->name().size() + 18, ' ');
+  }
+
+  void GenerateHeader(io::Printer* p) {
+    p->Print(vars_,
+             "// Blocking client for $service$.  Safe to use from several"
+             " threads;\n"
+             "// connections are kept in `pool` between calls.  Bodies go"
+             " out as\n"
+             "// the Objective-C client sends them, per method wire_format.\n"
+             "class $client$ {\n"
+             " public:\n"
+             "  explicit $client$(const std::string& address,\n"
+             "$indent$dx::ConnectionPool* pool ="
+             " dx::ConnectionPool::Default())\n"
+             "      : address_(address), pool_(pool) {}\n\n");
+    p->Indent();
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      MethodGenerator(descriptor_->method(i), options_, error_)
+          .GenerateHeader(p, false);
+    }
+    p->Print(vars_,
+             "// Calls sent back to back on one connection.  The responses and\n"
+             "// statuses are filled in, in order, by Run().\n"
+             "class Pipeline {\n"
+             " public:\n"
+             "  explicit Pipeline($client$* client)\n"
+             "      : pipeline_(client->pool_, client->address_) {}\n\n");
+    p->Indent();
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      MethodGenerator(descriptor_->method(i), options_, error_)
+          .GenerateHeader(p, true);
+    }
+    p->Print("dx::Status Run() { return pipeline_.Run(); }\n\n");
+    p->Outdent();
+    p->Print(" private:\n"
+             "  dx::Pipeline pipeline_;\n"
+             "  std::string path_;\n"
+             "};\n\n");
+    p->Outdent();
+    p->Print(" private:\n"
+             "  std::string address_;\n"
+             "  dx::ConnectionPool* pool_;\n"
+             "};\n\n");
+  }
+
+  void GenerateImpl(io::Printer* p) {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      MethodGenerator method(descriptor_->method(i), options_, error_);
+      method.GenerateImpl(p, vars_["client"]);
+      method.GeneratePipelineImpl(p, vars_["client"]);
+    }
+  }
+
+ private:
+  const ServiceDescriptor* descriptor_;
+  const GeneratorOptions& options_;
+  string* error_;
+  map<string, string> vars_;
+};
+
+class MyCodeGenerator : public CodeGenerator {
+ public:
+  MyCodeGenerator() : runtime_written_(false) {}
+  virtual ~MyCodeGenerator() {}
+
+  static bool ParseOptions(const string& parameter,
+                           GeneratorOptions* options,
+                           string* error) {
+    vector<pair<string, string> > params;
+    ParseGeneratorParameter(parameter, &params);
+    for (int i = 0; i < params.size(); i++) {
+      const string& key = params[i].first;
+      const string& value = params[i].second;
+      if (key == "wire_format" && (value == "json" || value == "binary")) {
+        options->binary_wire_format = value == "binary";
+      } else if (key == "runtime" && (value == "true" || value == "false")) {
+        options->emit_runtime = value == "true";
+      } else if (key == "loadgen" && (value == "true" || value == "false")) {
+        options->loadgen = value == "true";
+      } else {
+        error->assign("Unknown parameter: " + key + "=" + value);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  virtual bool Generate(const FileDescriptor* file,
+                        const string& parameter,
+                        GeneratorContext* context,
+                        string* error) const {
+    GeneratorOptions options;
+    if (!ParseOptions(parameter, &options, error)) {
+      fprintf(stderr, "ERROR: %s\n", error->c_str());
+      return false;
+    }
+    if (file->service_count() == 0) {
+      return true;
+    }
+
+    if (options.emit_runtime && !runtime_written_) {
+      WriteRuntimeFile(context, "DXClient.h", kClientRuntimeHeader);
+      WriteRuntimeFile(context, "DXClient.cc", kClientRuntimeSource);
+      WriteRuntimeFile(context, "DXTranscoder.h", kTranscoderRuntimeHeader);
+      WriteRuntimeFile(context, "DXTranscoder.cc", kTranscoderRuntimeSource);
+      WriteRuntimeFile(context, "DXStandinServer.h", kStandinServerHeader);
+      WriteRuntimeFile(context, "DXStandinServer.cc", kStandinServerSource);
+      if (options.loadgen) {
+        WriteRuntimeFile(context, "DXLoadGen.h", kLoadGenRuntimeHeader);
+        WriteRuntimeFile(context, "DXLoadGen.cc", kLoadGenRuntimeSource);
+      }
+      runtime_written_ = true;
+    }
+
+    string base = Basename(file->name());
+    string guard = IncludeGuard(base + ".client.h");
+    string ns = CppNamespace(file->package());
+
+    // Generate .h file.
+    {
+      scoped_ptr<io::ZeroCopyOutputStream> output(
+          context->Open(base + ".client.h"));
+      io::Printer printer(output.get(), '$');
+      printer.PrintRaw(kFileHeader);
+      printer.Print("#ifndef $guard$\n"
+                    "#define $guard$\n\n"
+                    "#include <string>\n"
+                    "#include <string_view>\n\n"
+                    "#include \"DXClient.h\"\n"
+                    "#include \"$base$.pb.h\"\n\n",
+                    "guard", guard, "base", base);
+      if (!ns.empty()) {
+        printer.Print("namespace $ns$ {\n\n", "ns", ns);
+      }
+      for (int i = 0; i < file->service_count(); i++) {
+        ServiceGenerator(file->service(i), options, error)
+            .GenerateHeader(&printer);
+      }
+      if (!ns.empty()) {
+        printer.Print("}  // namespace $ns$\n\n", "ns", ns);
+      }
+      printer.Print("#endif  // $guard$\n", "guard", guard);
+    }
+
+    // Generate .cc file.
+    {
+      scoped_ptr<io::ZeroCopyOutputStream> output(
+          context->Open(base + ".client.cc"));
+      io::Printer printer(output.get(), '$');
+      printer.PrintRaw(kFileHeader);
+      printer.Print("#include \"$base$.client.h\"\n\n", "base", base);
+      if (!ns.empty()) {
+        printer.Print("namespace $ns$ {\n\n", "ns", ns);
+      }
+      for (int i = 0; i < file->service_count(); i++) {
+        ServiceGenerator(file->service(i), options, error)
+            .GenerateImpl(&printer);
+      }
+      if (!ns.empty()) {
+        printer.Print("}  // namespace $ns$\n", "ns", ns);
+      }
+    }
+
+    if (options.loadgen) {
+      GenerateLoadGen(file, options, context, error);
+    }
+
+    if (!error->empty()) {
+      fprintf(stderr, "ERROR: %s\n", error->c_str());
+    }
+    return error->empty();
+  }
+
+ private:
+  // A main() that loads every method of the file's services; see
+  // DXLoadGen.h.
+  static void GenerateLoadGen(const FileDescriptor* file,
+                              const GeneratorOptions& options,
+                              GeneratorContext* context,
+                              string* error) {
+    string base = Basename(file->name());
+    scoped_ptr<io::ZeroCopyOutputStream> output(
+        context->Open(base + ".loadgen.cc"));
+    io::Printer printer(output.get(), '$');
+    printer.PrintRaw(kFileHeader);
+    printer.Print("#include <string>\n"
+                  "#include <vector>\n\n"
+                  "#include \"DXLoadGen.h\"\n"
+                  "#include \"$base$.client.h\"\n\n"
+                  "namespace {\n\n",
+                  "base", base);
+    for (int i = 0; i < file->service_count(); i++) {
+      const ServiceDescriptor* service = file->service(i);
+      for (int j = 0; j < service->method_count(); j++) {
+        MethodGenerator(service->method(j), options, error)
+            .GenerateLoadCall(&printer);
+      }
+    }
+    printer.Print("const dx::LoadMethod kMethods[] = {\n");
+    printer.Indent();
+    for (int i = 0; i < file->service_count(); i++) {
+      const ServiceDescriptor* service = file->service(i);
+      for (int j = 0; j < service->method_count(); j++) {
+        MethodGenerator(service->method(j), options, error)
+            .GenerateLoadMethod(&printer);
+      }
+    }
+    printer.Outdent();
+    printer.Print("};\n\n"
+                  "}  // namespace\n\n"
+                  "int main(int argc, char* argv[]) {\n"
+                  "  return dx::LoadMain(argc, argv, kMethods,\n"
+                  "                      sizeof(kMethods) / sizeof(kMethods[0]));\n"
+                  "}\n");
+  }
+
+  mutable bool runtime_written_;
+};
+
+int main(int argc, char* argv[]) {
+  MyCodeGenerator generator;
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
@@ -0,0 +1,702 @@
+#include "DXClient.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <utility>
+
+#include <google/protobuf/descriptor.h>
+
+namespace dx {
+
+const char kProtobufContentType[] = "application/x-protobuf";
+const char kJSONContentType[] = "application/json";
+
+using google::protobuf::Descriptor;
+using google::protobuf::Message;
+
+bool HttpReader::Fill(std::string* error) {
+  if (pos_ == buffer_.size()) {
+    buffer_.clear();
+    pos_ = 0;
+  } else if (pos_ > 65536) {
+    buffer_.erase(0, pos_);
+    pos_ = 0;
+  }
+  char chunk[16384];
+  ssize_t n;
+  do {
+    n = recv(fd_, chunk, sizeof(chunk), 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    error->assign(strerror(errno));
+    return false;
+  }
+  if (n == 0) {
+    error->clear();
+    return false;
+  }
+  buffer_.append(chunk, n);
+  return true;
+}
+
+bool HttpReader::ReadLine(std::string* line, std::string* error) {
+  size_t end;
+  while ((end = buffer_.find('\n', pos_)) == std::string::npos) {
+    if (!Fill(error)) {
+      return false;
+    }
+  }
+  size_t len = end - pos_;
+  if (len > 0 && buffer_[end - 1] == '\r') {
+    len--;
+  }
+  line->assign(buffer_, pos_, len);
+  pos_ = end + 1;
+  return true;
+}
+
+bool HttpReader::ReadBytes(size_t n, std::string* out, std::string* error) {
+  while (buffer_.size() - pos_ < n) {
+    if (!Fill(error)) {
+      if (error->empty()) {
+        error->assign("connection closed mid-message");
+      }
+      return false;
+    }
+  }
+  out->append(buffer_, pos_, n);
+  pos_ += n;
+  return true;
+}
+
+bool HttpReader::Read(HttpMessage* message, std::string* error) {
+  message->start_line.clear();
+  message->content_type.clear();
+  message->close = false;
+  message->body.clear();
+
+  // Tolerate blank lines between messages.
+  do {
+    if (!ReadLine(&message->start_line, error)) {
+      return false;
+    }
+  } while (message->start_line.empty());
+
+  long long length = -1;
+  bool chunked = false;
+  std::string line;
+  while (true) {
+    if (!ReadLine(&line, error)) {
+      if (error->empty()) {
+        error->assign("connection closed mid-message");
+      }
+      return false;
+    }
+    if (line.empty()) {
+      break;
+    }
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      error->assign("malformed header: " + line);
+      return false;
+    }
+    std::string name = line.substr(0, colon);
+    size_t start = line.find_first_not_of(" \t", colon + 1);
+    std::string value = start == std::string::npos ? "" : line.substr(start);
+    if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+      length = atoll(value.c_str());
+    } else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+      chunked = strcasecmp(value.c_str(), "chunked") == 0;
+    } else if (strcasecmp(name.c_str(), "Connection") == 0) {
+      message->close = strcasecmp(value.c_str(), "close") == 0;
+    } else if (strcasecmp(name.c_str(), "Content-Type") == 0) {
+      message->content_type = value;
+    }
+  }
+
+  if (chunked) {
+    while (true) {
+      if (!ReadLine(&line, error)) {
+        return false;
+      }
+      size_t size = strtoul(line.c_str(), NULL, 16);
+      if (size == 0) {
+        break;
+      }
+      if (!ReadBytes(size, &message->body, error) ||
+          !ReadLine(&line, error)) {
+        return false;
+      }
+    }
+    // Trailers, up to the blank line.
+    do {
+      if (!ReadLine(&line, error)) {
+        return false;
+      }
+    } while (!line.empty());
+  } else if (length > 0) {
+    if (!ReadBytes(length, &message->body, error)) {
+      return false;
+    }
+  } else if (length < 0 && message->close) {
+    // The body runs to the end of the stream.
+    while (Fill(error)) {
+    }
+    if (!error->empty()) {
+      return false;
+    }
+    message->body.append(buffer_, pos_, std::string::npos);
+    pos_ = buffer_.size();
+  }
+  return true;
+}
+
+bool WriteAll(int fd, std::string_view data, std::string* error) {
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif
+  while (!data.empty()) {
+    ssize_t n = send(fd, data.data(), data.size(), flags);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error->assign(strerror(errno));
+      return false;
+    }
+    data.remove_prefix(n);
+  }
+  return true;
+}
+
+Connection::~Connection() {
+  close(fd_);
+}
+
+std::unique_ptr<Connection> Connection::Open(const std::string& address,
+                                             int timeout_ms,
+                                             std::string* error) {
+  std::string host = address;
+  if (host.compare(0, 7, "http://") == 0) {
+    host = host.substr(7);
+  } else if (host.find("://") != std::string::npos) {
+    error->assign("only http:// addresses are supported: " + address);
+    return nullptr;
+  }
+  host = host.substr(0, host.find('/'));
+  std::string name = host;
+  std::string port = "80";
+  size_t colon = host.rfind(':');
+  if (colon != std::string::npos) {
+    name = host.substr(0, colon);
+    port = host.substr(colon + 1);
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs = NULL;
+  int rc = getaddrinfo(name.c_str(), port.c_str(), &hints, &addrs);
+  if (rc != 0) {
+    error->assign(std::string("can't resolve ") + name + ": " +
+                  gai_strerror(rc));
+    return nullptr;
+  }
+
+  int fd = -1;
+  for (struct addrinfo* a = addrs; a != NULL; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    error->assign(std::string("can't connect to ") + host + ": " +
+                  strerror(errno));
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) {
+    if (error->empty()) {
+      error->assign("can't connect to " + host);
+    }
+    return nullptr;
+  }
+  error->clear();
+
+  // Pipelined requests are small writes that shouldn't wait on each other.
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  if (timeout_ms > 0) {
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+  return std::unique_ptr<Connection>(new Connection(fd, host));
+}
+
+ConnectionPool* ConnectionPool::Default() {
+  static ConnectionPool* pool = new ConnectionPool();
+  return pool;
+}
+
+std::unique_ptr<Connection> ConnectionPool::Acquire(const std::string& address,
+                                                    bool* reused,
+                                                    std::string* error) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    std::vector<std::unique_ptr<Connection>>& idle = idle_[address];
+    if (!idle.empty()) {
+      std::unique_ptr<Connection> connection = std::move(idle.back());
+      idle.pop_back();
+      *reused = true;
+      return connection;
+    }
+  }
+  *reused = false;
+  return Connection::Open(address, timeout_ms_, error);
+}
+
+void ConnectionPool::Release(const std::string& address,
+                             std::unique_ptr<Connection> connection) {
+  if (connection == nullptr || connection->broken ||
+      connection->reader()->started()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  std::vector<std::unique_ptr<Connection>>& idle = idle_[address];
+  if (idle.size() < max_idle_) {
+    idle.push_back(std::move(connection));
+  }
+}
+
+bool ConnectionPool::RefusesProtobuf(const std::string& address) {
+  std::lock_guard<std::mutex> lock(mu_);
+  return refuses_protobuf_.count(address) > 0;
+}
+
+void ConnectionPool::SetRefusesProtobuf(const std::string& address) {
+  std::lock_guard<std::mutex> lock(mu_);
+  refuses_protobuf_.insert(address);
+}
+
+const Transcoder* TranscoderFor(const Descriptor* type, std::string* error) {
+  static std::mutex mu;
+  static std::map<const Descriptor*, std::unique_ptr<Transcoder>>*
+      transcoders =
+          new std::map<const Descriptor*, std::unique_ptr<Transcoder>>();
+  std::lock_guard<std::mutex> lock(mu);
+  std::unique_ptr<Transcoder>& transcoder = (*transcoders)[type];
+  if (transcoder == nullptr) {
+    transcoder = Transcoder::Create(type, error);
+  }
+  return transcoder.get();
+}
+
+template <typename T>
+static std::string Number(T value) {
+  char buf[32];
+  std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), value);
+  return std::string(buf, r.ptr);
+}
+
+// The end of the JSON value at `i`, in the compact JSON that
+// Transcoder::WireToJSON() writes.
+static size_t ValueEnd(std::string_view json, size_t i) {
+  int depth = 0;
+  bool in_string = false;
+  for (; i < json.size(); i++) {
+    char c = json[i];
+    if (in_string) {
+      if (c == '\\') {
+        i++;
+      } else if (c == '"') {
+        in_string = false;
+        if (depth == 0) {
+          return i + 1;
+        }
+      }
+    } else if (c == '"') {
+      in_string = true;
+    } else if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (depth == 0) {
+        return i;
+      }
+      if (--depth == 0) {
+        return i + 1;
+      }
+    } else if (c == ',' && depth == 0) {
+      return i;
+    }
+  }
+  return i;
+}
+
+// One value as DXQueryString() would write it, before escaping: strings
+// without their quotes, everything else as JSON.  Undoes the escapes
+// WriteEscaped() in DXTranscoder.cc uses.
+static void AppendQueryValue(std::string_view value, std::string* out) {
+  if (value.empty() || value[0] != '"') {
+    out->append(value);
+    return;
+  }
+  for (size_t i = 1; i + 1 < value.size(); i++) {
+    char c = value[i];
+    if (c != '\\' || i + 2 >= value.size()) {
+      *out += c;
+      continue;
+    }
+    c = value[++i];
+    switch (c) {
+      case 'n': *out += '\n'; break;
+      case 'r': *out += '\r'; break;
+      case 't': *out += '\t'; break;
+      case 'u':
+        // Only control characters are written as \u00XX.
+        if (i + 4 < value.size()) {
+          *out += char(strtoul(std::string(value.substr(i + 1, 4)).c_str(),
+                               NULL, 16));
+          i += 4;
+        }
+        break;
+      default: *out += c;
+    }
+  }
+}
+
+// Percent-escapes what NSURLQueryAllowedCharacterSet, less "&=+?#", doesn't
+// allow.
+static void AppendEscaped(std::string_view s, std::string* out) {
+  static const char kHex[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (isalnum(c) || strchr("-._~!$'()*,;:@/", c) != NULL) {
+      *out += c;
+    } else {
+      *out += '%';
+      *out += kHex[c >> 4];
+      *out += kHex[c & 15];
+    }
+  }
+}
+
+bool AppendQuery(const Message& request, std::string* path,
+                 std::string* error) {
+  const Transcoder* transcoder = TranscoderFor(request.GetDescriptor(), error);
+  std::string json;
+  if (transcoder == nullptr ||
+      !transcoder->WireToJSON(request.SerializeAsString(), &json, nullptr,
+                              error)) {
+    return false;
+  }
+
+  // The members of the top-level object, sorted by key.  Keys are
+  // camel-case field names, which need no unescaping.
+  std::string_view object(json);
+  std::vector<std::pair<std::string_view, std::string_view>> members;
+  for (size_t i = 1; i < object.size() && object[i] == '"';) {
+    size_t colon = object.find("\":", i + 1);
+    size_t end = ValueEnd(object, colon + 2);
+    members.emplace_back(object.substr(i + 1, colon - i - 1),
+                         object.substr(colon + 2, end - colon - 2));
+    i = end + 1;
+  }
+  std::stable_sort(members.begin(), members.end(),
+                   [](const std::pair<std::string_view, std::string_view>& a,
+                      const std::pair<std::string_view, std::string_view>& b) {
+                     return a.first < b.first;
+                   });
+
+  bool first = path->find('?') == std::string::npos;
+  std::string value;
+  for (const auto& member : members) {
+    // Arrays are repeated fields, sent as one key per element.
+    std::string_view values = member.second;
+    bool array = !values.empty() && values[0] == '[';
+    size_t i = array ? 1 : 0;
+    while (i < values.size() && values[i] != ']') {
+      size_t end = array ? ValueEnd(values, i) : values.size();
+      *path += first ? '?' : '&';
+      first = false;
+      AppendEscaped(member.first, path);
+      *path += '=';
+      value.clear();
+      AppendQueryValue(values.substr(i, end - i), &value);
+      AppendEscaped(value, path);
+      i = end + 1;
+    }
+  }
+  return true;
+}
+
+Pipeline::Pipeline(ConnectionPool* pool, const std::string& address)
+    : pool_(pool), address_(address), reused_(false) {}
+
+Pipeline::~Pipeline() {
+  // Requests added but never run are still in the buffer.
+  if (connection_ != nullptr && connection_->out.empty()) {
+    pool_->Release(address_, std::move(connection_));
+  }
+}
+
+void Pipeline::Add(std::string_view method,
+                   std::string_view path,
+                   const Message* request,
+                   Message* response,
+                   Status* status,
+                   bool protobuf) {
+  if (calls_.empty() && connection_ == nullptr) {
+    connection_ = pool_->Acquire(address_, &reused_, &open_status_.error);
+    if (connection_ != nullptr) {
+      connection_->out.clear();
+    }
+  }
+  calls_.push_back(Call{std::string(), std::string(), request, response,
+                        status,
+                        protobuf && method != "GET" &&
+                            !pool_->RefusesProtobuf(address_),
+                        false});
+  Call* call = &calls_.back();
+  if (call->protobuf) {
+    call->method.assign(method);
+    call->path.assign(path);
+  }
+  if (connection_ != nullptr) {
+    Write(method, path, call);
+  }
+}
+
+// Encodes `call` onto the end of the connection's buffer, or sets its
+// status if it can't be.
+void Pipeline::Write(std::string_view method, std::string_view path,
+                     Call* call) {
+  std::string error;
+  std::string_view body;
+  if (method == "GET") {
+    query_.assign(path);
+    if (!AppendQuery(*call->request, &query_, &error)) {
+      call->status->error = error;
+      return;
+    }
+    path = query_;
+  } else if (call->protobuf) {
+    wire_.clear();
+    call->request->SerializeToString(&wire_);
+    body = wire_;
+  } else {
+    const Transcoder* transcoder =
+        TranscoderFor(call->request->GetDescriptor(), &error);
+    wire_.clear();
+    json_.clear();
+    if (transcoder == nullptr ||
+        !call->request->SerializeToString(&wire_) ||
+        !transcoder->WireToJSON(wire_, &json_, &arena_, &error)) {
+      call->status->error = error;
+      return;
+    }
+    body = json_;
+  }
+
+  std::string& out = connection_->out;
+  out.append(method);
+  out += ' ';
+  out.append(path);
+  out += " HTTP/1.1\r\nHost: ";
+  out += connection_->host();
+  out += "\r\nAccept: ";
+  if (call->protobuf || method == "GET") {
+    out += kProtobufContentType;
+    out += ", ";
+    out += kJSONContentType;
+    out += ";q=0.5\r\n";
+  } else {
+    out += kJSONContentType;
+    out += "\r\n";
+  }
+  if (method != "GET") {
+    out += "Content-Type: ";
+    out += call->protobuf ? kProtobufContentType : kJSONContentType;
+    out += "\r\nContent-Length: ";
+    out += Number(body.size());
+    out += "\r\n";
+  }
+  out += "\r\n";
+  out.append(body);
+  call->sent = true;
+}
+
+void Pipeline::Fail(size_t from, const std::string& error) {
+  for (size_t i = from; i < calls_.size(); i++) {
+    if (calls_[i].sent) {
+      calls_[i].status->error = error;
+    }
+  }
+}
+
+// Writes the buffered requests and reads one response per call sent.
+// Returns false if nothing was read before the connection failed, so the
+// caller can retry on a fresh one.
+bool Pipeline::Send(Status* result) {
+  std::string error;
+  if (!WriteAll(connection_->fd(), connection_->out, &error)) {
+    connection_->broken = true;
+    result->error = error;
+    return false;
+  }
+
+  HttpMessage message;
+  bool read = false;
+  for (size_t i = 0; i < calls_.size(); i++) {
+    if (!calls_[i].sent) {
+      continue;
+    }
+    if (!connection_->reader()->Read(&message, &error)) {
+      connection_->broken = true;
+      result->error = error.empty() ? "connection closed" : error;
+      if (!read) {
+        return false;
+      }
+      Fail(i, result->error);
+      return true;
+    }
+    read = true;
+
+    Status* status = calls_[i].status;
+    size_t space = message.start_line.find(' ');
+    status->code = space == std::string::npos
+        ? 0 : atoi(message.start_line.c_str() + space + 1);
+    status->error.clear();
+    if (status->code < 200 || status->code >= 400) {
+      status->error = "HTTP " + Number(status->code);
+    } else if (message.content_type.compare(
+                   0, strlen(kProtobufContentType),
+                   kProtobufContentType) == 0) {
+      if (!calls_[i].response->ParseFromString(message.body)) {
+        status->error = "can't parse protobuf response";
+      }
+    } else {
+      const Transcoder* transcoder =
+          TranscoderFor(calls_[i].response->GetDescriptor(), &error);
+      wire_.clear();
+      if (transcoder == nullptr ||
+          !transcoder->JSONToWire(message.body, &wire_, &arena_, &error) ||
+          !calls_[i].response->ParseFromString(wire_)) {
+        status->error = "can't parse JSON response";
+      }
+    }
+
+    if (message.close && i + 1 < calls_.size()) {
+      connection_->broken = true;
+      result->error = "connection closed";
+      Fail(i + 1, result->error);
+      return true;
+    }
+    connection_->broken = message.close;
+  }
+  return true;
+}
+
+// Send(), and if a connection from the pool turns out to be closed, again
+// on a new one.  Calls that got no response have the error.
+bool Pipeline::SendOrReopen(Status* result) {
+  bool sent = Send(result);
+  if (!sent && reused_) {
+    // The server may have closed the idle connection; try a new one.
+    std::string out = std::move(connection_->out);
+    std::string error;
+    connection_ = Connection::Open(address_, pool_->timeout_ms(), &error);
+    reused_ = false;
+    if (connection_ == nullptr) {
+      result->error = error;
+    } else {
+      connection_->out = std::move(out);
+      result->error.clear();
+      sent = Send(result);
+    }
+  }
+  if (!sent) {
+    Fail(0, result->error);
+  }
+  return sent;
+}
+
+// Resends as JSON the protobuf bodies that got a 415, and remembers that
+// the address refused them.
+void Pipeline::ResendRefused(Status* result) {
+  std::vector<Call> refused;
+  for (Call& call : calls_) {
+    if (call.sent && call.protobuf && call.status->code == 415) {
+      refused.push_back(std::move(call));
+    }
+  }
+  if (refused.empty()) {
+    return;
+  }
+  pool_->SetRefusesProtobuf(address_);
+  calls_.swap(refused);
+  if (connection_ == nullptr || connection_->broken) {
+    connection_ = Connection::Open(address_, pool_->timeout_ms(),
+                                   &result->error);
+    reused_ = false;
+  }
+  for (Call& call : calls_) {
+    call.protobuf = false;
+    call.sent = false;
+    if (connection_ == nullptr) {
+      call.status->error = result->error;
+    }
+  }
+  if (connection_ == nullptr) {
+    return;
+  }
+  connection_->out.clear();
+  for (Call& call : calls_) {
+    Write(call.method, call.path, &call);
+  }
+  SendOrReopen(result);
+}
+
+Status Pipeline::Run() {
+  Status result;
+  if (connection_ == nullptr) {
+    result = open_status_;
+    for (Call& call : calls_) {
+      call.status->error = result.error;
+    }
+  } else if (!calls_.empty() && SendOrReopen(&result)) {
+    ResendRefused(&result);
+  }
+  calls_.clear();
+  open_status_ = Status();
+  if (connection_ != nullptr) {
+    connection_->out.clear();
+    pool_->Release(address_, std::move(connection_));
+  }
+  return result;
+}
+
+}  // namespace dx
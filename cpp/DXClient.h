@@ -0,0 +1,205 @@
+// Support code shared by the generated C++ clients (*.client.h).  Plain
+// HTTP/1.1 over keep-alive connections.  Bodies are the protobuf wire format
+// or, for methods with the JSON wire_format, the JSON that the
+// protoc-gen-objcjson classes read and write (see DXTranscoder.h).  Either
+// kind of response is accepted.
+
+#ifndef DX_CLIENT_H__
+#define DX_CLIENT_H__
+
+#include <stddef.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include "DXTranscoder.h"
+
+namespace dx {
+
+extern const char kProtobufContentType[];
+extern const char kJSONContentType[];
+
+struct Status {
+  int code = 0;       // the HTTP status, or 0 if there was no response
+  std::string error;  // empty on success
+
+  bool ok() const { return error.empty(); }
+};
+
+// One HTTP message as read off a connection.
+struct HttpMessage {
+  std::string start_line;
+  std::string content_type;
+  bool close = false;  // "Connection: close"
+  std::string body;
+};
+
+// Buffered reads of HTTP/1.1 messages from a socket; bodies are delimited
+// by Content-Length or chunked encoding.
+class HttpReader {
+ public:
+  explicit HttpReader(int fd) : fd_(fd), pos_(0) {}
+
+  // False at the end of the stream (with an empty error) or on a read
+  // error or malformed message.
+  bool Read(HttpMessage* message, std::string* error);
+
+  // Whether anything has been read since the last Read() returned.
+  bool started() const { return pos_ < buffer_.size(); }
+
+ private:
+  bool Fill(std::string* error);
+  bool ReadLine(std::string* line, std::string* error);
+  bool ReadBytes(size_t n, std::string* out, std::string* error);
+
+  int fd_;
+  std::string buffer_;
+  size_t pos_;
+};
+
+// Writes all of `data` to `fd`.
+bool WriteAll(int fd, std::string_view data, std::string* error);
+
+// An open keep-alive connection to one host.
+class Connection {
+ public:
+  ~Connection();
+
+  // "http://host:port"; the port defaults to 80.  HTTPS isn't supported.
+  static std::unique_ptr<Connection> Open(const std::string& address,
+                                          int timeout_ms,
+                                          std::string* error);
+
+  int fd() const { return fd_; }
+  const std::string& host() const { return host_; }
+  HttpReader* reader() { return &reader_; }
+
+  // Set once the connection can't carry another request.
+  bool broken = false;
+
+  // Requests are built here and kept until their responses are read, so a
+  // stale connection's requests can be resent.  Reused across pipelines.
+  std::string out;
+
+ private:
+  Connection(int fd, const std::string& host) : fd_(fd), host_(host),
+                                                reader_(fd) {}
+
+  int fd_;
+  std::string host_;
+  HttpReader reader_;
+};
+
+// Idle connections by address, kept for the next call to the same one.
+class ConnectionPool {
+ public:
+  explicit ConnectionPool(size_t max_idle_per_address = 8,
+                          int timeout_ms = 30000)
+      : max_idle_(max_idle_per_address), timeout_ms_(timeout_ms) {}
+
+  static ConnectionPool* Default();
+
+  // An idle connection to `address`, or a new one.  `reused` says which.
+  std::unique_ptr<Connection> Acquire(const std::string& address,
+                                      bool* reused,
+                                      std::string* error);
+
+  // Keeps `connection` for later unless it's broken or the pool is full.
+  void Release(const std::string& address,
+               std::unique_ptr<Connection> connection);
+
+  // Addresses that answered a protobuf body with 415 get JSON from then on,
+  // as with the Objective-C clients.
+  bool RefusesProtobuf(const std::string& address);
+  void SetRefusesProtobuf(const std::string& address);
+
+  int timeout_ms() const { return timeout_ms_; }
+
+ private:
+  std::mutex mu_;
+  std::map<std::string, std::vector<std::unique_ptr<Connection>>> idle_;
+  std::set<std::string> refuses_protobuf_;
+  size_t max_idle_;
+  int timeout_ms_;
+};
+
+// The Transcoder for `type`, made on first use and kept; nullptr with
+// `error` set if the type can't be transcoded.
+const Transcoder* TranscoderFor(const google::protobuf::Descriptor* type,
+                                std::string* error);
+
+// Appends a GET request's fields to `path` as a query string, the way
+// DXQueryString() does with [request toDict] for the Objective-C clients:
+// camel-case keys in sorted order, repeated fields as repeated keys, and
+// values as the JSON plugin writes them, with messages and dx_map_key
+// fields as JSON objects and dx_json_packed fields as base64 strings.
+bool AppendQuery(const google::protobuf::Message& request,
+                 std::string* path,
+                 std::string* error);
+
+// Calls to one address, written back to back on a single connection and
+// answered in order.  Each Add() encodes its request straight into the
+// connection's buffer; Run() sends them all and fills in the responses.
+// A connection from the pool that turns out to be closed is replaced, and
+// the requests resent, once.  Protobuf bodies answered with 415 are resent
+// as JSON.  After Run() the pipeline can take more calls.
+class Pipeline {
+ public:
+  Pipeline(ConnectionPool* pool, const std::string& address);
+  ~Pipeline();
+
+  // GETs carry `request` in the query string, and other methods in the
+  // body: as protobuf if `protobuf` is set and the address hasn't refused
+  // it, else as JSON.  `request`, `response` and `status` must outlive
+  // Run().
+  void Add(std::string_view method,
+           std::string_view path,
+           const google::protobuf::Message* request,
+           google::protobuf::Message* response,
+           Status* status,
+           bool protobuf);
+
+  // The error that stopped the pipeline, if any; it's also in the status
+  // of every call that didn't get a response.
+  Status Run();
+
+ private:
+  struct Call {
+    std::string method;  // protobuf bodies only, for a resend as JSON
+    std::string path;
+    const google::protobuf::Message* request;
+    google::protobuf::Message* response;
+    Status* status;
+    bool protobuf;  // the body went out as protobuf
+    bool sent;      // false if the request couldn't be encoded
+  };
+
+  void Write(std::string_view method, std::string_view path, Call* call);
+  bool Send(Status* result);
+  bool SendOrReopen(Status* result);
+  void ResendRefused(Status* result);
+  void Fail(size_t from, const std::string& error);
+
+  ConnectionPool* pool_;
+  std::string address_;
+  std::unique_ptr<Connection> connection_;
+  bool reused_;
+  Status open_status_;
+  std::vector<Call> calls_;
+
+  // Scratch space for encoding, kept between calls.
+  std::string query_;
+  std::string wire_;
+  std::string json_;
+  Arena arena_;
+};
+
+}  // namespace dx
+
+#endif  // DX_CLIENT_H__
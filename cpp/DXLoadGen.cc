@@ -0,0 +1,506 @@
+#include "DXLoadGen.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <google/protobuf/descriptor.h>
+
+#include "DXStandinServer.h"
+
+namespace dx {
+
+using google::protobuf::Descriptor;
+using google::protobuf::EnumDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+typedef std::chrono::steady_clock Clock;
+
+Histogram::Histogram(int64_t max_value, int significant_digits)
+    : max_value_(max_value) {
+  int64_t largest_exact = 2;
+  for (int i = 0; i < significant_digits; i++) {
+    largest_exact *= 10;
+  }
+  sub_bucket_bits_ = 1;
+  while ((int64_t(1) << sub_bucket_bits_) < largest_exact) {
+    sub_bucket_bits_++;
+  }
+  sub_bucket_half_ = int64_t(1) << (sub_bucket_bits_ - 1);
+  counts_.resize(IndexOf(max_value) + 1);
+}
+
+// Bucket 0 holds 0 to 2 * half - 1 exactly; each bucket after it covers
+// twice the range of the one before with the upper half of its
+// sub-buckets, so indexes run on without gaps.
+size_t Histogram::IndexOf(int64_t value) const {
+  int64_t sub_bucket_mask = (int64_t(1) << sub_bucket_bits_) - 1;
+  int magnitude = 63 - __builtin_clzll(uint64_t(value | sub_bucket_mask));
+  int bucket = magnitude - (sub_bucket_bits_ - 1);
+  return size_t(bucket * sub_bucket_half_ + (value >> bucket));
+}
+
+int64_t Histogram::HighestEquivalent(size_t index) const {
+  if (int64_t(index) < 2 * sub_bucket_half_) {
+    return int64_t(index);
+  }
+  int bucket = int(index / sub_bucket_half_) - 1;
+  int64_t sub_bucket = int64_t(index) - bucket * sub_bucket_half_;
+  return ((sub_bucket + 1) << bucket) - 1;
+}
+
+void Histogram::Record(int64_t value) {
+  if (value < 0) {
+    value = 0;
+  } else if (value > max_value_) {
+    value = max_value_;
+  }
+  counts_[IndexOf(value)]++;
+  count_++;
+  sum_ += value;
+  if (value < min_) {
+    min_ = value;
+  }
+  if (value > max_) {
+    max_ = value;
+  }
+}
+
+void Histogram::Merge(const Histogram& other) {
+  for (size_t i = 0; i < counts_.size() && i < other.counts_.size(); i++) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  if (other.count_ > 0) {
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+}
+
+int64_t Histogram::ValueAtPercentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  int64_t rank = int64_t(percentile / 100 * count_ + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  int64_t seen = 0;
+  for (size_t i = 0; i < counts_.size(); i++) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      return std::min(HighestEquivalent(i), max_);
+    }
+  }
+  return max_;
+}
+
+static std::string RandomString(int size, std::mt19937_64* rng) {
+  static const char kChars[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  std::string s(size, ' ');
+  for (int i = 0; i < size; i++) {
+    s[i] = kChars[(*rng)() % (sizeof(kChars) - 1)];
+  }
+  return s;
+}
+
+static std::string RandomBytes(int size, std::mt19937_64* rng) {
+  std::string s(size, '\0');
+  for (int i = 0; i < size; i++) {
+    s[i] = char((*rng)());
+  }
+  return s;
+}
+
+static void SynthesizeAt(Message* message, const SynthOptions& options,
+                         std::mt19937_64* rng, int depth) {
+  const Descriptor* descriptor = message->GetDescriptor();
+  const Reflection* r = message->GetReflection();
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    const FieldDescriptor* field = descriptor->field(i);
+    bool is_message = field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE;
+    if (is_message && depth >= options.max_depth) {
+      continue;
+    }
+    int n = field->is_repeated() ? options.repeated_count : 1;
+    for (int j = 0; j < n; j++) {
+      bool rep = field->is_repeated();
+      // Small non-negative numbers, so that sizes and ids stay plausible.
+      uint64_t number = (*rng)() % 1000;
+      double real = double((*rng)() % 100000) / 100;
+      switch (field->cpp_type()) {
+        case FieldDescriptor::CPPTYPE_INT32:
+          rep ? r->AddInt32(message, field, int32_t(number))
+              : r->SetInt32(message, field, int32_t(number));
+          break;
+        case FieldDescriptor::CPPTYPE_INT64:
+          rep ? r->AddInt64(message, field, int64_t(number))
+              : r->SetInt64(message, field, int64_t(number));
+          break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+          rep ? r->AddUInt32(message, field, uint32_t(number))
+              : r->SetUInt32(message, field, uint32_t(number));
+          break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+          rep ? r->AddUInt64(message, field, number)
+              : r->SetUInt64(message, field, number);
+          break;
+        case FieldDescriptor::CPPTYPE_FLOAT:
+          rep ? r->AddFloat(message, field, float(real))
+              : r->SetFloat(message, field, float(real));
+          break;
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+          rep ? r->AddDouble(message, field, real)
+              : r->SetDouble(message, field, real);
+          break;
+        case FieldDescriptor::CPPTYPE_BOOL:
+          rep ? r->AddBool(message, field, number & 1)
+              : r->SetBool(message, field, number & 1);
+          break;
+        case FieldDescriptor::CPPTYPE_ENUM: {
+          const EnumDescriptor* type = field->enum_type();
+          int value = type->value(int(number % type->value_count()))->number();
+          rep ? r->AddEnumValue(message, field, value)
+              : r->SetEnumValue(message, field, value);
+          break;
+        }
+        case FieldDescriptor::CPPTYPE_STRING: {
+          std::string s = field->type() == FieldDescriptor::TYPE_BYTES
+              ? RandomBytes(options.string_size, rng)
+              : RandomString(options.string_size, rng);
+          rep ? r->AddString(message, field, s)
+              : r->SetString(message, field, s);
+          break;
+        }
+        case FieldDescriptor::CPPTYPE_MESSAGE:
+          SynthesizeAt(rep ? r->AddMessage(message, field)
+                           : r->MutableMessage(message, field),
+                       options, rng, depth + 1);
+          break;
+      }
+    }
+  }
+}
+
+void Synthesize(Message* message, const SynthOptions& options,
+                std::mt19937_64* rng) {
+  SynthesizeAt(message, options, rng, 0);
+}
+
+// The names of the path variables in `path`, "/user/:userId" -> {"userId"}.
+static std::vector<std::string> PathArgs(const std::string& path) {
+  std::vector<std::string> args;
+  size_t pos = 0;
+  while ((pos = path.find(':', pos)) != std::string::npos) {
+    size_t end = path.find('/', pos);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    args.push_back(path.substr(pos + 1, end - pos - 1));
+    pos = end;
+  }
+  return args;
+}
+
+// A path variable takes the request field of the same name if there is
+// one, so that the path and the body agree.
+static std::string ArgValue(const Message& request, const std::string& arg,
+                            std::mt19937_64* rng) {
+  const FieldDescriptor* field =
+      request.GetDescriptor()->FindFieldByCamelcaseName(arg);
+  const Reflection* r = request.GetReflection();
+  if (field != NULL && !field->is_repeated() && r->HasField(request, field)) {
+    switch (field->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_STRING:
+        return r->GetString(request, field);
+      case FieldDescriptor::CPPTYPE_INT32:
+        return std::to_string(r->GetInt32(request, field));
+      case FieldDescriptor::CPPTYPE_INT64:
+        return std::to_string(r->GetInt64(request, field));
+      case FieldDescriptor::CPPTYPE_UINT32:
+        return std::to_string(r->GetUInt32(request, field));
+      case FieldDescriptor::CPPTYPE_UINT64:
+        return std::to_string(r->GetUInt64(request, field));
+      default:
+        break;
+    }
+  }
+  return RandomString(8, rng);
+}
+
+// Whether `path`, less its query, fits the template "/user/:userId".
+static bool PathMatches(const std::string& pattern, std::string path) {
+  path = path.substr(0, path.find('?'));
+  size_t p = 0;
+  size_t q = 0;
+  while (p < pattern.size() && q <= path.size()) {
+    if (pattern[p] == ':') {
+      size_t slash = path.find('/', q);
+      if (slash == q) {
+        return false;  // variables don't match empty segments
+      }
+      q = slash == std::string::npos ? path.size() : slash;
+      p = pattern.find('/', p);
+      if (p == std::string::npos) {
+        p = pattern.size();
+      }
+    } else if (q < path.size() && pattern[p] == path[q]) {
+      p++;
+      q++;
+    } else {
+      return false;
+    }
+  }
+  return p == pattern.size() && q == path.size();
+}
+
+struct Flags {
+  std::string target;
+  double rate = 0;
+  int concurrency = 8;
+  double duration = 10;
+  std::string methods;
+  int requests = 64;
+  uint64_t seed = 1;
+  SynthOptions synth;
+};
+
+static void Usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [flags]\n"
+          "  --target=http://host:port  server to load; without it, a local\n"
+          "                             stand-in server answers\n"
+          "  --rate=N          requests per second over all methods; 0 sends\n"
+          "                    as fast as --concurrency allows (default 0)\n"
+          "  --concurrency=N   requests in flight at most (default 8)\n"
+          "  --duration=S      seconds to run (default 10)\n"
+          "  --methods=A,B     only methods whose names contain A or B\n"
+          "  --requests=N      distinct requests per method (default 64)\n"
+          "  --string-size=N   characters per string or bytes field (16)\n"
+          "  --repeated=N      elements per repeated field (4)\n"
+          "  --depth=N         levels of nested messages to fill in (3)\n"
+          "  --seed=N          for the random requests (1)\n",
+          argv0);
+}
+
+static bool ParseFlags(int argc, char* argv[], Flags* flags) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      return false;
+    }
+    std::string name = arg.substr(2, eq - 2);
+    const char* value = argv[i] + eq + 1;
+    if (name == "target") {
+      flags->target = value;
+    } else if (name == "rate") {
+      flags->rate = atof(value);
+    } else if (name == "concurrency") {
+      flags->concurrency = atoi(value);
+    } else if (name == "duration") {
+      flags->duration = atof(value);
+    } else if (name == "methods") {
+      flags->methods = value;
+    } else if (name == "requests") {
+      flags->requests = atoi(value);
+    } else if (name == "string-size") {
+      flags->synth.string_size = atoi(value);
+    } else if (name == "repeated") {
+      flags->synth.repeated_count = atoi(value);
+    } else if (name == "depth") {
+      flags->synth.max_depth = atoi(value);
+    } else if (name == "seed") {
+      flags->seed = strtoull(value, NULL, 10);
+    } else {
+      return false;
+    }
+  }
+  return flags->concurrency > 0 && flags->requests > 0 &&
+         flags->duration > 0 && flags->rate >= 0;
+}
+
+static bool Selected(const std::string& filter, const char* name) {
+  if (filter.empty()) {
+    return true;
+  }
+  size_t start = 0;
+  while (start <= filter.size()) {
+    size_t comma = filter.find(',', start);
+    if (comma == std::string::npos) {
+      comma = filter.size();
+    }
+    std::string part = filter.substr(start, comma - start);
+    if (!part.empty() && strstr(name, part.c_str()) != NULL) {
+      return true;
+    }
+    start = comma + 1;
+  }
+  return false;
+}
+
+// A method under load, with its synthesized requests and what it got.
+struct MethodLoad {
+  const LoadMethod* method;
+  std::vector<std::unique_ptr<Message>> requests;
+  std::vector<std::vector<std::string>> args;
+  std::string response;  // what the stand-in server answers
+
+  // Recording is cheap next to a round trip, so the workers share these.
+  std::mutex mu;
+  Histogram latency;  // microseconds
+  int64_t errors = 0;
+  std::string last_error;
+};
+
+int LoadMain(int argc, char* argv[], const LoadMethod* methods,
+             size_t count) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  std::mt19937_64 rng(flags.seed);
+  std::vector<std::unique_ptr<MethodLoad>> loads;
+  for (size_t i = 0; i < count; i++) {
+    if (!Selected(flags.methods, methods[i].name)) {
+      continue;
+    }
+    std::unique_ptr<MethodLoad> load(new MethodLoad);
+    load->method = &methods[i];
+    std::vector<std::string> names = PathArgs(methods[i].path);
+    for (int j = 0; j < flags.requests; j++) {
+      std::unique_ptr<Message> request(methods[i].request_prototype->New());
+      Synthesize(request.get(), flags.synth, &rng);
+      std::vector<std::string> values;
+      for (const std::string& name : names) {
+        values.push_back(ArgValue(*request, name, &rng));
+      }
+      load->requests.push_back(std::move(request));
+      load->args.push_back(values);
+    }
+    std::unique_ptr<Message> response(methods[i].response_prototype->New());
+    Synthesize(response.get(), flags.synth, &rng);
+    load->response = response->SerializeAsString();
+    loads.push_back(std::move(load));
+  }
+  if (loads.empty()) {
+    fprintf(stderr, "No methods match --methods=%s\n", flags.methods.c_str());
+    return 2;
+  }
+
+  std::unique_ptr<StandinServer> standin;
+  std::string target = flags.target;
+  if (target.empty()) {
+    standin.reset(new StandinServer(
+        [&loads](const StandinServer::Request& request,
+                 StandinServer::Response* response) {
+          for (const std::unique_ptr<MethodLoad>& load : loads) {
+            if (request.method == load->method->http_method &&
+                PathMatches(load->method->path, request.path)) {
+              response->body = load->response;
+              return;
+            }
+          }
+          response->status = 404;
+        }));
+    std::string error;
+    if (!standin->Start(&error)) {
+      fprintf(stderr, "Can't start the stand-in server: %s\n",
+              error.c_str());
+      return 1;
+    }
+    target = standin->address();
+  }
+
+  if (flags.rate > 0) {
+    printf("Loading %s at %.0f requests/s, at most %d at a time, for %gs\n",
+           target.c_str(), flags.rate, flags.concurrency, flags.duration);
+  } else {
+    printf("Loading %s with %d requests at a time for %gs\n",
+           target.c_str(), flags.concurrency, flags.duration);
+  }
+
+  // Every request gets a slot; methods take turns.  At a fixed rate, a
+  // slot's latency counts from when it was due rather than when it went
+  // out, so a stalled server isn't hidden by requests that wait their
+  // turn behind it.
+  ConnectionPool pool(flags.concurrency);
+  std::atomic<int64_t> next_slot(0);
+  Clock::time_point start = Clock::now();
+  Clock::time_point end =
+      start + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(flags.duration));
+  std::vector<std::thread> threads;
+  for (int w = 0; w < flags.concurrency; w++) {
+    threads.push_back(std::thread([&]() {
+      while (true) {
+        int64_t slot = next_slot++;
+        Clock::time_point sent;
+        if (flags.rate > 0) {
+          sent = start + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>(slot / flags.rate));
+          if (sent >= end) {
+            return;
+          }
+          std::this_thread::sleep_until(sent);
+        } else {
+          sent = Clock::now();
+          if (sent >= end) {
+            return;
+          }
+        }
+        MethodLoad& load = *loads[slot % loads.size()];
+        size_t r = (slot / loads.size()) % load.requests.size();
+        Status status = load.method->call(target, &pool, *load.requests[r],
+                                          load.args[r]);
+        int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - sent).count();
+        std::lock_guard<std::mutex> lock(load.mu);
+        load.latency.Record(micros);
+        if (!status.ok()) {
+          load.errors++;
+          load.last_error = status.error;
+        }
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  printf("\n%-32s %9s %7s %9s %9s %9s %9s %9s %9s\n", "method (ms)", "count",
+         "errors", "req/s", "p50", "p90", "p99", "p99.9", "max");
+  for (const std::unique_ptr<MethodLoad>& load : loads) {
+    const Histogram& h = load->latency;
+    printf("%-32s %9lld %7lld %9.1f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+           load->method->name, (long long)h.count(), (long long)load->errors,
+           h.count() / elapsed, h.ValueAtPercentile(50) / 1000.0,
+           h.ValueAtPercentile(90) / 1000.0, h.ValueAtPercentile(99) / 1000.0,
+           h.ValueAtPercentile(99.9) / 1000.0, h.max() / 1000.0);
+  }
+  for (const std::unique_ptr<MethodLoad>& load : loads) {
+    if (load->errors > 0) {
+      printf("%s: %s\n", load->method->name, load->last_error.c_str());
+    }
+  }
+
+  if (standin != nullptr) {
+    standin->Stop();
+  }
+  return 0;
+}
+
+}  // namespace dx
@@ -0,0 +1,95 @@
+// Support code for the load generators that protoc-gen-cppclient writes
+// with loadgen=true (*.loadgen.cc).  Requests are synthesized from the
+// input message descriptors, sent through the generated clients at a fixed
+// rate or a fixed concurrency, and their latencies kept in HDR histograms.
+
+#ifndef DX_LOADGEN_H__
+#define DX_LOADGEN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include "DXClient.h"
+
+namespace dx {
+
+// A high-dynamic-range histogram: buckets are exact up to 2 *
+// 10^significant_digits and keep that many significant digits above, so
+// the memory is fixed whatever the range of values.
+class Histogram {
+ public:
+  // The default range is a minute in microseconds.
+  explicit Histogram(int64_t max_value = 60000000,
+                     int significant_digits = 3);
+
+  // Values above max_value are recorded as max_value.
+  void Record(int64_t value);
+
+  // `other` must have the same max_value and significant_digits.
+  void Merge(const Histogram& other);
+
+  int64_t count() const { return count_; }
+  int64_t min() const { return count_ > 0 ? min_ : 0; }
+  int64_t max() const { return max_; }
+  double mean() const { return count_ > 0 ? double(sum_) / count_ : 0; }
+
+  // The highest value equivalent to the one at `percentile` (0 to 100).
+  int64_t ValueAtPercentile(double percentile) const;
+
+ private:
+  size_t IndexOf(int64_t value) const;
+  int64_t HighestEquivalent(size_t index) const;
+
+  int64_t max_value_;
+  int sub_bucket_bits_;  // log2 of the sub-buckets in bucket 0
+  int64_t sub_bucket_half_;
+  std::vector<int64_t> counts_;
+  int64_t count_ = 0;
+  int64_t min_ = INT64_MAX;
+  int64_t max_ = 0;
+  int64_t sum_ = 0;
+};
+
+// Size and cardinality knobs for synthesized messages.
+struct SynthOptions {
+  int string_size = 16;     // characters in strings, bytes in bytes fields
+  int repeated_count = 4;   // elements in repeated fields
+  int max_depth = 3;        // message fields below this are left unset
+};
+
+// Sets every field of `message` to a random valid value: enums get one of
+// their values, strings printable characters.
+void Synthesize(google::protobuf::Message* message,
+                const SynthOptions& options,
+                std::mt19937_64* rng);
+
+// One generated method: how to call it and what it takes.
+struct LoadMethod {
+  const char* name;         // "Service.Method"
+  const char* http_method;  // "GET" or "POST"
+  const char* path;         // "/user/:userId/balance"
+  const google::protobuf::Message* request_prototype;
+  const google::protobuf::Message* response_prototype;
+
+  // Sends `request` to `address` with `args` for the path variables, in
+  // the order they appear in the path.
+  Status (*call)(const std::string& address,
+                 ConnectionPool* pool,
+                 const google::protobuf::Message& request,
+                 const std::vector<std::string>& args);
+};
+
+// The main() of a generated load generator; run it with --help for the
+// flags.  Without --target it starts a StandinServer, answering each
+// method with a synthesized response, and loads that.
+int LoadMain(int argc, char* argv[], const LoadMethod* methods, size_t count);
+
+}  // namespace dx
+
+#endif  // DX_LOADGEN_H__
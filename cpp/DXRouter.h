@@ -0,0 +1,53 @@
+// Support code shared by the generated C++ routers (*.router.h).
+
+#ifndef DX_ROUTER_H__
+#define DX_ROUTER_H__
+
+#include <stddef.h>
+#include <string_view>
+
+namespace dx {
+
+enum class RouteResult {
+  kHandled,
+  kNotImplemented,    // the handler returned false
+  kMethodNotAllowed,  // the path matched, but not for this method
+  kNotFound,
+};
+
+// What a handler's return value means to the dispatcher.
+inline RouteResult Handled(bool handled) {
+  return handled ? RouteResult::kHandled : RouteResult::kNotImplemented;
+}
+
+// Splits "/a/b?x=1" into {"a", "b"} and returns how many segments there
+// are.  The segments point into `path`.  Returns max + 1 for a path with
+// more than `max` segments, or one that doesn't start with '/'; only the
+// first `max` are stored.
+inline size_t SplitPath(std::string_view path,
+                        std::string_view* segments,
+                        size_t max) {
+  path = path.substr(0, path.find('?'));
+  if (path.empty() || path[0] != '/') {
+    return max + 1;
+  }
+  size_t n = 0;
+  size_t start = 1;
+  while (true) {
+    size_t end = path.find('/', start);
+    if (n == max) {
+      return max + 1;
+    }
+    segments[n++] = path.substr(start, end == std::string_view::npos
+                                           ? std::string_view::npos
+                                           : end - start);
+    if (end == std::string_view::npos) {
+      return n;
+    }
+    start = end + 1;
+  }
+}
+
+}  // namespace dx
+
+#endif  // DX_ROUTER_H__
@@ -0,0 +1,189 @@
+#include "DXStandinServer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "DXClient.h"
+
+namespace dx {
+
+StandinServer::StandinServer(Handler handler)
+    : handler_(handler), listen_fd_(-1), port_(0), connections_(0),
+      requests_(0) {
+  stop_pipe_[0] = stop_pipe_[1] = -1;
+}
+
+StandinServer::~StandinServer() {
+  Stop();
+}
+
+bool StandinServer::Start(std::string* error, int port) {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    error->assign(strerror(errno));
+    return false;
+  }
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  socklen_t len = sizeof(addr);
+  if (bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd_, 128) != 0 ||
+      getsockname(listen_fd_, (struct sockaddr*)&addr, &len) != 0) {
+    error->assign(strerror(errno));
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  port_ = ntohs(addr.sin_port);
+  // Non-blocking, so accept() can't hang on a client that left after
+  // poll() saw it.
+  fcntl(listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL) | O_NONBLOCK);
+  if (pipe(stop_pipe_) != 0) {
+    error->assign(strerror(errno));
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  accept_thread_ = std::thread(&StandinServer::Accept, this);
+  return true;
+}
+
+void StandinServer::Stop() {
+  if (listen_fd_ < 0) {
+    return;
+  }
+  // Accept() waits on the pipe as well as the listening socket, since
+  // neither shutdown() nor close() wakes a blocked accept() everywhere.
+  char stop = 0;
+  while (write(stop_pipe_[1], &stop, 1) < 0 && errno == EINTR) {
+  }
+  accept_thread_.join();
+  close(listen_fd_);
+  close(stop_pipe_[0]);
+  close(stop_pipe_[1]);
+  listen_fd_ = stop_pipe_[0] = stop_pipe_[1] = -1;
+
+  // Shutting the connections down wakes the threads reading them.
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    threads.swap(finished_);
+    for (auto& entry : threads_) {
+      shutdown(entry.first, SHUT_RDWR);
+      threads.push_back(std::move(entry.second));
+    }
+    threads_.clear();
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+std::string StandinServer::address() const {
+  return "http://127.0.0.1:" + std::to_string(port_);
+}
+
+void StandinServer::Accept() {
+  struct pollfd fds[2];
+  fds[0].fd = listen_fd_;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_pipe_[0];
+  fds[1].events = POLLIN;
+  while (true) {
+    fds[0].revents = fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (fds[1].revents != 0) {
+      return;
+    }
+    if (fds[0].revents == 0) {
+      continue;
+    }
+    int fd = accept(listen_fd_, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ||
+          errno == EWOULDBLOCK) {
+        continue;
+      }
+      return;
+    }
+    // Some systems pass O_NONBLOCK on from the listening socket.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    connections_++;
+    // Threads that have finished serving are joined here, so a long run
+    // holds one thread per open connection, not per connection made.
+    std::vector<std::thread> finished;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      finished.swap(finished_);
+      threads_[fd] = std::thread(&StandinServer::Serve, this, fd);
+    }
+    for (std::thread& thread : finished) {
+      thread.join();
+    }
+  }
+}
+
+void StandinServer::Serve(int fd) {
+  HttpReader reader(fd);
+  HttpMessage message;
+  std::string error;
+  std::string out;
+  while (reader.Read(&message, &error)) {
+    Request request;
+    size_t space = message.start_line.find(' ');
+    size_t space2 = message.start_line.find(' ', space + 1);
+    if (space == std::string::npos || space2 == std::string::npos) {
+      break;
+    }
+    request.method = message.start_line.substr(0, space);
+    request.path = message.start_line.substr(space + 1, space2 - space - 1);
+    request.content_type = message.content_type;
+    request.body.swap(message.body);
+
+    Response response;
+    handler_(request, &response);
+    requests_++;
+
+    out = "HTTP/1.1 " + std::to_string(response.status) +
+          (response.status < 400 ? " OK" : " Error") +
+          "\r\nContent-Type: " + response.content_type +
+          "\r\nContent-Length: " + std::to_string(response.body.size()) +
+          (message.close ? "\r\nConnection: close" : "") + "\r\n\r\n";
+    out += response.body;
+    if (!WriteAll(fd, out, &error) || message.close) {
+      break;
+    }
+  }
+
+  // Accept() adds this thread to threads_ before it can get here; Stop()
+  // may have taken it already, and then joins it itself.
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = threads_.find(fd);
+  if (it != threads_.end()) {
+    finished_.push_back(std::move(it->second));
+    threads_.erase(it);
+  }
+  close(fd);
+}
+
+}  // namespace dx
@@ -0,0 +1,70 @@
+// A loopback HTTP/1.1 server that stands in for a backend when testing or
+// load-testing generated clients.  Keep-alive and pipelined requests work
+// as they would against the real thing.
+
+#ifndef DX_STANDIN_SERVER_H__
+#define DX_STANDIN_SERVER_H__
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dx {
+
+class StandinServer {
+ public:
+  struct Request {
+    std::string method;
+    std::string path;  // with the query string
+    std::string content_type;
+    std::string body;
+  };
+
+  struct Response {
+    int status = 200;
+    std::string content_type = "application/x-protobuf";
+    std::string body;
+  };
+
+  // Called for every request, on the connection's own thread.
+  typedef std::function<void(const Request&, Response*)> Handler;
+
+  explicit StandinServer(Handler handler);
+  ~StandinServer();
+
+  // Listens on 127.0.0.1 at `port`, or a free one if 0.
+  bool Start(std::string* error, int port = 0);
+  void Stop();
+
+  int port() const { return port_; }
+
+  // "http://127.0.0.1:<port>", for the generated clients.
+  std::string address() const;
+
+  // Connections accepted and requests answered so far.
+  int connections() const { return connections_; }
+  int requests() const { return requests_; }
+
+ private:
+  void Accept();
+  void Serve(int fd);
+
+  Handler handler_;
+  int listen_fd_;
+  int stop_pipe_[2];  // written to by Stop() to end Accept()
+  int port_;
+  std::thread accept_thread_;
+  std::mutex mu_;
+  std::map<int, std::thread> threads_;  // by connection fd
+  std::vector<std::thread> finished_;   // done serving, to be joined
+  std::atomic<int> connections_;
+  std::atomic<int> requests_;
+};
+
+}  // namespace dx
+
+#endif  // DX_STANDIN_SERVER_H__
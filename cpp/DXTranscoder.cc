@@ -0,0 +1,1780 @@
+#include "DXTranscoder.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <charconv>
+#include <map>
+#include <type_traits>
+
+#include "google/protobuf/dx_options.pb.h"  // for dx_map_key and friends
+
+namespace dx {
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+
+// Deeper input is rejected rather than risking the stack.
+static const int kMaxDepth = 100;
+
+// Field numbers below this are looked up in a flat table.
+static const uint32_t kDenseNumbers = 1024;
+
+Arena::~Arena() {
+  for (Block& block : blocks_) {
+    free(block.data);
+  }
+}
+
+void* Arena::Allocate(size_t size) {
+  size = (size + 7) & ~size_t(7);
+  while (current_ < blocks_.size()) {
+    Block& block = blocks_[current_];
+    if (block.size - used_ >= size) {
+      void* p = block.data + used_;
+      used_ += size;
+      return p;
+    }
+    current_++;
+    used_ = 0;
+  }
+  size_t block_size = std::max(block_size_, size);
+  blocks_.push_back(Block{static_cast<char*>(malloc(block_size)), block_size});
+  current_ = blocks_.size() - 1;
+  used_ = size;
+  return blocks_.back().data;
+}
+
+void Arena::Reset() {
+  current_ = 0;
+  used_ = 0;
+}
+
+// ---- JSON ----------------------------------------------------------------
+
+// The C++ twin of DXJSONReader in DXJSONRuntime.m, with the same leniency:
+// quoted numbers, null for absent values, and a sticky failure that parks
+// the cursor at the end so every loop stops.
+struct JSONReader {
+  const char* start;
+  const char* p;
+  const char* end;
+  bool failed = false;
+  size_t error_offset = 0;
+  // True just after a '{' or '[', where the next member or element takes
+  // no ',' before it.
+  bool first = false;
+};
+
+static void Fail(JSONReader* r) {
+  if (!r->failed) {
+    r->failed = true;
+    r->error_offset = r->p - r->start;
+  }
+  r->p = r->end;
+}
+
+static void SkipSpace(JSONReader* r) {
+  while (r->p < r->end &&
+         (*r->p == ' ' || *r->p == '\n' || *r->p == '\r' || *r->p == '\t')) {
+    r->p++;
+  }
+}
+
+static bool Consume(JSONReader* r, char c) {
+  SkipSpace(r);
+  if (r->p < r->end && *r->p == c) {
+    r->p++;
+    return true;
+  }
+  return false;
+}
+
+static bool ConsumeLiteral(JSONReader* r, const char* lit, size_t len) {
+  SkipSpace(r);
+  if (size_t(r->end - r->p) >= len && memcmp(r->p, lit, len) == 0) {
+    r->p += len;
+    return true;
+  }
+  return false;
+}
+
+static bool ReadNull(JSONReader* r) {
+  return ConsumeLiteral(r, "null", 4);
+}
+
+// Consume '{' and return true, or consume `null` and return false.
+static bool ReadObjectStart(JSONReader* r) {
+  if (Consume(r, '{')) {
+    r->first = true;
+    return true;
+  }
+  if (!ReadNull(r)) {
+    Fail(r);
+  }
+  return false;
+}
+
+static bool ReadArrayStart(JSONReader* r) {
+  if (Consume(r, '[')) {
+    r->first = true;
+    return true;
+  }
+  if (!ReadNull(r)) {
+    Fail(r);
+  }
+  return false;
+}
+
+static bool ReadArrayNext(JSONReader* r) {
+  bool first = r->first;
+  r->first = false;
+  if (Consume(r, ']') || r->failed) {
+    return false;
+  }
+  if (!first && !Consume(r, ',')) {
+    Fail(r);
+    return false;
+  }
+  return true;
+}
+
+// Reads a string's raw contents, still escaped, after its opening quote.
+static bool ReadRawString(JSONReader* r, std::string_view* s, bool* escaped) {
+  const char* p = r->p;
+  *escaped = false;
+  while (p < r->end) {
+    if (*p == '"') {
+      *s = std::string_view(r->p, p - r->p);
+      r->p = p + 1;
+      return true;
+    } else if (*p == '\\') {
+      *escaped = true;
+      p += 2;
+    } else {
+      p++;
+    }
+  }
+  Fail(r);
+  return false;
+}
+
+static bool ReadString(JSONReader* r, std::string_view* s, bool* escaped) {
+  if (!Consume(r, '"')) {
+    Fail(r);
+    return false;
+  }
+  return ReadRawString(r, s, escaped);
+}
+
+// Reads the next member's key and its ':', or consumes the closing '}' and
+// returns false.  The key is left escaped.
+static bool ReadKey(JSONReader* r, std::string_view* key) {
+  bool first = r->first;
+  r->first = false;
+  if (Consume(r, '}')) {
+    return false;
+  }
+  if (!first && !Consume(r, ',')) {
+    Fail(r);
+    return false;
+  }
+  bool escaped;
+  if (!ReadString(r, key, &escaped)) {
+    return false;
+  }
+  if (!Consume(r, ':')) {
+    Fail(r);
+    return false;
+  }
+  return true;
+}
+
+// Copies the number token at r->p into buf and consumes it.  Quoted
+// numbers are accepted as well.
+static size_t NumberToken(JSONReader* r, char* buf, size_t size) {
+  bool quoted = Consume(r, '"');
+  if (!quoted) {
+    SkipSpace(r);
+  }
+  size_t n = 0;
+  while (r->p < r->end && n < size - 1) {
+    char c = *r->p;
+    if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+        c == 'e' || c == 'E') {
+      buf[n++] = c;
+      r->p++;
+    } else {
+      break;
+    }
+  }
+  buf[n] = '\0';
+  if (n == 0 || (quoted && !Consume(r, '"'))) {
+    Fail(r);
+    return 0;
+  }
+  return n;
+}
+
+static bool IsIntegral(const char* buf, size_t n) {
+  return memchr(buf, '.', n) == NULL && memchr(buf, 'e', n) == NULL &&
+         memchr(buf, 'E', n) == NULL;
+}
+
+template <class T>
+static T ReadInteger(JSONReader* r) {
+  char buf[64];
+  size_t n = NumberToken(r, buf, sizeof(buf));
+  if (n == 0) {
+    return 0;
+  }
+  if (!IsIntegral(buf, n)) {
+    return T(strtod(buf, NULL));
+  }
+  T v;
+  if (std::from_chars(buf, buf + n, v).ec == std::errc()) {
+    return v;
+  }
+  // "+1" or out of range; let strto* clamp it the way the Objective-C
+  // reader does.
+  return std::is_signed<T>::value ? T(strtoll(buf, NULL, 10))
+                                  : T(strtoull(buf, NULL, 10));
+}
+
+static double ReadDouble(JSONReader* r) {
+  char buf[64];
+  size_t n = NumberToken(r, buf, sizeof(buf));
+  if (n == 0) {
+    return 0;
+  }
+  double v;
+  if (std::from_chars(buf, buf + n, v).ec == std::errc()) {
+    return v;
+  }
+  return strtod(buf, NULL);
+}
+
+static bool ReadBool(JSONReader* r) {
+  if (ConsumeLiteral(r, "true", 4)) {
+    return true;
+  }
+  if (!ConsumeLiteral(r, "false", 5)) {
+    Fail(r);
+  }
+  return false;
+}
+
+static void SkipValue(JSONReader* r, int depth = 0) {
+  SkipSpace(r);
+  if (r->p == r->end || depth > kMaxDepth) {
+    Fail(r);
+    return;
+  }
+  switch (*r->p) {
+    case '{': {
+      r->p++;
+      r->first = true;
+      std::string_view key;
+      while (ReadKey(r, &key)) {
+        SkipValue(r, depth + 1);
+      }
+      return;
+    }
+    case '[':
+      r->p++;
+      r->first = true;
+      while (ReadArrayNext(r)) {
+        SkipValue(r, depth + 1);
+      }
+      return;
+    case '"': {
+      std::string_view s;
+      bool escaped;
+      ReadString(r, &s, &escaped);
+      return;
+    }
+    case 't':
+    case 'f':
+      ReadBool(r);
+      return;
+    case 'n':
+      if (!ReadNull(r)) {
+        Fail(r);
+      }
+      return;
+    default: {
+      char buf[64];
+      NumberToken(r, buf, sizeof(buf));
+      return;
+    }
+  }
+}
+
+static int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool ReadHex4(const char* p, const char* end, uint32_t* out) {
+  if (end - p < 4) {
+    return false;
+  }
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    int h = HexValue(p[i]);
+    if (h < 0) {
+      return false;
+    }
+    v = (v << 4) | h;
+  }
+  *out = v;
+  return true;
+}
+
+static size_t PutUTF8(char* out, uint32_t cp) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3f);
+  out[2] = 0x80 | ((cp >> 6) & 0x3f);
+  out[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+// Unescapes `s` into out, which must hold s.size() bytes; an escape never
+// produces more bytes than it takes up.  Returns the length, or -1.
+static ssize_t Unescape(std::string_view s, char* out) {
+  const char* p = s.data();
+  const char* end = p + s.size();
+  char* o = out;
+  while (p < end) {
+    if (*p != '\\') {
+      *o++ = *p++;
+      continue;
+    }
+    if (end - p < 2) {
+      return -1;
+    }
+    char c = p[1];
+    p += 2;
+    switch (c) {
+      case '"': case '\\': case '/': *o++ = c; break;
+      case 'b': *o++ = '\b'; break;
+      case 'f': *o++ = '\f'; break;
+      case 'n': *o++ = '\n'; break;
+      case 'r': *o++ = '\r'; break;
+      case 't': *o++ = '\t'; break;
+      case 'u': {
+        uint32_t cp, lo;
+        if (!ReadHex4(p, end, &cp)) {
+          return -1;
+        }
+        p += 4;
+        if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 &&
+            p[0] == '\\' && p[1] == 'u' && ReadHex4(p + 2, end, &lo) &&
+            lo >= 0xdc00 && lo < 0xe000) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          p += 6;
+        }
+        o += PutUTF8(o, cp);
+        break;
+      }
+      default:
+        return -1;
+    }
+  }
+  return o - out;
+}
+
+static void WriteEscaped(const char* s, size_t len, std::string* json) {
+  static const char kHex[] = "0123456789abcdef";
+  json->push_back('"');
+  size_t run = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    json->append(s + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"':  json->append("\\\"", 2); break;
+      case '\\': json->append("\\\\", 2); break;
+      case '\n': json->append("\\n", 2); break;
+      case '\r': json->append("\\r", 2); break;
+      case '\t': json->append("\\t", 2); break;
+      default: {
+        char esc[6] = { '\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf] };
+        json->append(esc, 6);
+      }
+    }
+  }
+  json->append(s + run, len - run);
+  json->push_back('"');
+}
+
+static void WriteUInt64(uint64_t v, std::string* json) {
+  char buf[20];
+  char* end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+  json->append(buf, end - buf);
+}
+
+static void WriteInt64(int64_t v, std::string* json) {
+  char buf[20];
+  char* end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+  json->append(buf, end - buf);
+}
+
+// The shortest form that reads back the same value, as DXJSONWriteDouble()
+// aims for.
+template <class T>
+static void WriteReal(T v, std::string* json) {
+  if (!isfinite(v)) {
+    // JSON has no NaN or infinity.
+    json->append("null", 4);
+    return;
+  }
+  char buf[32];
+  char* end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+  json->append(buf, end - buf);
+}
+
+// ---- Base64 --------------------------------------------------------------
+
+static const char kBase64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Value of each base64 character, taking the URL-safe alphabet too; -1 for
+// bad ones, -2 for line breaks.
+static const int8_t kBase64Values[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -2, -1, -1, -2, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, 62, -1, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+  -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+  -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// Writes `data` as a quoted base64 string, with padding.
+static void WriteBase64(const char* data, size_t len, std::string* json) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+  size_t start = json->size();
+  json->resize(start + (len + 2) / 3 * 4 + 2);
+  char* o = &(*json)[start];
+  *o++ = '"';
+  while (len >= 3) {
+    uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+    o[0] = kBase64[v >> 18];
+    o[1] = kBase64[(v >> 12) & 63];
+    o[2] = kBase64[(v >> 6) & 63];
+    o[3] = kBase64[v & 63];
+    o += 4;
+    in += 3;
+    len -= 3;
+  }
+  if (len > 0) {
+    uint32_t v = in[0] << 16;
+    if (len == 2) {
+      v |= in[1] << 8;
+    }
+    o[0] = kBase64[v >> 18];
+    o[1] = kBase64[(v >> 12) & 63];
+    o[2] = len == 2 ? kBase64[(v >> 6) & 63] : '=';
+    o[3] = '=';
+    o += 4;
+  }
+  *o = '"';
+}
+
+// Decodes `in` into out, which must hold in.size() / 4 * 3 + 3 bytes.
+// Takes what DXDataFromBase64String() takes: either alphabet, missing
+// padding and line breaks.  Returns the length, or -1.
+static ssize_t DecodeBase64(std::string_view in, char* out) {
+  char* o = out;
+  uint32_t bits = 0;
+  int count = 0;
+  bool padded = false;
+  for (unsigned char ch : in) {
+    int v = kBase64Values[ch];
+    if (v == -2) {
+      continue;
+    } else if (ch == '=') {
+      padded = true;
+    } else if (v < 0 || padded) {
+      return -1;
+    } else {
+      bits = (bits << 6) | v;
+      if (++count == 4) {
+        o[0] = bits >> 16;
+        o[1] = bits >> 8;
+        o[2] = bits;
+        o += 3;
+        bits = 0;
+        count = 0;
+      }
+    }
+  }
+  if (count == 1) {
+    return -1;
+  } else if (count == 2) {
+    *o++ = bits >> 4;
+  } else if (count == 3) {
+    *o++ = bits >> 10;
+    *o++ = bits >> 2;
+  }
+  return o - out;
+}
+
+// ---- Wire format ---------------------------------------------------------
+
+enum WireType {
+  kVarint = 0,
+  kFixed64 = 1,
+  kLengthDelimited = 2,
+  kStartGroup = 3,
+  kEndGroup = 4,
+  kFixed32 = 5,
+};
+
+static const char* ReadVarint(const char* p, const char* end, uint64_t* v) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    result |= uint64_t(b & 0x7f) << shift;
+    if (b < 0x80) {
+      *v = result;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+static size_t EncodeVarint(uint64_t v, char* buf) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    buf[n++] = char(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = char(v);
+  return n;
+}
+
+static void WriteVarint(uint64_t v, std::string* wire) {
+  char buf[10];
+  wire->append(buf, EncodeVarint(v, buf));
+}
+
+// Skips to just past the end of the group `number`, whose start tag has
+// been read.
+static const char* SkipGroup(const char* p, const char* end, uint32_t number,
+                             int depth) {
+  if (depth > kMaxDepth) {
+    return nullptr;
+  }
+  while (p != nullptr && p < end) {
+    uint64_t tag, v;
+    p = ReadVarint(p, end, &tag);
+    if (p == nullptr) {
+      return nullptr;
+    }
+    switch (tag & 7) {
+      case kVarint:
+        p = ReadVarint(p, end, &v);
+        break;
+      case kFixed64:
+        p = end - p < 8 ? nullptr : p + 8;
+        break;
+      case kFixed32:
+        p = end - p < 4 ? nullptr : p + 4;
+        break;
+      case kLengthDelimited:
+        p = ReadVarint(p, end, &v);
+        p = p == nullptr || v > uint64_t(end - p) ? nullptr : p + v;
+        break;
+      case kStartGroup:
+        p = SkipGroup(p, end, tag >> 3, depth + 1);
+        break;
+      case kEndGroup:
+        return (tag >> 3) == number ? p : nullptr;
+      default:
+        return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+// ---- Plans ---------------------------------------------------------------
+
+// Conversions for one scalar type, between its value as read off the wire
+// (a varint, or the bits of a fixed32 or fixed64) and its JSON, or its C
+// value in a dx_json_packed array.
+typedef void (*WriteJSONFn)(uint64_t value, std::string* json);
+typedef uint64_t (*ReadJSONFn)(JSONReader* r);
+typedef uint64_t (*LoadFn)(const char* native);
+typedef void (*StoreFn)(uint64_t value, char* native);
+
+enum class Kind : uint8_t {
+  kScalar,
+  kString,
+  kBytes,
+  kMessage,
+  kMap,         // dx_map_key: a JSON object of entries
+  kPackedJSON,  // dx_json_packed: base64 of the C array
+};
+
+struct FieldPlan {
+  const FieldDescriptor* descriptor;
+  uint32_t number;
+  WireType wire_type;  // of one value
+  Kind kind;
+  bool repeated;
+  bool packed;         // repeated scalars go out as one packed record
+  size_t native_size;  // of a dx_json_packed element
+  std::string key;     // ",\"userId\":", see DXJSONWriteKey()
+  std::string tag;
+  std::string packed_tag;
+
+  WriteJSONFn write_json = nullptr;
+  ReadJSONFn read_json = nullptr;
+  LoadFn load = nullptr;
+  StoreFn store = nullptr;
+
+  // Written for map entries that leave out their key or value.
+  uint64_t default_value = 0;
+  std::string default_string;
+
+  // The message type, or the entry type of a map.
+  const MessagePlan* message = nullptr;
+  int map_key = -1;  // indexes into message->fields
+  int map_val = -1;
+};
+
+struct MessagePlan {
+  const Descriptor* descriptor;
+  std::vector<FieldPlan> fields;
+  std::vector<int16_t> by_number;  // below kDenseNumbers; -1 if no field
+  std::vector<std::pair<uint32_t, int>> sparse_numbers;  // sorted
+  std::vector<int> by_key;  // open addressing on KeyHash(); -1 if empty
+  uint32_t key_mask = 0;
+
+  int FindNumber(uint32_t number) const {
+    if (number < by_number.size()) {
+      return by_number[number];
+    }
+    auto it = std::lower_bound(sparse_numbers.begin(), sparse_numbers.end(),
+                               std::make_pair(number, -1));
+    return it != sparse_numbers.end() && it->first == number ? it->second
+                                                             : -1;
+  }
+
+  int FindKey(std::string_view key) const;
+};
+
+static uint32_t KeyHash(std::string_view key) {
+  uint32_t h = 2166136261u;
+  for (unsigned char c : key) {
+    h ^= c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int MessagePlan::FindKey(std::string_view key) const {
+  for (uint32_t i = KeyHash(key) & key_mask;; i = (i + 1) & key_mask) {
+    int index = by_key[i];
+    if (index < 0) {
+      return -1;
+    }
+    const std::string& k = fields[index].key;
+    if (k.size() == key.size() + 4 &&
+        memcmp(k.data() + 2, key.data(), key.size()) == 0) {
+      return index;
+    }
+  }
+}
+
+// One codec per protobuf type: its C type, and how that maps to the value
+// read off the wire.
+struct Int32Codec {
+  typedef int32_t Native;
+  static uint64_t ToWire(Native v) { return uint64_t(int64_t(v)); }
+  static Native FromWire(uint64_t w) { return Native(w); }
+};
+
+struct Int64Codec {
+  typedef int64_t Native;
+  static uint64_t ToWire(Native v) { return uint64_t(v); }
+  static Native FromWire(uint64_t w) { return Native(w); }
+};
+
+struct UInt32Codec {
+  typedef uint32_t Native;
+  static uint64_t ToWire(Native v) { return v; }
+  static Native FromWire(uint64_t w) { return Native(w); }
+};
+
+struct UInt64Codec {
+  typedef uint64_t Native;
+  static uint64_t ToWire(Native v) { return v; }
+  static Native FromWire(uint64_t w) { return w; }
+};
+
+struct SInt32Codec {
+  typedef int32_t Native;
+  static uint64_t ToWire(Native v) {
+    return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+  }
+  static Native FromWire(uint64_t w) {
+    return Native((uint32_t(w) >> 1) ^ -(uint32_t(w) & 1));
+  }
+};
+
+struct SInt64Codec {
+  typedef int64_t Native;
+  static uint64_t ToWire(Native v) {
+    return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+  }
+  static Native FromWire(uint64_t w) { return Native((w >> 1) ^ -(w & 1)); }
+};
+
+struct FloatCodec {
+  typedef float Native;
+  static uint64_t ToWire(Native v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+  }
+  static Native FromWire(uint64_t w) {
+    uint32_t bits = uint32_t(w);
+    Native v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+};
+
+struct DoubleCodec {
+  typedef double Native;
+  static uint64_t ToWire(Native v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+  }
+  static Native FromWire(uint64_t w) {
+    Native v;
+    memcpy(&v, &w, sizeof(v));
+    return v;
+  }
+};
+
+struct BoolCodec {
+  typedef bool Native;
+  static uint64_t ToWire(Native v) { return v ? 1 : 0; }
+  static Native FromWire(uint64_t w) { return w != 0; }
+};
+
+static void WriteNative(int32_t v, std::string* json) { WriteInt64(v, json); }
+static void WriteNative(int64_t v, std::string* json) { WriteInt64(v, json); }
+static void WriteNative(uint32_t v, std::string* json) { WriteUInt64(v, json); }
+static void WriteNative(uint64_t v, std::string* json) { WriteUInt64(v, json); }
+static void WriteNative(float v, std::string* json) { WriteReal(v, json); }
+static void WriteNative(double v, std::string* json) { WriteReal(v, json); }
+static void WriteNative(bool v, std::string* json) {
+  if (v) {
+    json->append("true", 4);
+  } else {
+    json->append("false", 5);
+  }
+}
+
+// Narrowing as the generated parsers do, e.g. (int32_t)DXJSONReadInt64(r).
+static void ReadNative(JSONReader* r, int32_t* v) {
+  *v = int32_t(ReadInteger<int64_t>(r));
+}
+static void ReadNative(JSONReader* r, int64_t* v) {
+  *v = ReadInteger<int64_t>(r);
+}
+static void ReadNative(JSONReader* r, uint32_t* v) {
+  *v = uint32_t(ReadInteger<uint64_t>(r));
+}
+static void ReadNative(JSONReader* r, uint64_t* v) {
+  *v = ReadInteger<uint64_t>(r);
+}
+static void ReadNative(JSONReader* r, float* v) { *v = float(ReadDouble(r)); }
+static void ReadNative(JSONReader* r, double* v) { *v = ReadDouble(r); }
+static void ReadNative(JSONReader* r, bool* v) { *v = ReadBool(r); }
+
+template <class C>
+static void WriteJSON(uint64_t value, std::string* json) {
+  WriteNative(C::FromWire(value), json);
+}
+
+template <class C>
+static uint64_t ReadJSON(JSONReader* r) {
+  typename C::Native v;
+  ReadNative(r, &v);
+  return C::ToWire(v);
+}
+
+// dx_json_packed arrays are little-endian, like the hosts we run on.
+template <class C>
+static uint64_t Load(const char* native) {
+  typename C::Native v;
+  memcpy(&v, native, sizeof(v));
+  return C::ToWire(v);
+}
+
+template <class C>
+static void Store(uint64_t value, char* native) {
+  typename C::Native v = C::FromWire(value);
+  memcpy(native, &v, sizeof(v));
+}
+
+template <class C>
+static void UseCodec(FieldPlan* plan, WireType wire_type,
+                     typename C::Native default_value) {
+  plan->wire_type = wire_type;
+  plan->write_json = &WriteJSON<C>;
+  plan->read_json = &ReadJSON<C>;
+  plan->load = &Load<C>;
+  plan->store = &Store<C>;
+  plan->native_size = sizeof(typename C::Native);
+  plan->default_value = C::ToWire(default_value);
+}
+
+static std::string Tag(uint32_t number, WireType wire_type) {
+  char buf[10];
+  return std::string(buf, EncodeVarint((number << 3) | wire_type, buf));
+}
+
+static bool IsIntegerKey(const FieldDescriptor* key) {
+  switch (key->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT32:
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static MessagePlan* BuildPlan(
+    const Descriptor* descriptor,
+    std::map<const Descriptor*, MessagePlan*>* built,
+    std::vector<std::unique_ptr<MessagePlan>>* plans,
+    std::string* error);
+
+// Fills in everything about `field` but its links to other plans.
+static bool PlanField(const FieldDescriptor* field, FieldPlan* plan,
+                      std::string* error) {
+  plan->descriptor = field;
+  plan->number = field->number();
+  plan->repeated = field->is_repeated();
+  plan->packed = field->is_packed();
+  plan->key = ",\"" + field->camelcase_name() + "\":";
+  plan->kind = Kind::kScalar;
+
+  switch (field->type()) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_ENUM:
+      UseCodec<Int32Codec>(plan, kVarint,
+                           field->type() == FieldDescriptor::TYPE_ENUM
+                               ? field->default_value_enum()->number()
+                               : field->default_value_int32());
+      break;
+    case FieldDescriptor::TYPE_SINT32:
+      UseCodec<SInt32Codec>(plan, kVarint, field->default_value_int32());
+      break;
+    case FieldDescriptor::TYPE_SFIXED32:
+      UseCodec<Int32Codec>(plan, kFixed32, field->default_value_int32());
+      break;
+    case FieldDescriptor::TYPE_INT64:
+      UseCodec<Int64Codec>(plan, kVarint, field->default_value_int64());
+      break;
+    case FieldDescriptor::TYPE_SINT64:
+      UseCodec<SInt64Codec>(plan, kVarint, field->default_value_int64());
+      break;
+    case FieldDescriptor::TYPE_SFIXED64:
+      UseCodec<Int64Codec>(plan, kFixed64, field->default_value_int64());
+      break;
+    case FieldDescriptor::TYPE_UINT32:
+      UseCodec<UInt32Codec>(plan, kVarint, field->default_value_uint32());
+      break;
+    case FieldDescriptor::TYPE_FIXED32:
+      UseCodec<UInt32Codec>(plan, kFixed32, field->default_value_uint32());
+      break;
+    case FieldDescriptor::TYPE_UINT64:
+      UseCodec<UInt64Codec>(plan, kVarint, field->default_value_uint64());
+      break;
+    case FieldDescriptor::TYPE_FIXED64:
+      UseCodec<UInt64Codec>(plan, kFixed64, field->default_value_uint64());
+      break;
+    case FieldDescriptor::TYPE_FLOAT:
+      UseCodec<FloatCodec>(plan, kFixed32, field->default_value_float());
+      break;
+    case FieldDescriptor::TYPE_DOUBLE:
+      UseCodec<DoubleCodec>(plan, kFixed64, field->default_value_double());
+      break;
+    case FieldDescriptor::TYPE_BOOL:
+      UseCodec<BoolCodec>(plan, kVarint, field->default_value_bool());
+      break;
+    case FieldDescriptor::TYPE_STRING:
+    case FieldDescriptor::TYPE_BYTES:
+      plan->kind = field->type() == FieldDescriptor::TYPE_STRING
+          ? Kind::kString : Kind::kBytes;
+      plan->wire_type = kLengthDelimited;
+      plan->packed = false;
+      plan->default_string = field->default_value_string();
+      break;
+    case FieldDescriptor::TYPE_MESSAGE:
+      plan->kind = Kind::kMessage;
+      plan->wire_type = kLengthDelimited;
+      plan->packed = false;
+      break;
+    case FieldDescriptor::TYPE_GROUP:
+      error->assign("Groups aren't supported: " + field->full_name());
+      return false;
+  }
+  plan->tag = Tag(plan->number, plan->wire_type);
+  plan->packed_tag = Tag(plan->number, kLengthDelimited);
+
+  if (field->options().GetExtension(::dx_json_packed)) {
+    if (!plan->repeated || plan->kind != Kind::kScalar ||
+        field->type() == FieldDescriptor::TYPE_BOOL) {
+      error->assign("dx_json_packed needs a repeated numeric field: " +
+                    field->full_name());
+      return false;
+    }
+    plan->kind = Kind::kPackedJSON;
+  }
+  return true;
+}
+
+// A dx_map_key field must be a repeated message whose key field is a
+// string or integer, as in json_generator.cc.
+static bool PlanMap(const FieldDescriptor* field, FieldPlan* plan,
+                    std::string* error) {
+  const google::protobuf::FieldOptions& options = field->options();
+  const Descriptor* entry = field->message_type();
+  if (!field->is_repeated() || entry == NULL) {
+    error->assign("dx_map_key field must be a repeated message: " +
+                  field->full_name());
+    return false;
+  }
+  const FieldDescriptor* key = entry->FindFieldByName(
+      options.GetExtension(::dx_map_key));
+  const FieldDescriptor* val = entry->FindFieldByName(
+      options.GetExtension(::dx_map_val));
+  if (key == NULL || val == NULL || key->is_repeated() ||
+      val->is_repeated()) {
+    error->assign("dx_map_key/dx_map_val must name two singular fields "
+                  "of " + entry->full_name());
+    return false;
+  }
+  if (key->type() != FieldDescriptor::TYPE_STRING && !IsIntegerKey(key)) {
+    error->assign("Map key must be a string or integer: " +
+                  key->full_name());
+    return false;
+  }
+  plan->kind = Kind::kMap;
+  plan->map_key = plan->message->FindNumber(key->number());
+  plan->map_val = plan->message->FindNumber(val->number());
+  return true;
+}
+
+static MessagePlan* BuildPlan(
+    const Descriptor* descriptor,
+    std::map<const Descriptor*, MessagePlan*>* built,
+    std::vector<std::unique_ptr<MessagePlan>>* plans,
+    std::string* error) {
+  auto it = built->find(descriptor);
+  if (it != built->end()) {
+    return it->second;
+  }
+  // Registered before the fields are planned, so recursive types link
+  // back to it.
+  plans->emplace_back(new MessagePlan);
+  MessagePlan* plan = plans->back().get();
+  (*built)[descriptor] = plan;
+  plan->descriptor = descriptor;
+
+  int count = descriptor->field_count();
+  plan->fields.resize(count);
+  uint32_t max_dense = 0;
+  for (int i = 0; i < count; i++) {
+    if (!PlanField(descriptor->field(i), &plan->fields[i], error)) {
+      return nullptr;
+    }
+    uint32_t number = plan->fields[i].number;
+    if (number < kDenseNumbers) {
+      max_dense = std::max(max_dense, number + 1);
+    } else {
+      plan->sparse_numbers.push_back(std::make_pair(number, i));
+    }
+  }
+  plan->by_number.assign(max_dense, -1);
+  for (int i = 0; i < count; i++) {
+    if (plan->fields[i].number < kDenseNumbers) {
+      plan->by_number[plan->fields[i].number] = i;
+    }
+  }
+  std::sort(plan->sparse_numbers.begin(), plan->sparse_numbers.end());
+
+  // At most half full, so probes stay short.
+  uint32_t size = 1;
+  while (size < 2 * uint32_t(count)) {
+    size <<= 1;
+  }
+  plan->key_mask = size - 1;
+  plan->by_key.assign(size, -1);
+  for (int i = 0; i < count; i++) {
+    const std::string& key = plan->fields[i].key;
+    uint32_t h = KeyHash(std::string_view(key).substr(2, key.size() - 4));
+    while (plan->by_key[h & plan->key_mask] >= 0) {
+      h++;
+    }
+    plan->by_key[h & plan->key_mask] = i;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const FieldDescriptor* field = descriptor->field(i);
+    FieldPlan* field_plan = &plan->fields[i];
+    if (field_plan->kind != Kind::kMessage) {
+      continue;
+    }
+    field_plan->message =
+        BuildPlan(field->message_type(), built, plans, error);
+    if (field_plan->message == nullptr) {
+      return nullptr;
+    }
+    const google::protobuf::FieldOptions& options = field->options();
+    if ((options.HasExtension(::dx_map_key) ||
+         options.HasExtension(::dx_map_val)) &&
+        !PlanMap(field, field_plan, error)) {
+      return nullptr;
+    }
+  }
+  return plan;
+}
+
+Transcoder::Transcoder() {}
+
+Transcoder::~Transcoder() {}
+
+std::unique_ptr<Transcoder> Transcoder::Create(const Descriptor* type,
+                                               std::string* error) {
+  std::unique_ptr<Transcoder> transcoder(new Transcoder);
+  std::map<const Descriptor*, MessagePlan*> built;
+  transcoder->type_ = type;
+  transcoder->root_ = BuildPlan(type, &built, &transcoder->plans_, error);
+  if (transcoder->root_ == nullptr) {
+    return nullptr;
+  }
+  return transcoder;
+}
+
+// ---- Wire to JSON --------------------------------------------------------
+
+// A field's value as found on the wire: the scalar, or the bytes of a
+// string, message or packed run.  Values of one field are chained in the
+// order they came, so repeated fields come out as one array even if
+// their records are interleaved with others.
+struct WireValue {
+  const char* data;
+  uint64_t value;  // the scalar, or the length
+  bool packed;
+  WireValue* next;
+};
+
+class JSONEncoder {
+ public:
+  JSONEncoder(Arena* arena, std::string* json) : arena_(arena), json_(json) {}
+
+  bool Message(const MessagePlan& plan, const char* p, const char* end);
+
+  const Descriptor* failed_type() const { return failed_type_; }
+
+ private:
+  bool Fail(const MessagePlan& plan) {
+    if (failed_type_ == nullptr) {
+      failed_type_ = plan.descriptor;
+    }
+    return false;
+  }
+
+  bool Field(const FieldPlan& field, const WireValue* head,
+             const WireValue* tail);
+  bool Value(const FieldPlan& field, const char* data, uint64_t value);
+  bool MapEntry(const FieldPlan& field, const WireValue* entry);
+  void PackedJSON(const FieldPlan& field, const WireValue* head);
+
+  // Calls `f` with each scalar in `v`, unpacking a packed run.
+  template <class F>
+  static bool ForEachScalar(const FieldPlan& field, const WireValue* v, F f);
+
+  Arena* arena_;
+  std::string* json_;
+  int depth_ = 0;
+  const Descriptor* failed_type_ = nullptr;
+};
+
+template <class F>
+bool JSONEncoder::ForEachScalar(const FieldPlan& field, const WireValue* v,
+                                F f) {
+  if (!v->packed) {
+    f(v->value);
+    return true;
+  }
+  const char* p = v->data;
+  const char* end = p + v->value;
+  while (p < end) {
+    uint64_t value = 0;
+    if (field.wire_type == kVarint) {
+      p = ReadVarint(p, end, &value);
+      if (p == nullptr) {
+        return false;
+      }
+    } else {
+      size_t size = field.wire_type == kFixed32 ? 4 : 8;
+      if (size_t(end - p) < size) {
+        return false;
+      }
+      memcpy(&value, p, size);
+      p += size;
+    }
+    f(value);
+  }
+  return true;
+}
+
+bool JSONEncoder::Message(const MessagePlan& plan, const char* p,
+                          const char* end) {
+  if (++depth_ > kMaxDepth) {
+    return Fail(plan);
+  }
+  size_t count = plan.fields.size();
+  WireValue** heads = arena_->AllocateArray<WireValue*>(2 * count);
+  WireValue** tails = heads + count;
+  memset(heads, 0, 2 * count * sizeof(WireValue*));
+
+  while (p < end) {
+    uint64_t tag;
+    p = ReadVarint(p, end, &tag);
+    if (p == nullptr) {
+      return Fail(plan);
+    }
+    uint32_t number = uint32_t(tag >> 3);
+    WireType wire_type = WireType(tag & 7);
+    const char* data = p;
+    uint64_t value = 0;
+    switch (wire_type) {
+      case kVarint:
+        p = ReadVarint(p, end, &value);
+        break;
+      case kFixed64:
+        if (end - p < 8) {
+          return Fail(plan);
+        }
+        memcpy(&value, p, 8);
+        p += 8;
+        break;
+      case kFixed32:
+        if (end - p < 4) {
+          return Fail(plan);
+        }
+        memcpy(&value, p, 4);
+        p += 4;
+        break;
+      case kLengthDelimited:
+        p = ReadVarint(p, end, &value);
+        if (p == nullptr || value > uint64_t(end - p)) {
+          return Fail(plan);
+        }
+        data = p;
+        p += value;
+        break;
+      case kStartGroup:
+        p = SkipGroup(p, end, number, depth_);
+        break;
+      default:
+        return Fail(plan);
+    }
+    if (p == nullptr) {
+      return Fail(plan);
+    }
+
+    int index = plan.FindNumber(number);
+    if (index < 0 || wire_type == kStartGroup) {
+      continue;
+    }
+    const FieldPlan& field = plan.fields[index];
+    // Repeated scalars may come packed whether or not the field is.
+    bool packed = wire_type == kLengthDelimited &&
+        field.wire_type != kLengthDelimited && field.repeated;
+    if (wire_type != field.wire_type && !packed) {
+      continue;  // treat it as an unknown field, as protobuf does
+    }
+    WireValue* v = arena_->AllocateArray<WireValue>(1);
+    *v = WireValue{data, value, packed, nullptr};
+    if (tails[index] != nullptr) {
+      tails[index]->next = v;
+    } else {
+      heads[index] = v;
+    }
+    tails[index] = v;
+  }
+
+  json_->push_back('{');
+  bool first = true;
+  for (size_t i = 0; i < count; i++) {
+    if (heads[i] == nullptr) {
+      continue;
+    }
+    const std::string& key = plan.fields[i].key;
+    json_->append(key.data() + first, key.size() - first);
+    first = false;
+    if (!Field(plan.fields[i], heads[i], tails[i])) {
+      return Fail(plan);
+    }
+  }
+  json_->push_back('}');
+  depth_--;
+  return true;
+}
+
+bool JSONEncoder::Field(const FieldPlan& field, const WireValue* head,
+                        const WireValue* tail) {
+  if (field.kind == Kind::kPackedJSON) {
+    PackedJSON(field, head);
+    return true;
+  }
+  if (field.kind == Kind::kMap) {
+    json_->push_back('{');
+    for (const WireValue* v = head; v != nullptr; v = v->next) {
+      if (v != head) {
+        json_->push_back(',');
+      }
+      if (!MapEntry(field, v)) {
+        return false;
+      }
+    }
+    json_->push_back('}');
+    return true;
+  }
+  if (field.repeated) {
+    json_->push_back('[');
+    bool first = true;
+    for (const WireValue* v = head; v != nullptr; v = v->next) {
+      if (field.kind == Kind::kScalar) {
+        bool ok = ForEachScalar(field, v, [&](uint64_t value) {
+          if (!first) {
+            json_->push_back(',');
+          }
+          first = false;
+          field.write_json(value, json_);
+        });
+        if (!ok) {
+          return false;
+        }
+        continue;
+      }
+      if (!first) {
+        json_->push_back(',');
+      }
+      first = false;
+      if (!Value(field, v->data, v->value)) {
+        return false;
+      }
+    }
+    json_->push_back(']');
+    return true;
+  }
+
+  // The last value wins, except that a message split over several records
+  // is the merge of them all.
+  if (field.kind == Kind::kMessage && head != tail) {
+    size_t size = 0;
+    for (const WireValue* v = head; v != nullptr; v = v->next) {
+      size += v->value;
+    }
+    char* merged = arena_->AllocateArray<char>(size);
+    char* p = merged;
+    for (const WireValue* v = head; v != nullptr; v = v->next) {
+      memcpy(p, v->data, v->value);
+      p += v->value;
+    }
+    return Message(*field.message, merged, merged + size);
+  }
+  return Value(field, tail->data, tail->value);
+}
+
+bool JSONEncoder::Value(const FieldPlan& field, const char* data,
+                        uint64_t value) {
+  switch (field.kind) {
+    case Kind::kString:
+      WriteEscaped(data, value, json_);
+      return true;
+    case Kind::kBytes:
+      WriteBase64(data, value, json_);
+      return true;
+    case Kind::kMessage:
+      return Message(*field.message, data, data + value);
+    default:
+      field.write_json(value, json_);
+      return true;
+  }
+}
+
+// Writes one "key":value member of a map from the entry message.
+bool JSONEncoder::MapEntry(const FieldPlan& field, const WireValue* entry) {
+  const MessagePlan& plan = *field.message;
+  const FieldPlan& key = plan.fields[field.map_key];
+  const FieldPlan& val = plan.fields[field.map_val];
+  const char* key_data = nullptr;
+  const char* val_data = nullptr;
+  uint64_t key_value = key.default_value;
+  uint64_t val_value = val.default_value;
+  bool has_key = false;
+  bool has_val = false;
+
+  const char* p = entry->data;
+  const char* end = p + entry->value;
+  while (p < end) {
+    uint64_t tag;
+    p = ReadVarint(p, end, &tag);
+    if (p == nullptr) {
+      return false;
+    }
+    const char* data = p;
+    uint64_t value = 0;
+    switch (tag & 7) {
+      case kVarint:
+        p = ReadVarint(p, end, &value);
+        break;
+      case kFixed64:
+        p = end - p < 8 ? nullptr : p + 8;
+        if (p != nullptr) {
+          memcpy(&value, data, 8);
+        }
+        break;
+      case kFixed32:
+        p = end - p < 4 ? nullptr : p + 4;
+        if (p != nullptr) {
+          memcpy(&value, data, 4);
+        }
+        break;
+      case kLengthDelimited:
+        p = ReadVarint(p, end, &value);
+        if (p == nullptr || value > uint64_t(end - p)) {
+          return false;
+        }
+        data = p;
+        p += value;
+        break;
+      case kStartGroup:
+        p = SkipGroup(p, end, uint32_t(tag >> 3), depth_);
+        if (p == nullptr) {
+          return false;
+        }
+        continue;
+      default:
+        return false;
+    }
+    if (p == nullptr) {
+      return false;
+    }
+    if ((tag >> 3) == key.number && (tag & 7) == key.wire_type) {
+      key_data = data;
+      key_value = value;
+      has_key = true;
+    } else if ((tag >> 3) == val.number && (tag & 7) == val.wire_type) {
+      val_data = data;
+      val_value = value;
+      has_val = true;
+    }
+  }
+
+  if (key.kind != Kind::kString) {
+    json_->push_back('"');
+    key.write_json(key_value, json_);
+    json_->push_back('"');
+  } else if (has_key) {
+    WriteEscaped(key_data, key_value, json_);
+  } else {
+    WriteEscaped(key.default_string.data(), key.default_string.size(), json_);
+  }
+  json_->push_back(':');
+
+  if (has_val || val.kind == Kind::kScalar) {
+    return Value(val, val_data, val_value);
+  }
+  switch (val.kind) {
+    case Kind::kString:
+      WriteEscaped(val.default_string.data(), val.default_string.size(),
+                   json_);
+      break;
+    case Kind::kBytes:
+      WriteBase64(val.default_string.data(), val.default_string.size(),
+                  json_);
+      break;
+    default:
+      json_->append("{}", 2);
+  }
+  return true;
+}
+
+// The values as a C array, base64-encoded.
+void JSONEncoder::PackedJSON(const FieldPlan& field, const WireValue* head) {
+  size_t count = 0;
+  for (const WireValue* v = head; v != nullptr; v = v->next) {
+    ForEachScalar(field, v, [&](uint64_t) { count++; });
+  }
+  char* native = arena_->AllocateArray<char>(count * field.native_size);
+  char* p = native;
+  for (const WireValue* v = head; v != nullptr; v = v->next) {
+    ForEachScalar(field, v, [&](uint64_t value) {
+      field.store(value, p);
+      p += field.native_size;
+    });
+  }
+  WriteBase64(native, count * field.native_size, json_);
+}
+
+bool Transcoder::WireToJSON(std::string_view wire, std::string* json,
+                            Arena* arena, std::string* error) const {
+  Arena local;
+  if (arena == nullptr) {
+    arena = &local;
+  }
+  size_t start = json->size();
+  JSONEncoder encoder(arena, json);
+  bool ok = encoder.Message(*root_, wire.data(), wire.data() + wire.size());
+  arena->Reset();
+  if (!ok) {
+    json->resize(start);
+    error->assign("Malformed protobuf in " +
+                  encoder.failed_type()->full_name());
+  }
+  return ok;
+}
+
+// ---- JSON to wire --------------------------------------------------------
+
+class WireEncoder {
+ public:
+  WireEncoder(std::string_view json, Arena* arena, std::string* wire)
+      : arena_(arena), wire_(wire) {
+    r_.start = r_.p = json.data();
+    r_.end = json.data() + json.size();
+  }
+
+  // Reads the top-level object and checks that nothing follows it.
+  bool Run(const MessagePlan& plan);
+
+  size_t error_offset() const { return r_.error_offset; }
+
+ private:
+  void Message(const MessagePlan& plan);
+  void Field(const FieldPlan& field);
+  void Value(const FieldPlan& field);
+  void MapEntry(const FieldPlan& field, std::string_view key);
+  void PackedJSON(const FieldPlan& field);
+
+  void WriteScalar(const FieldPlan& field, uint64_t value);
+  void WriteBytes(const FieldPlan& field, const char* data, size_t size);
+
+  // Leaves a one-byte length to be filled in by EndLength().  Most
+  // messages are short enough; longer ones move their bytes up to make
+  // room for the longer varint.
+  size_t BeginLength() {
+    wire_->push_back(0);
+    return wire_->size();
+  }
+
+  void EndLength(size_t mark) {
+    size_t size = wire_->size() - mark;
+    if (size < 0x80) {
+      (*wire_)[mark - 1] = char(size);
+      return;
+    }
+    char buf[10];
+    size_t n = EncodeVarint(size, buf);
+    wire_->insert(mark, n - 1, '\0');
+    memcpy(&(*wire_)[mark - 1], buf, n);
+  }
+
+  JSONReader r_;
+  Arena* arena_;
+  std::string* wire_;
+  int depth_ = 0;
+};
+
+bool WireEncoder::Run(const MessagePlan& plan) {
+  if (ReadObjectStart(&r_)) {
+    Message(plan);
+  }
+  SkipSpace(&r_);
+  if (r_.p != r_.end) {
+    Fail(&r_);
+  }
+  return !r_.failed;
+}
+
+void WireEncoder::Message(const MessagePlan& plan) {
+  if (++depth_ > kMaxDepth) {
+    Fail(&r_);
+    return;
+  }
+  std::string_view key;
+  while (ReadKey(&r_, &key)) {
+    int index = plan.FindKey(key);
+    if (index < 0) {
+      SkipValue(&r_);
+    } else if (!ReadNull(&r_)) {
+      Field(plan.fields[index]);
+    }
+  }
+  depth_--;
+}
+
+void WireEncoder::Field(const FieldPlan& field) {
+  if (field.kind == Kind::kPackedJSON) {
+    PackedJSON(field);
+    return;
+  }
+  if (field.kind == Kind::kMap) {
+    if (!ReadObjectStart(&r_)) {
+      return;
+    }
+    std::string_view key;
+    while (ReadKey(&r_, &key)) {
+      if (!ReadNull(&r_)) {
+        MapEntry(field, key);
+      }
+    }
+    return;
+  }
+  if (!field.repeated) {
+    Value(field);
+    return;
+  }
+  if (!ReadArrayStart(&r_)) {
+    return;
+  }
+  if (field.kind == Kind::kScalar && field.packed) {
+    size_t start = wire_->size();
+    wire_->append(field.packed_tag);
+    size_t mark = BeginLength();
+    while (ReadArrayNext(&r_)) {
+      WriteScalar(field, field.read_json(&r_));
+    }
+    if (wire_->size() == mark) {
+      wire_->resize(start);  // no record for an empty array
+    } else {
+      EndLength(mark);
+    }
+    return;
+  }
+  while (ReadArrayNext(&r_)) {
+    // Null elements can't go in the array; skip them.
+    if (field.kind != Kind::kScalar && ReadNull(&r_)) {
+      continue;
+    }
+    Value(field);
+  }
+}
+
+void WireEncoder::WriteScalar(const FieldPlan& field, uint64_t value) {
+  switch (field.wire_type) {
+    case kFixed32: {
+      uint32_t bits = uint32_t(value);
+      wire_->append(reinterpret_cast<const char*>(&bits), 4);
+      break;
+    }
+    case kFixed64:
+      wire_->append(reinterpret_cast<const char*>(&value), 8);
+      break;
+    default:
+      WriteVarint(value, wire_);
+  }
+}
+
+void WireEncoder::WriteBytes(const FieldPlan& field, const char* data,
+                             size_t size) {
+  wire_->append(field.tag);
+  WriteVarint(size, wire_);
+  wire_->append(data, size);
+}
+
+void WireEncoder::Value(const FieldPlan& field) {
+  switch (field.kind) {
+    case Kind::kString: {
+      std::string_view s;
+      bool escaped;
+      if (!ReadString(&r_, &s, &escaped)) {
+        return;
+      }
+      if (!escaped) {
+        WriteBytes(field, s.data(), s.size());
+        return;
+      }
+      char* buf = arena_->AllocateArray<char>(s.size());
+      ssize_t n = Unescape(s, buf);
+      if (n < 0) {
+        Fail(&r_);
+        return;
+      }
+      WriteBytes(field, buf, n);
+      return;
+    }
+    case Kind::kBytes: {
+      std::string_view s;
+      bool escaped;
+      if (!ReadString(&r_, &s, &escaped)) {
+        return;
+      }
+      if (escaped) {
+        // Some encoders write '/' as "\/".
+        char* buf = arena_->AllocateArray<char>(s.size());
+        ssize_t n = Unescape(s, buf);
+        if (n < 0) {
+          Fail(&r_);
+          return;
+        }
+        s = std::string_view(buf, n);
+      }
+      char* data = arena_->AllocateArray<char>(s.size() / 4 * 3 + 3);
+      ssize_t n = DecodeBase64(s, data);
+      if (n < 0) {
+        Fail(&r_);
+        return;
+      }
+      WriteBytes(field, data, n);
+      return;
+    }
+    case Kind::kMessage: {
+      wire_->append(field.tag);
+      size_t mark = BeginLength();
+      if (ReadObjectStart(&r_)) {
+        Message(*field.message);
+      }
+      EndLength(mark);
+      return;
+    }
+    default: {
+      uint64_t value = field.read_json(&r_);
+      wire_->append(field.tag);
+      WriteScalar(field, value);
+    }
+  }
+}
+
+// Writes one entry message from a "key":value member; the value is next in
+// the input.
+void WireEncoder::MapEntry(const FieldPlan& field, std::string_view key) {
+  const MessagePlan& plan = *field.message;
+  const FieldPlan& key_field = plan.fields[field.map_key];
+  wire_->append(field.tag);
+  size_t mark = BeginLength();
+  if (key_field.kind == Kind::kString) {
+    if (key.find('\\') == std::string_view::npos) {
+      WriteBytes(key_field, key.data(), key.size());
+    } else {
+      char* buf = arena_->AllocateArray<char>(key.size());
+      ssize_t n = Unescape(key, buf);
+      if (n < 0) {
+        Fail(&r_);
+        return;
+      }
+      WriteBytes(key_field, buf, n);
+    }
+  } else {
+    // Integer keys read like quoted numbers.
+    JSONReader key_reader;
+    key_reader.start = key_reader.p = key.data();
+    key_reader.end = key.data() + key.size();
+    uint64_t value = key_field.read_json(&key_reader);
+    wire_->append(key_field.tag);
+    WriteScalar(key_field, value);
+  }
+  Value(plan.fields[field.map_val]);
+  EndLength(mark);
+}
+
+void WireEncoder::PackedJSON(const FieldPlan& field) {
+  std::string_view s;
+  bool escaped;
+  if (!ReadString(&r_, &s, &escaped)) {
+    return;
+  }
+  char* native = arena_->AllocateArray<char>(s.size() / 4 * 3 + 3);
+  ssize_t n = DecodeBase64(s, native);
+  if (n < 0 || escaped) {
+    Fail(&r_);
+    return;
+  }
+  size_t count = n / field.native_size;
+  if (count == 0) {
+    return;
+  }
+  if (field.packed) {
+    wire_->append(field.packed_tag);
+    size_t mark = BeginLength();
+    for (size_t i = 0; i < count; i++) {
+      WriteScalar(field, field.load(native + i * field.native_size));
+    }
+    EndLength(mark);
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      wire_->append(field.tag);
+      WriteScalar(field, field.load(native + i * field.native_size));
+    }
+  }
+}
+
+bool Transcoder::JSONToWire(std::string_view json, std::string* wire,
+                            Arena* arena, std::string* error) const {
+  Arena local;
+  if (arena == nullptr) {
+    arena = &local;
+  }
+  size_t start = wire->size();
+  WireEncoder encoder(json, arena, wire);
+  bool ok = encoder.Run(*root_);
+  arena->Reset();
+  if (!ok) {
+    wire->resize(start);
+    error->assign("Malformed JSON at byte " +
+                  std::to_string(encoder.error_offset()));
+  }
+  return ok;
+}
+
+}  // namespace dx
@@ -0,0 +1,99 @@
+// Converts between the protobuf wire format and the JSON that the classes
+// from protoc-gen-objcjson read and write, without going through message
+// objects: camel-case keys, unset fields left out, repeated fields as
+// arrays, bytes as base64, dx_map_key fields as objects and dx_json_packed
+// fields as base64 strings of their little-endian values.
+//
+// Each message type is looked at once, when the Transcoder is created, and
+// turned into a plan: a table from keys and field numbers to fields, and a
+// pair of conversion functions per field.  Converting then walks the input
+// once, following the plans.
+
+#ifndef DX_TRANSCODER_H__
+#define DX_TRANSCODER_H__
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+namespace dx {
+
+// Scratch space for one conversion at a time, freed all at once.  Reset()
+// keeps the memory, so an arena reused across calls stops allocating once
+// it has grown to fit.
+class Arena {
+ public:
+  explicit Arena(size_t block_size = 16384) : block_size_(block_size) {}
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // 8-byte aligned.
+  void* Allocate(size_t size);
+
+  template <class T>
+  T* AllocateArray(size_t n) {
+    return static_cast<T*>(Allocate(n * sizeof(T)));
+  }
+
+  void Reset();
+
+ private:
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  size_t block_size_;
+  std::vector<Block> blocks_;
+  size_t current_ = 0;  // index into blocks_
+  size_t used_ = 0;     // in blocks_[current_]
+};
+
+struct MessagePlan;
+
+class Transcoder {
+ public:
+  ~Transcoder();
+
+  // Plans `type` and every message type it reaches.  Fails, with `error`
+  // set, on groups and on dx_map_key or dx_json_packed options that the
+  // JSON plugin would reject too.
+  static std::unique_ptr<Transcoder> Create(
+      const google::protobuf::Descriptor* type, std::string* error);
+
+  const google::protobuf::Descriptor* type() const { return type_; }
+
+  // Appends the JSON for the serialized message in `wire` to `json`.
+  // Unknown fields are dropped.  `arena` holds the scratch space and may
+  // be nullptr for a one-off call.  Safe to call from several threads, each
+  // with its own arena.
+  bool WireToJSON(std::string_view wire,
+                  std::string* json,
+                  Arena* arena,
+                  std::string* error) const;
+
+  // Appends the serialized form of the JSON object in `json` to `wire`.
+  // Unknown keys and nulls are skipped; keys with escapes don't match any
+  // field, as with the generated parsers.
+  bool JSONToWire(std::string_view json,
+                  std::string* wire,
+                  Arena* arena,
+                  std::string* error) const;
+
+ private:
+  Transcoder();
+
+  const google::protobuf::Descriptor* type_ = nullptr;
+  const MessagePlan* root_ = nullptr;
+  std::vector<std::unique_ptr<MessagePlan>> plans_;
+};
+
+}  // namespace dx
+
+#endif  // DX_TRANSCODER_H__
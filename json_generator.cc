@@ -4,13 +4,15 @@
 #include <stdio.h>
 #include <assert.h>
 #include <google/protobuf/compiler/code_generator.h>
-#include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/io/zero_copy_stream.h>
 
+#include "json_generator.h"
 #include "objc_helper.h"
+#include "runtime.h"
+#include "util.h"
 #include "google/protobuf/dx_options.pb.h"  // for method options
 
 using namespace google::protobuf;
@@ -52,7 +54,7 @@ string GetParsed(const FieldDescriptor* d, const string& var) {
       return "(NSString *)" + var;
 
     case FieldDescriptor::TYPE_BYTES:
-      return "(NSData *)" + var;
+      return "DXDataFromBase64String((NSString *)" + var + ")";
 
     case FieldDescriptor::TYPE_ENUM:
       // TODO(walt): check for validity
@@ -84,7 +86,7 @@ string GetObjForDict(const FieldDescriptor* descriptor, const string& var) {
     case FieldDescriptor::TYPE_DOUBLE  : return "@(" + var + ")";
     case FieldDescriptor::TYPE_BOOL    : return "@(" + var + ")";
     case FieldDescriptor::TYPE_STRING  : return var;
-    case FieldDescriptor::TYPE_BYTES   : return var;
+    case FieldDescriptor::TYPE_BYTES   : return "DXBase64String(" + var + ")";
     case FieldDescriptor::TYPE_ENUM    : return "@(" + var + ")";
     case FieldDescriptor::TYPE_MESSAGE : return "[" + var + " toDict]";
     case FieldDescriptor::TYPE_GROUP:
@@ -95,22 +97,483 @@ string GetObjForDict(const FieldDescriptor* descriptor, const string& var) {
   return "";
 }
 
-}  // anonymous namespace
+// "v", INT32 -> "DXJSONWriteInt64(w, v);"
+string GetJSONWrite(const FieldDescriptor* descriptor, const string& var) {
+  switch (descriptor->type()) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_SINT32:
+    case FieldDescriptor::TYPE_SFIXED32:
+    case FieldDescriptor::TYPE_INT64:
+    case FieldDescriptor::TYPE_SINT64:
+    case FieldDescriptor::TYPE_SFIXED64:
+    case FieldDescriptor::TYPE_ENUM:
+      return "DXJSONWriteInt64(w, " + var + ");";
+
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_UINT64:
+    case FieldDescriptor::TYPE_FIXED64:
+      return "DXJSONWriteUInt64(w, " + var + ");";
+
+    case FieldDescriptor::TYPE_FLOAT:
+      return "DXJSONWriteFloat(w, " + var + ");";
+    case FieldDescriptor::TYPE_DOUBLE:
+      return "DXJSONWriteDouble(w, " + var + ");";
+    case FieldDescriptor::TYPE_BOOL:
+      return "DXJSONWriteBool(w, " + var + ");";
+    case FieldDescriptor::TYPE_STRING:
+      return "DXJSONWriteString(w, " + var + ");";
+    case FieldDescriptor::TYPE_BYTES:
+      return "DXJSONWriteData(w, " + var + ");";
+    case FieldDescriptor::TYPE_MESSAGE:
+      return "[" + var + " writeJSONTo:w];";
+    case FieldDescriptor::TYPE_GROUP:
+      break;  // not handled
+  }
+
+  GOOGLE_LOG(FATAL) << "Can't get here.";
+  return "";
+}
+
+// "r", INT32 -> "(int32_t)DXJSONReadInt64(r)"
+string GetJSONRead(const FieldDescriptor* descriptor) {
+  switch (descriptor->type()) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_SINT32:
+    case FieldDescriptor::TYPE_SFIXED32:
+      return "(int32_t)DXJSONReadInt64(r)";
+
+    case FieldDescriptor::TYPE_INT64:
+    case FieldDescriptor::TYPE_SINT64:
+    case FieldDescriptor::TYPE_SFIXED64:
+      return "DXJSONReadInt64(r)";
+
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_FIXED32:
+      return "(uint32_t)DXJSONReadUInt64(r)";
+
+    case FieldDescriptor::TYPE_UINT64:
+    case FieldDescriptor::TYPE_FIXED64:
+      return "DXJSONReadUInt64(r)";
+
+    case FieldDescriptor::TYPE_FLOAT:
+      return "(float)DXJSONReadDouble(r)";
+    case FieldDescriptor::TYPE_DOUBLE:
+      return "DXJSONReadDouble(r)";
+    case FieldDescriptor::TYPE_BOOL:
+      return "DXJSONReadBool(r)";
+    case FieldDescriptor::TYPE_STRING:
+      return "DXJSONReadString(r)";
+    case FieldDescriptor::TYPE_BYTES:
+      return "DXJSONReadData(r)";
+    case FieldDescriptor::TYPE_ENUM:
+      return "(" + objc::ClassName(descriptor->enum_type()) +
+          ")DXJSONReadInt64(r)";
+    case FieldDescriptor::TYPE_MESSAGE:
+      return "[" + objc::ClassName(descriptor->message_type()) +
+          " parseFromJSONReader:r]";
+    case FieldDescriptor::TYPE_GROUP:
+      break;  // not handled
+  }
+
+  GOOGLE_LOG(FATAL) << "Can't get here.";
+  return "";
+}
+
+// The C type of a repeated scalar's backing array, or "" for objects.
+string CType(const FieldDescriptor* d) {
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32 : return "int32_t";
+    case FieldDescriptor::CPPTYPE_INT64 : return "int64_t";
+    case FieldDescriptor::CPPTYPE_UINT32: return "uint32_t";
+    case FieldDescriptor::CPPTYPE_UINT64: return "uint64_t";
+    case FieldDescriptor::CPPTYPE_FLOAT : return "float";
+    case FieldDescriptor::CPPTYPE_DOUBLE: return "double";
+    case FieldDescriptor::CPPTYPE_BOOL  : return "BOOL";
+    case FieldDescriptor::CPPTYPE_ENUM  : return "int32_t";
+    default:
+      return "";
+  }
+}
+
+bool IsIntegerKey(const FieldDescriptor* key) {
+  switch (key->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT32:
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Map key in `var` -> the NSString used as the JSON object key.
+string MapKeyToString(const FieldDescriptor* key, const string& var) {
+  if (key->type() == FieldDescriptor::TYPE_STRING) {
+    return var;
+  }
+  return "[@(" + var + ") stringValue]";
+}
+
+// JSON object key in the NSString `var` -> map key.
+string MapKeyFromString(const FieldDescriptor* key, const string& var) {
+  switch (key->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_STRING: return var;
+    case FieldDescriptor::CPPTYPE_INT32 : return "[" + var + " intValue]";
+    case FieldDescriptor::CPPTYPE_INT64 : return "[" + var + " longLongValue]";
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return "(uint32_t)[" + var + " longLongValue]";
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return "strtoull([" + var + " UTF8String], NULL, 10)";
+    default:
+      GOOGLE_LOG(FATAL) << "Can't get here.";
+      return "";
+  }
+}
+
+// JSON object key from DXJSONReadKey() in mkey/mlen -> map key.
+string MapKeyFromJSON(const FieldDescriptor* key) {
+  switch (key->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_STRING:
+      return "DXJSONKeyString(mkey, mlen)";
+    case FieldDescriptor::CPPTYPE_INT32:
+      return "(int32_t)DXJSONKeyInt64(mkey, mlen)";
+    case FieldDescriptor::CPPTYPE_INT64:
+      return "DXJSONKeyInt64(mkey, mlen)";
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return "(uint32_t)DXJSONKeyUInt64(mkey, mlen)";
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return "DXJSONKeyUInt64(mkey, mlen)";
+    default:
+      GOOGLE_LOG(FATAL) << "Can't get here.";
+      return "";
+  }
+}
+
+// Scalars get boxed, objects are used as they are.
+string BoxedObj(const FieldDescriptor* d, const string& var) {
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_STRING:
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return var;
+    default:
+      return "@(" + var + ")";
+  }
+}
+
+string BoxedType(const FieldDescriptor* d) {
+  switch (d->type()) {
+    case FieldDescriptor::TYPE_STRING : return "NSString";
+    case FieldDescriptor::TYPE_BYTES  : return "NSData";
+    case FieldDescriptor::TYPE_MESSAGE:
+      return objc::ClassName(d->message_type());
+    default:
+      return "NSNumber";
+  }
+}
+
+// Must match DXKeyHash() in DXJSONRuntime.m; keys here are ASCII, so each
+// char is one UTF-16 unit.
+uint32 KeyHash(const string& key, uint32 seed) {
+  uint32 h = 2166136261u ^ seed;
+  for (int i = 0; i < key.size(); i++) {
+    h ^= static_cast<uint8>(key[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Finds a seed and power-of-two mask under which `keys` (all distinct) land
+// in distinct slots.  Only the used slots become cases of the generated
+// switch, so the table can be sparse: it starts at twice the keys and
+// grows until a seed works, up to kMaxPerfectHashSize.  Returns false if
+// none does.
+const uint32 kMaxPerfectHashSize = 1 << 20;
+const uint32 kPerfectHashSeeds = 64;
+
+bool FindPerfectHash(const vector<string>& keys, uint32* seed, uint32* mask) {
+  uint32 size = 1;
+  while (size < 2 * keys.size()) {
+    size <<= 1;
+  }
+  // Slots hold the number of the try that last used them, so the buffer
+  // needn't be cleared between tries.
+  vector<uint32> used;
+  uint32 attempt = 0;
+  for (; size <= kMaxPerfectHashSize; size <<= 1) {
+    used.assign(size, 0);
+    for (uint32 s = 0; s < kPerfectHashSeeds; s++) {
+      attempt++;
+      bool ok = true;
+      for (int i = 0; i < keys.size() && ok; i++) {
+        uint32 slot = KeyHash(keys[i], s) & (size - 1);
+        ok = used[slot] != attempt;
+        used[slot] = attempt;
+      }
+      if (ok) {
+        *seed = s;
+        *mask = size - 1;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Settings from the plugin parameter, e.g. --objcjson_out=runtime=false:.
+struct GeneratorOptions {
+  GeneratorOptions() : emit_runtime(true), lazy_messages(false) {}
+
+  // Write DXJSONRuntime.h/.m; pass runtime=false if the app ships its own.
+  bool emit_runtime;
+
+  // lazy=true: parse every message field lazily, as if it had dx_lazy set.
+  bool lazy_messages;
+};
 
 class FieldGenerator {
  public:
-  FieldGenerator(const FieldDescriptor* descriptor, string* error)
+  FieldGenerator(const FieldDescriptor* descriptor,
+                 const GeneratorOptions& generator_options,
+                 string* error)
       : descriptor_(descriptor), error_(error) {
     vars_["field"] = descriptor->camelcase_name();
+    vars_["ufield"] = objc::UnderscoresToCapitalizedCamelCase(descriptor);
+    // The quoted key as written by -writeJSONTo:, see DXJSONWriteKey().
+    vars_["json_key"] = ",\\\"" + descriptor->camelcase_name() + "\\\":";
+    vars_["json_key_len"] =
+        SimpleItoa(descriptor->camelcase_name().size() + 4);
+
+    vars_["ctype"] = CType(descriptor);
+    packed_ = descriptor->options().GetExtension(dx_json_packed);
+    if (packed_ && (!descriptor->is_repeated() || !is_scalar_array() ||
+                    descriptor->type() == FieldDescriptor::TYPE_BOOL)) {
+      error_->assign("dx_json_packed needs a repeated numeric field: " +
+                     descriptor->full_name());
+    }
+
+    map_key_ = map_val_ = NULL;
+    const FieldOptions& options = descriptor->options();
+    if (options.HasExtension(dx_map_key) || options.HasExtension(dx_map_val)) {
+      InitMap(options.GetExtension(dx_map_key),
+              options.GetExtension(dx_map_val));
+    }
+
+    bool is_message = descriptor->type() == FieldDescriptor::TYPE_MESSAGE;
+    if (options.GetExtension(dx_lazy) && (!is_message || is_map())) {
+      error_->assign("dx_lazy needs a message field that isn't a map: " +
+                     descriptor->full_name());
+    }
+    lazy_ = is_message && !is_map() &&
+        (options.GetExtension(dx_lazy) || generator_options.lazy_messages);
+    if (is_message) {
+      vars_["class"] = objc::ClassName(descriptor->message_type());
+    }
+    if (lazy_) {
+      vars_["lazy"] = "lazy" + vars_["ufield"];
+    }
   }
 
-  void GenerateFromDict(io::Printer* p) {
+  // The field's entry in the DXLazyField table for DXInstallLazyFields().
+  void GenerateLazyField(io::Printer* p) {
+    if (descriptor_->is_repeated()) {
+      p->Print(vars_,
+               "{\"$lazy$\", \"$field$Array\", NULL,"
+               " \"$field$ $field$Array $field$AtIndex:\"},\n");
+    } else {
+      p->Print(vars_,
+               "{\"$lazy$\", \"$field$\", \"has$ufield$\","
+               " \"$field$ has$ufield$\"},\n");
+    }
+  }
+
+  bool is_map() const { return map_key_ != NULL; }
+
+  // Parsing keeps the field's JSON in a DXLazyValue; -lazyFoo decodes it.
+  bool is_lazy() const { return lazy_; }
+
+  // Repeated scalars are backed by a C array (PBArray), which we read and
+  // set in bulk rather than an element at a time.
+  bool is_scalar_array() const {
+    return descriptor_->is_repeated() && !vars_.find("ctype")->second.empty();
+  }
+
+  // Repeated messages other than maps are converted with DXParallelMap().
+  bool is_message_array() const {
+    return descriptor_->is_repeated() && !is_map() &&
+        descriptor_->type() == FieldDescriptor::TYPE_MESSAGE;
+  }
+
+  // -fooMap and -fooForKey: on messages with a dx_map_key field foo.
+  void GenerateMapAccessorHeader(io::Printer* p) {
     p->Print(vars_,
-             "tmp = [dict objectForKey:@\"$field$\"];\n"
-             "if (tmp != nil) {\n");
-    p->Indent(); p->Indent();
+             "- (NSDictionary*) $field$Map;\n"
+             "\n"
+             "- ($val_type$*) $field$ForKey:($key_type$*) key;\n"
+             "\n");
+  }
+
+  // The map is built on first use from the pair array and kept with the
+  // message, so lookups are O(1) afterwards.
+  void GenerateMapAccessorImpl(io::Printer* p) {
+    p->Print(vars_,
+             "- (NSDictionary*) $field$Map {\n"
+             "    return DXCachedObject(self, @selector($field$Map), ^id {\n"
+             "        NSMutableDictionary *m = [NSMutableDictionary"
+             " dictionaryWithCapacity:self.$field$Array.count];\n"
+             "        for (int i = 0; i < self.$field$Array.count; i++) {\n"
+             "            $entry_class$ *e = [self $field$AtIndex:i];\n");
+    p->Print("            [m setObject:$val$ forKey:$key$];\n",
+             "val", BoxedObj(map_val_, "e." + map_val_->camelcase_name()),
+             "key", BoxedObj(map_key_, "e." + map_key_->camelcase_name()));
+    p->Print(vars_,
+             "        }\n"
+             "        return m;\n"
+             "    });\n"
+             "}\n\n"
+             "- ($val_type$*) $field$ForKey:($key_type$*) key {\n"
+             "    return [[self $field$Map] objectForKey:key];\n"
+             "}\n\n");
+  }
 
+  // -lazyFoo returns the field, decoding it on first use if it was parsed
+  // lazily.  Repeated fields come back as an NSArray.  JSON of the wrong
+  // shape decodes to nil or an empty array, see DXLazyDecodeError().
+  void GenerateLazyAccessorHeader(io::Printer* p) {
     if (descriptor_->is_repeated()) {
+      p->Print(vars_, "- (NSArray*) $lazy$;\n\n");
+    } else {
+      p->Print(vars_, "- ($class$*) $lazy$;\n\n");
+    }
+  }
+
+  void GenerateLazyAccessorImpl(io::Printer* p) {
+    if (!descriptor_->is_repeated()) {
+      p->Print(vars_,
+               "- ($class$*) $lazy$ {\n"
+               "    DXLazyValue *lazy = DXGetLazyValue(self, @selector($lazy$));\n"
+               "    if (lazy == nil) {\n"
+               "        return self.$field$;\n"
+               "    }\n"
+               "    return [lazy valueForOwner:self withDecoder:"
+               "^id (id object, NSData *json, NSError **error) {\n"
+               "        if (object != nil) {\n"
+               "            if (![object isKindOfClass:[NSDictionary class]])"
+               " {\n"
+               "                *error = DXJSONTypeError();\n"
+               "                return nil;\n"
+               "            }\n"
+               "            return [$class$ parseFromDict:object];\n"
+               "        }\n"
+               "        return [$class$ parseFromJSONData:json error:error];\n"
+               "    }];\n"
+               "}\n\n");
+      return;
+    }
+    p->Print(vars_,
+             "- (NSArray*) $lazy$ {\n"
+             "    DXLazyValue *lazy = DXGetLazyValue(self, @selector($lazy$));\n"
+             "    if (lazy == nil) {\n"
+             "        NSMutableArray *arr = [NSMutableArray"
+             " arrayWithCapacity:self.$field$Array.count];\n"
+             "        for (int i = 0; i < self.$field$Array.count; i++) {\n"
+             "            [arr addObject:[self $field$AtIndex:i]];\n"
+             "        }\n"
+             "        return arr;\n"
+             "    }\n"
+             "    return [lazy valueForOwner:self withDecoder:"
+             "^id (id object, NSData *json, NSError **error) {\n"
+             "        if (object != nil) {\n"
+             "            if (!DXIsArrayOf(object, [NSDictionary class])) {\n"
+             "                *error = DXJSONTypeError();\n"
+             "                return @[];\n"
+             "            }\n"
+             "            NSArray *elems = (NSArray *)object;\n"
+             "            return DXParallelMap(elems.count, ^id (NSUInteger i) {\n"
+             "                id x = elems[i];\n"
+             "                return x == [NSNull null] ? nil"
+             " : [$class$ parseFromDict:x];\n"
+             "            });\n"
+             "        }\n"
+             "        NSMutableArray *arr = [NSMutableArray new];\n"
+             "        DXJSONReader r;\n"
+             "        DXJSONReaderInit(&r, json);\n"
+             "        if (DXJSONReadArrayStart(&r)) {\n"
+             "            while (DXJSONReadArrayNext(&r)) {\n"
+             "                if (DXJSONReadNull(&r)) {\n"
+             "                    continue;\n"
+             "                }\n"
+             "                $class$ *x = [$class$ parseFromJSONReader:&r];\n"
+             "                if (x != nil && !r.failed) {\n"
+             "                    [arr addObject:x];\n"
+             "                }\n"
+             "            }\n"
+             "        }\n"
+             "        if (!DXJSONReaderAtEnd(&r)) {\n"
+             "            *error = DXJSONReaderError(&r);\n"
+             "            return @[];\n"
+             "        }\n"
+             "        return arr;\n"
+             "    }];\n"
+             "}\n\n");
+  }
+
+  // Declares the variable a lazy field's DXLazyValue is parsed into.
+  void GenerateLazyDecl(io::Printer* p, bool in_block) {
+    p->Print(vars_, in_block ? "__block DXLazyValue *$lazy$ = nil;\n"
+                             : "DXLazyValue *$lazy$ = nil;\n");
+  }
+
+  // Hangs the lazy value off the built message `msg`.
+  void GenerateLazyAttach(io::Printer* p) {
+    p->Print(vars_, "DXSetLazyValue(msg, @selector($lazy$), $lazy$);\n");
+  }
+
+  // Sets the field from the dictionary value `tmp`.
+  void GenerateFromDict(io::Printer* p) {
+    if (lazy_) {
+      p->Print(vars_, "$lazy$ = [[DXLazyValue alloc] initWithObject:tmp];\n");
+    } else if (is_map()) {
+      p->Print(vars_,
+               "__block $entry_class$Builder *e = nil;\n"
+               "[(NSDictionary *)tmp enumerateKeysAndObjectsUsingBlock:"
+               "^(NSString *mkey, id mval, BOOL *mstop) {\n"
+               "    if (mval == [NSNull null]) {\n"
+               "        return;\n"
+               "    }\n");
+      p->Indent(); p->Indent();
+      GenerateMapEntry(p, MapKeyFromString(map_key_, "mkey"),
+                       GetParsed(map_val_, "mval"));
+      p->Outdent(); p->Outdent();
+      p->Print("}];\n");
+    } else if (packed_) {
+      p->Print(vars_,
+               "NSData *packed = DXDataFromBase64String((NSString *)tmp);\n"
+               "[builder set$ufield$Values:(const $ctype$ *)packed.bytes"
+               " count:packed.length / sizeof($ctype$)];\n");
+    } else if (is_scalar_array()) {
+      p->Print(vars_,
+               "NSArray *arr = (NSArray *)tmp;\n"
+               "$ctype$ *values = malloc(arr.count * sizeof($ctype$));\n"
+               "for (NSUInteger i = 0; i < arr.count; i++) {\n");
+      p->Print("    values[i] = $val$;\n",
+               "val", GetParsed(descriptor_, "arr[i]"));
+      p->Print(vars_,
+               "}\n"
+               "[builder set$ufield$Values:values count:arr.count];\n"
+               "free(values);\n");
+    } else if (is_message_array()) {
+      // Big arrays are parsed on all cores, see DXParallelMap().
+      p->Print(vars_,
+               "NSArray *arr = (NSArray *)tmp;\n"
+               "NSArray *parsed = DXParallelMap(arr.count, ^id (NSUInteger i) {\n"
+               "    return [$class$ parseFromDict:arr[i]];\n"
+               "});\n"
+               "for (id x in parsed) {\n"
+               "    [builder add$ufield$:x];\n"
+               "}\n");
+    } else if (descriptor_->is_repeated()) {
       p->Print("for (id x in (NSArray *)tmp) {\n"
                "    [builder add$ufield$:$val$];\n"
                "}\n",
@@ -121,15 +584,71 @@ class FieldGenerator {
                "field", vars_["field"],
                "val", GetParsed(descriptor_, "tmp"));
     }
-
-    p->Outdent(); p->Outdent();
-    p->Print("}\n");
   }
 
   void GenerateToDict(io::Printer* p) {
-    if (descriptor_->is_repeated()) {
+    if (lazy_) {
+      // A field that hasn't been decoded goes back out as the JSON it came
+      // in as.  Reading it through the getter would decode it.
+      p->Print(vars_,
+               "DXLazyValue *$lazy$ = DXGetLazyValue(self, @selector($lazy$));\n"
+               "if ($lazy$ != nil) {\n"
+               "    [dict setObject:DXLazyValueJSONObject($lazy$)"
+               " forKey:@\"$field$\"];\n"
+               "} else {\n");
+      p->Indent(); p->Indent();
+    }
+    if (is_map()) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    NSMutableDictionary *m = [NSMutableDictionary"
+               " dictionaryWithCapacity:self.$field$Array.count];\n"
+               "    for (int i = 0; i < self.$field$Array.count; i++) {\n"
+               "        $entry_class$ *e = [self $field$AtIndex:i];\n");
+      p->Print("        [m setObject:$val$ forKey:$key$];\n",
+               "val", GetObjForDict(map_val_,
+                                    "e." + map_val_->camelcase_name()),
+               "key", MapKeyToString(map_key_,
+                                     "e." + map_key_->camelcase_name()));
+      p->Print(vars_,
+               "    }\n"
+               "    [dict setObject:m forKey:@\"$field$\"];\n"
+               "}\n");
+    } else if (packed_) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    NSData *packed = [NSData"
+               " dataWithBytesNoCopy:(void *)self.$field$Array.data"
+               " length:self.$field$Array.count * sizeof($ctype$)"
+               " freeWhenDone:NO];\n"
+               "    [dict setObject:DXBase64String(packed)"
+               " forKey:@\"$field$\"];\n"
+               "}\n");
+    } else if (is_scalar_array()) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    NSUInteger n = self.$field$Array.count;\n"
+               "    const $ctype$ *values = self.$field$Array.data;\n"
+               "    NSMutableArray *arr = [NSMutableArray"
+               " arrayWithCapacity:n];\n"
+               "    for (NSUInteger i = 0; i < n; i++) {\n"
+               "        [arr addObject:@(values[i])];\n"
+               "    }\n"
+               "    [dict setObject:arr forKey:@\"$field$\"];\n"
+               "}\n");
+    } else if (is_message_array()) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    NSArray *arr = DXParallelMap(self.$field$Array.count,"
+               " ^id (NSUInteger i) {\n"
+               "        return [[self $field$AtIndex:i] toDict];\n"
+               "    });\n"
+               "    [dict setObject:arr forKey:@\"$field$\"];\n"
+               "}\n");
+    } else if (descriptor_->is_repeated()) {
       p->Print("if (self.$field$Array.count > 0) {\n"
-               "    NSMutableArray *arr = [NSMutableArray new];\n"
+               "    NSMutableArray *arr = [NSMutableArray"
+               " arrayWithCapacity:self.$field$Array.count];\n"
                "    for (int i = 0; i < self.$field$Array.count; i++) {\n"
                "        [arr addObject:$obj$];\n"
                "    }\n"
@@ -147,19 +666,333 @@ class FieldGenerator {
                "ufield", objc::UnderscoresToCapitalizedCamelCase(descriptor_),
                "obj", GetObjForDict(descriptor_, "self." + vars_["field"]));
     }
+    if (lazy_) {
+      p->Outdent(); p->Outdent();
+      p->Print("}\n");
+    }
+  }
+
+  void GenerateWriteJSON(io::Printer* p) {
+    if (lazy_) {
+      p->Print(vars_,
+               "DXLazyValue *$lazy$ = DXGetLazyValue(self, @selector($lazy$));\n"
+               "if ($lazy$ != nil) {\n"
+               "    DXJSONWriteKey(w, \"$json_key$\", $json_key_len$);\n"
+               "    DXJSONWriteLazyValue(w, $lazy$);\n"
+               "} else {\n");
+      p->Indent(); p->Indent();
+    }
+    if (is_map()) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    DXJSONWriteKey(w, \"$json_key$\", $json_key_len$);\n"
+               "    DXJSONWriteByte(w, '{');\n"
+               "    for (int i = 0; i < self.$field$Array.count; i++) {\n"
+               "        $entry_class$ *e = [self $field$AtIndex:i];\n"
+               "        if (i > 0) {\n"
+               "            DXJSONWriteByte(w, ',');\n"
+               "        }\n");
+      string key = "e." + map_key_->camelcase_name();
+      if (IsIntegerKey(map_key_)) {
+        p->Print("        DXJSONWriteByte(w, '\"');\n"
+                 "        $write$\n"
+                 "        DXJSONWriteByte(w, '\"');\n",
+                 "write", GetJSONWrite(map_key_, key));
+      } else {
+        p->Print("        DXJSONWriteString(w, $key$);\n", "key", key);
+      }
+      p->Print("        DXJSONWriteByte(w, ':');\n"
+               "        $write$\n"
+               "    }\n"
+               "    DXJSONWriteByte(w, '}');\n"
+               "}\n",
+               "write", GetJSONWrite(map_val_,
+                                     "e." + map_val_->camelcase_name()));
+    } else if (packed_) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    DXJSONWriteKey(w, \"$json_key$\", $json_key_len$);\n"
+               "    DXJSONWriteData(w, [NSData"
+               " dataWithBytesNoCopy:(void *)self.$field$Array.data"
+               " length:self.$field$Array.count * sizeof($ctype$)"
+               " freeWhenDone:NO]);\n"
+               "}\n");
+    } else if (is_scalar_array()) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    NSUInteger n = self.$field$Array.count;\n"
+               "    const $ctype$ *values = self.$field$Array.data;\n"
+               "    DXJSONWriteKey(w, \"$json_key$\", $json_key_len$);\n"
+               "    DXJSONWriteByte(w, '[');\n"
+               "    for (NSUInteger i = 0; i < n; i++) {\n"
+               "        if (i > 0) {\n"
+               "            DXJSONWriteByte(w, ',');\n"
+               "        }\n");
+      p->Print("        $write$\n",
+               "write", GetJSONWrite(descriptor_, "values[i]"));
+      p->Print("    }\n"
+               "    DXJSONWriteByte(w, ']');\n"
+               "}\n");
+    } else if (descriptor_->is_repeated()) {
+      p->Print(vars_,
+               "if (self.$field$Array.count > 0) {\n"
+               "    DXJSONWriteKey(w, \"$json_key$\", $json_key_len$);\n"
+               "    DXJSONWriteByte(w, '[');\n"
+               "    for (int i = 0; i < self.$field$Array.count; i++) {\n"
+               "        if (i > 0) {\n"
+               "            DXJSONWriteByte(w, ',');\n"
+               "        }\n");
+      p->Print("        $write$\n",
+               "write", GetJSONWrite(
+                   descriptor_, "[self " + vars_["field"] + "AtIndex:i]"));
+      p->Print("    }\n"
+               "    DXJSONWriteByte(w, ']');\n"
+               "}\n");
+    } else {
+      p->Print(vars_,
+               "if (self.has$ufield$) {\n"
+               "    DXJSONWriteKey(w, \"$json_key$\", $json_key_len$);\n");
+      p->Print("    $write$\n"
+               "}\n",
+               "write", GetJSONWrite(descriptor_, "self." + vars_["field"]));
+    }
+    if (lazy_) {
+      p->Outdent(); p->Outdent();
+      p->Print("}\n");
+    }
+  }
+
+  // Reads the value for this field's key from the DXJSONReader `r`.
+  void GenerateReadJSON(io::Printer* p) {
+    if (lazy_) {
+      p->Print(vars_,
+               "if (!DXJSONReadNull(r)) {\n"
+               "    $lazy$ = DXJSONReadLazyValue(r);\n"
+               "}\n");
+    } else if (is_map()) {
+      p->Print(vars_,
+               "if (DXJSONReadObjectStart(r)) {\n"
+               "    $entry_class$Builder *e = nil;\n"
+               "    const char *mkey;\n"
+               "    size_t mlen;\n"
+               "    while (DXJSONReadKey(r, &mkey, &mlen)) {\n"
+               "        if (DXJSONReadNull(r)) {\n"
+               "            continue;\n"
+               "        }\n");
+      p->Indent(); p->Indent(); p->Indent(); p->Indent();
+      GenerateMapEntry(p, MapKeyFromJSON(map_key_), GetJSONRead(map_val_));
+      p->Outdent(); p->Outdent(); p->Outdent(); p->Outdent();
+      p->Print("    }\n"
+               "}\n");
+    } else if (packed_) {
+      p->Print(vars_,
+               "if (!DXJSONReadNull(r)) {\n"
+               "    NSData *packed = DXJSONReadData(r);\n"
+               "    [builder set$ufield$Values:(const $ctype$ *)packed.bytes"
+               " count:packed.length / sizeof($ctype$)];\n"
+               "}\n");
+    } else if (is_scalar_array()) {
+      // The writer doubles as a growable scratch buffer for the values.
+      p->Print(vars_,
+               "if (DXJSONReadArrayStart(r)) {\n"
+               "    DXJSONWriter values;\n"
+               "    DXJSONWriterInit(&values, 64 * sizeof($ctype$));\n"
+               "    while (DXJSONReadArrayNext(r)) {\n");
+      p->Print("        $ctype$ v = $val$;\n",
+               "ctype", vars_["ctype"],
+               "val", GetJSONRead(descriptor_));
+      p->Print(vars_,
+               "        DXJSONWriteBytes(&values, (const char *)&v,"
+               " sizeof(v));\n"
+               "    }\n"
+               "    [builder set$ufield$Values:(const $ctype$ *)values.bytes"
+               " count:values.length / sizeof($ctype$)];\n"
+               "    free(values.bytes);\n"
+               "}\n");
+    } else if (descriptor_->is_repeated()) {
+      p->Print("if (DXJSONReadArrayStart(r)) {\n"
+               "    while (DXJSONReadArrayNext(r)) {\n");
+      // Null elements can't go in the array; skip them.
+      if (descriptor_->cpp_type() == FieldDescriptor::CPPTYPE_STRING ||
+          descriptor_->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+        p->Print("        if (DXJSONReadNull(r)) {\n"
+                 "            continue;\n"
+                 "        }\n");
+      }
+      // A wrong-typed element reads as nil and fails the reader, which
+      // ends the loop; -add...:nil would throw.
+      p->Print("        id value = $val$;\n"
+               "        if (value != nil && !r->failed) {\n"
+               "            [builder add$ufield$:value];\n"
+               "        }\n"
+               "    }\n"
+               "}\n",
+               "ufield", vars_["ufield"],
+               "val", GetJSONRead(descriptor_));
+    } else {
+      p->Print("if (!DXJSONReadNull(r)) {\n"
+               "    builder.$field$ = $val$;\n"
+               "}\n",
+               "field", vars_["field"],
+               "val", GetJSONRead(descriptor_));
+    }
   }
 
  private:
+  // A dx_map_key field must be a repeated message whose key field is a string
+  // or integer; it's a JSON object on the wire.
+  void InitMap(const string& key_name, const string& val_name) {
+    const Descriptor* entry = descriptor_->message_type();
+    if (!descriptor_->is_repeated() || entry == NULL) {
+      error_->assign("dx_map_key field must be a repeated message: " +
+                     descriptor_->full_name());
+      return;
+    }
+    const FieldDescriptor* key = entry->FindFieldByName(key_name);
+    const FieldDescriptor* val = entry->FindFieldByName(val_name);
+    if (key == NULL || val == NULL || key->is_repeated() ||
+        val->is_repeated()) {
+      error_->assign("dx_map_key/dx_map_val must name two singular fields "
+                     "of " + entry->full_name());
+      return;
+    }
+    if (key->type() != FieldDescriptor::TYPE_STRING && !IsIntegerKey(key)) {
+      error_->assign("Map key must be a string or integer: " +
+                     key->full_name());
+      return;
+    }
+    map_key_ = key;
+    map_val_ = val;
+    vars_["entry_class"] = objc::ClassName(entry);
+    vars_["key_type"] = BoxedType(key);
+    vars_["val_type"] = BoxedType(val);
+  }
+
+  // Adds one pair built straight from `key` and `val` expressions.
+  // Adds one key/value pair to the field.  The field is an array of entry
+  // messages, so each pair needs its own; the one builder `e` (declared
+  // nil by the caller) is reset with -clear rather than made per entry.
+  void GenerateMapEntry(io::Printer* p, const string& key, const string& val) {
+    p->Print(vars_,
+             "e = e == nil ? [$entry_class$ builder] : [e clear];\n");
+    p->Print("e.$key_field$ = $key$;\n"
+             "e.$val_field$ = $val$;\n",
+             "key_field", map_key_->camelcase_name(),
+             "key", key,
+             "val_field", map_val_->camelcase_name(),
+             "val", val);
+    p->Print(vars_,
+             "[builder add$ufield$:[e build]];\n");
+  }
+
   const FieldDescriptor* descriptor_;
   string* error_;
   map<string, string> vars_;
+  const FieldDescriptor* map_key_;
+  const FieldDescriptor* map_val_;
+  bool packed_;
+  bool lazy_;
 };
 
+typedef vector<const FieldDescriptor*> FieldList;
+
+// Dispatches a JSON key of a known length to one of `fields`, which all have
+// keys of that length.  Switches on the character that tells the most of
+// them apart until one candidate is left, then checks it with memcmp.
+// With `from_dict` the key is the NSString `key` of +parseFromDict:, and
+// the field is set from `tmp`.  `generators` holds the message's fields by
+// index.
+static void GenerateKeyDispatch(io::Printer* p,
+                                const FieldList& fields,
+                                bool from_dict,
+                                vector<FieldGenerator>& generators) {
+  size_t len = fields[0]->camelcase_name().size();
+  size_t best_pos = 0;
+  map<char, FieldList> best;
+  for (size_t pos = 0; pos < len && fields.size() > 1; pos++) {
+    map<char, FieldList> groups;
+    for (int i = 0; i < fields.size(); i++) {
+      groups[fields[i]->camelcase_name()[pos]].push_back(fields[i]);
+    }
+    if (groups.size() > best.size()) {
+      best_pos = pos;
+      best.swap(groups);
+    }
+  }
+
+  if (best.size() <= 1) {
+    // One field, or several with the same key; the first one wins.
+    for (int i = 0; i < fields.size(); i++) {
+      p->Print(from_dict ? "if ([key isEqualToString:@\"$key$\"]) {\n"
+                         : "if (memcmp(key, \"$key$\", $len$) == 0) {\n",
+               "key", fields[i]->camelcase_name(),
+               "len", SimpleItoa(len));
+      p->Indent(); p->Indent();
+      if (from_dict) {
+        generators[fields[i]->index()].GenerateFromDict(p);
+        p->Print("return;\n");
+      } else {
+        generators[fields[i]->index()].GenerateReadJSON(p);
+        p->Print("continue;\n");
+      }
+      p->Outdent(); p->Outdent();
+      p->Print("}\n");
+    }
+    return;
+  }
+
+  p->Print(from_dict ? "switch ([key characterAtIndex:$pos$]) {\n"
+                     : "switch (key[$pos$]) {\n",
+           "pos", SimpleItoa(best_pos));
+  for (map<char, FieldList>::iterator it = best.begin();
+       it != best.end(); ++it) {
+    p->Print("case '$c$':\n", "c", string(1, it->first));
+    p->Indent(); p->Indent();
+    GenerateKeyDispatch(p, it->second, from_dict, generators);
+    p->Print("break;\n");
+    p->Outdent(); p->Outdent();
+  }
+  p->Print("}\n");
+}
+
+// Switches on the key's length, then GenerateKeyDispatch() for the fields
+// of that length.
+static void GenerateKeySwitch(io::Printer* p,
+                              const Descriptor* descriptor,
+                              bool from_dict,
+                              vector<FieldGenerator>& generators) {
+  map<size_t, FieldList> by_length;
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    const FieldDescriptor* field = descriptor->field(i);
+    by_length[field->camelcase_name().size()].push_back(field);
+  }
+  if (by_length.empty()) {
+    return;
+  }
+  p->Print(from_dict ? "switch (key.length) {\n" : "switch (len) {\n");
+  for (map<size_t, FieldList>::iterator it = by_length.begin();
+       it != by_length.end(); ++it) {
+    p->Print("case $len$:\n", "len", SimpleItoa(it->first));
+    p->Indent(); p->Indent();
+    GenerateKeyDispatch(p, it->second, from_dict, generators);
+    p->Print("break;\n");
+    p->Outdent(); p->Outdent();
+  }
+  p->Print("}\n");
+}
+
 class MessageGenerator {
  public:
-  MessageGenerator(const Descriptor* descriptor, string* error)
-      : descriptor_(descriptor), error_(error) {
+  MessageGenerator(const Descriptor* descriptor,
+                   const GeneratorOptions& options,
+                   string* error)
+      : descriptor_(descriptor), options_(options), error_(error) {
     vars_["classname"] = objc::ClassName(descriptor);
+    // Built once; every method below walks the fields several times.
+    fields_.reserve(descriptor->field_count());
+    for (int i = 0; i < descriptor->field_count(); i++) {
+      fields_.push_back(FieldGenerator(descriptor->field(i), options, error));
+    }
   }
 
   void GenerateHeader(io::Printer* p) {
@@ -167,7 +1000,31 @@ class MessageGenerator {
              "+ ($classname$*) parseFromDict:(id) dict;\n"
              "\n"
              "- (NSDictionary*) toDict;\n"
-             "");
+             "\n"
+             "// Only the fields named in `mask`, e.g. for sparse updates.\n"
+             "- (NSDictionary*) toDictWithMask:(NSArray<$classname$Field> *) mask;\n"
+             "\n"
+             "- (void) writeJSONTo:(DXJSONWriter *) w;\n"
+             "\n"
+             "- (NSData*) toJSONData;\n"
+             "\n"
+             "+ ($classname$*) parseFromJSONReader:(DXJSONReader *) r;\n"
+             "\n"
+             "+ ($classname$*) parseFromJSONData:(NSData*) data;\n"
+             "\n"
+             "+ ($classname$*) parseFromJSONData:(NSData*) data"
+             " error:(NSError**) error;\n"
+             "\n");
+
+    for (int i = 0; i < fields_.size(); i++) {
+      FieldGenerator& field = fields_[i];
+      if (field.is_map()) {
+        field.GenerateMapAccessorHeader(p);
+      }
+      if (field.is_lazy()) {
+        field.GenerateLazyAccessorHeader(p);
+      }
+    }
   }
 
   void GenerateImpl(io::Printer* p) {
@@ -179,12 +1036,10 @@ class MessageGenerator {
     if (descriptor_->field_count() > 0) {
       p->Print(vars_,
                "$classname$Builder *builder = [$classname$ builder];\n"
-               "NSDictionary *dict = (NSDictionary *)obj;\n"
-               "id tmp;\n");
-      for (int i = 0; i < descriptor_->field_count(); i++) {
-        FieldGenerator(descriptor_->field(i), error_).GenerateFromDict(p);
-      }
-      p->Print("return [builder build];\n");
+               "NSDictionary *dict = (NSDictionary *)obj;\n");
+      GenerateLazyDecls(p, true);
+      GenerateFromDictKeys(p);
+      GenerateBuild(p);
     } else {
       p->Print("return nil;\n");
     }
@@ -197,68 +1052,376 @@ class MessageGenerator {
     p->Indent(); p->Indent();
     p->Print("NSMutableDictionary *dict = [NSMutableDictionary new];\n");
     for (int i = 0; i < descriptor_->field_count(); i++) {
-      FieldGenerator(descriptor_->field(i), error_).GenerateToDict(p);
+      fields_[i].GenerateToDict(p);
     }
     p->Print("return dict;\n");
     p->Outdent(); p->Outdent();
     p->Print("}\n\n");
+
+    // toDictWithMask:
+    p->Print(vars_,
+             "- (NSDictionary*) toDictWithMask:(NSArray<$classname$Field> *) mask {\n");
+    p->Indent(); p->Indent();
+    p->Print("NSSet *fields = [NSSet setWithArray:mask];\n"
+             "NSMutableDictionary *dict = [NSMutableDictionary new];\n");
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      p->Print("if ([fields containsObject:@\"$field$\"]) {\n",
+               "field", descriptor_->field(i)->camelcase_name());
+      p->Indent(); p->Indent();
+      fields_[i].GenerateToDict(p);
+      p->Outdent(); p->Outdent();
+      p->Print("}\n");
+    }
+    p->Print("return dict;\n");
+    p->Outdent(); p->Outdent();
+    p->Print("}\n\n");
+
+    // writeJSONTo:
+    p->Print("- (void) writeJSONTo:(DXJSONWriter *) w {\n");
+    p->Indent(); p->Indent();
+    p->Print("DXJSONWriteByte(w, '{');\n");
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_[i].GenerateWriteJSON(p);
+    }
+    p->Print("DXJSONWriteByte(w, '}');\n");
+    p->Outdent(); p->Outdent();
+    p->Print("}\n\n");
+
+    p->Print("- (NSData*) toJSONData {\n"
+             "    DXJSONWriter w;\n"
+             "    DXJSONWriterInit(&w, 256);\n"
+             "    [self writeJSONTo:&w];\n"
+             "    return DXJSONWriterFinish(&w);\n"
+             "}\n\n");
+
+    GenerateParseFromJSON(p);
+    GenerateInstallLazyFields(p);
+
+    for (int i = 0; i < fields_.size(); i++) {
+      FieldGenerator& field = fields_[i];
+      if (field.is_map()) {
+        field.GenerateMapAccessorImpl(p);
+      }
+      if (field.is_lazy()) {
+        field.GenerateLazyAccessorImpl(p);
+      }
+    }
+  }
+
+  // The $classname$Field type and one constant per field, named after the
+  // field and holding its JSON key.  These go before the classes.
+  void GenerateFieldConstantsHeader(io::Printer* p) {
+    p->Print(vars_, "typedef NSString *$classname$Field NS_TYPED_ENUM;\n");
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      const FieldDescriptor* field = descriptor_->field(i);
+      p->Print("extern $classname$Field const $classname$Field$ufield$;\n",
+               "classname", vars_["classname"],
+               "ufield", objc::UnderscoresToCapitalizedCamelCase(field));
+    }
+    p->Print("\n");
+  }
+
+  void GenerateFieldConstantsImpl(io::Printer* p) {
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      const FieldDescriptor* field = descriptor_->field(i);
+      p->Print("$classname$Field const $classname$Field$ufield$ ="
+               " @\"$field$\";\n",
+               "classname", vars_["classname"],
+               "ufield", objc::UnderscoresToCapitalizedCamelCase(field),
+               "field", field->camelcase_name());
+    }
+  }
+
+  // Walks the dictionary once rather than looking up every declared field,
+  // which matters for wide messages where most fields are absent.  Keys go
+  // to their field through a perfect hash picked here from the field names.
+  void GenerateFromDictKeys(io::Printer* p) {
+    vector<string> keys;
+    map<string, FieldList> fields_by_key;
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      const FieldDescriptor* field = descriptor_->field(i);
+      FieldList& fields = fields_by_key[field->camelcase_name()];
+      if (fields.empty()) {
+        keys.push_back(field->camelcase_name());
+      }
+      fields.push_back(field);
+    }
+
+    uint32 seed, mask;
+    if (!FindPerfectHash(keys, &seed, &mask)) {
+      // No seed separates the keys; dispatch on their characters instead,
+      // as +parseFromJSONReader: does.
+      p->Print("[dict enumerateKeysAndObjectsUsingBlock:"
+               "^(NSString *key, id tmp, BOOL *stop) {\n");
+      p->Indent(); p->Indent();
+      p->Print("if (tmp == [NSNull null]) {\n"
+               "    return;\n"
+               "}\n");
+      GenerateKeySwitch(p, descriptor_, true, fields_);
+      p->Outdent(); p->Outdent();
+      p->Print("}];\n");
+      return;
+    }
+    map<uint32, string> key_by_slot;
+    for (int i = 0; i < keys.size(); i++) {
+      key_by_slot[KeyHash(keys[i], seed) & mask] = keys[i];
+    }
+
+    p->Print("[dict enumerateKeysAndObjectsUsingBlock:"
+             "^(NSString *key, id tmp, BOOL *stop) {\n");
+    p->Indent(); p->Indent();
+    p->Print("if (tmp == [NSNull null]) {\n"
+             "    return;\n"
+             "}\n"
+             "switch (DXKeyHash(key, $seed$) & $mask$) {\n",
+             "seed", SimpleItoa(seed),
+             "mask", SimpleItoa(mask));
+    for (map<uint32, string>::iterator it = key_by_slot.begin();
+         it != key_by_slot.end(); ++it) {
+      // Several fields can share a key; the first one wins.
+      const FieldList& fields = fields_by_key[it->second];
+      p->Print("case $slot$:\n"
+               "    if ([key isEqualToString:@\"$key$\"]) {\n",
+               "slot", SimpleItoa(it->first),
+               "key", it->second);
+      p->Indent(); p->Indent(); p->Indent(); p->Indent();
+      fields_[fields[0]->index()].GenerateFromDict(p);
+      p->Outdent(); p->Outdent(); p->Outdent(); p->Outdent();
+      p->Print("    }\n"
+               "    break;\n");
+    }
+    p->Print("}\n");
+    p->Outdent(); p->Outdent();
+    p->Print("}];\n");
+  }
+
+  // Single pass over the JSON bytes.  Keys are dispatched on their length
+  // and then their characters, so we never hash or allocate for a key.
+  void GenerateParseFromJSON(io::Printer* p) {
+    p->Print(vars_,
+             "+ ($classname$*) parseFromJSONReader:(DXJSONReader *) r {\n");
+    p->Indent(); p->Indent();
+    p->Print(vars_,
+             "$classname$Builder *builder = [$classname$ builder];\n"
+             "const char *key;\n"
+             "size_t len;\n"
+             "if (!DXJSONReadObjectStart(r)) {\n"
+             "    return nil;\n"
+             "}\n");
+    GenerateLazyDecls(p, false);
+    p->Print("while (DXJSONReadKey(r, &key, &len)) {\n");
+    p->Indent(); p->Indent();
+
+    GenerateKeySwitch(p, descriptor_, false, fields_);
+    p->Print("DXJSONSkipValue(r);\n");
+
+    p->Outdent(); p->Outdent();
+    p->Print("}\n");
+    GenerateBuild(p);
+    p->Outdent(); p->Outdent();
+    p->Print("}\n\n");
+
+    p->Print(vars_,
+             "+ ($classname$*) parseFromJSONData:(NSData*) data {\n"
+             "    return [$classname$ parseFromJSONData:data error:NULL];\n"
+             "}\n\n"
+             "+ ($classname$*) parseFromJSONData:(NSData*) data"
+             " error:(NSError**) error {\n"
+             "    DXJSONReader r;\n"
+             "    DXJSONReaderInit(&r, data);\n"
+             "    $classname$ *res = [$classname$ parseFromJSONReader:&r];\n"
+             "    if (!DXJSONReaderAtEnd(&r)) {\n"
+             "        if (error != NULL) {\n"
+             "            *error = DXJSONReaderError(&r);\n"
+             "        }\n"
+             "        return nil;\n"
+             "    }\n"
+             "    return res;\n"
+             "}\n\n");
   }
 
  private:
+  // Hooks the lazy fields into the getters protoc-gen-objc made, once, so
+  // msg.foo, -data and builders see them; see DXInstallLazyFields().
+  void GenerateInstallLazyFields(io::Printer* p) {
+    vector<FieldGenerator*> lazy = LazyFields();
+    if (lazy.empty()) {
+      return;
+    }
+    p->Print(vars_,
+             "+ (void) installLazyFields {\n"
+             "    static const DXLazyField fields[] = {\n");
+    p->Indent(); p->Indent(); p->Indent(); p->Indent();
+    for (int i = 0; i < lazy.size(); i++) {
+      lazy[i]->GenerateLazyField(p);
+    }
+    p->Outdent(); p->Outdent(); p->Outdent(); p->Outdent();
+    // An accessor that can't be hooked would read as empty; stop instead.
+    p->Print(vars_,
+             "    };\n"
+             "    static dispatch_once_t once;\n"
+             "    static BOOL installed;\n"
+             "    dispatch_once(&once, ^{\n"
+             "        installed = DXInstallLazyFields([$classname$ class],"
+             " fields, sizeof(fields) / sizeof(fields[0]));\n"
+             "    });\n"
+             "    if (!installed) {\n"
+             "        [NSException raise:NSInternalInconsistencyException"
+             " format:@\"$classname$ lacks the protoc-gen-objc accessors"
+             " dx_lazy hooks\"];\n"
+             "    }\n"
+             "}\n\n");
+  }
+
+  vector<FieldGenerator*> LazyFields() {
+    vector<FieldGenerator*> lazy;
+    for (int i = 0; i < fields_.size(); i++) {
+      if (fields_[i].is_lazy()) {
+        lazy.push_back(&fields_[i]);
+      }
+    }
+    return lazy;
+  }
+
+  void GenerateLazyDecls(io::Printer* p, bool in_block) {
+    for (int i = 0; i < fields_.size(); i++) {
+      if (fields_[i].is_lazy()) {
+        fields_[i].GenerateLazyDecl(p, in_block);
+      }
+    }
+  }
+
+  // Builds and returns the message, with any lazy values attached.
+  void GenerateBuild(io::Printer* p) {
+    vector<FieldGenerator*> lazy = LazyFields();
+    if (lazy.empty()) {
+      p->Print("return [builder build];\n");
+      return;
+    }
+    p->Print(vars_,
+             "[$classname$ installLazyFields];\n"
+             "$classname$ *msg = [builder build];\n");
+    for (int i = 0; i < lazy.size(); i++) {
+      lazy[i]->GenerateLazyAttach(p);
+    }
+    p->Print("return msg;\n");
+  }
+
   const Descriptor* descriptor_;
+  const GeneratorOptions& options_;
   string* error_;
   map<string, string> vars_;
+  vector<FieldGenerator> fields_;
 };
 
+bool ParseOptions(const string& parameter,
+                  GeneratorOptions* options,
+                  string* error) {
+  vector<pair<string, string> > params;
+  ParseGeneratorParameter(parameter, &params);
+  for (int i = 0; i < params.size(); i++) {
+    const string& key = params[i].first;
+    const string& value = params[i].second;
+    if (key == "runtime" && (value == "true" || value == "false")) {
+      options->emit_runtime = value == "true";
+    } else if (key == "lazy" && (value == "true" || value == "false")) {
+      options->lazy_messages = value == "true";
+    } else {
+      error->assign("Unknown parameter: " + key + "=" + value);
+      return false;
+    }
+  }
+  return true;
+}
 
-class MyCodeGenerator : public CodeGenerator {
- public:
-  virtual ~MyCodeGenerator() {}
+void doMessage(const Descriptor* d,
+               const string& path,
+               const GeneratorOptions& options,
+               GeneratorContext* context,
+               string* error) {
+  MessageGenerator gen(d, options, error);
+  string class_name = objc::ClassName(d);
 
-  static void doMessage(const Descriptor* d,
-                        const string& path,
-                        GeneratorContext* context,
-                        string* error) {
-    MessageGenerator gen(d, error);
-    string class_name = objc::ClassName(d);
+  {
+    scoped_ptr<io::ZeroCopyOutputStream> output(
+        context->OpenForInsert(path + ".pb.h", class_name));
+    io::Printer printer(output.get(), '$');
+    gen.GenerateHeader(&printer);
+  }
 
-    {
-      scoped_ptr<io::ZeroCopyOutputStream> output(
-          context->OpenForInsert(path + ".pb.h", class_name));
-      io::Printer printer(output.get(), '$');
-      gen.GenerateHeader(&printer);
-    }
+  {
+    scoped_ptr<io::ZeroCopyOutputStream> output(
+        context->OpenForInsert(path + ".pb.m", class_name));
+    io::Printer printer(output.get(), '$');
+    gen.GenerateImpl(&printer);
+  }
 
-    {
-      scoped_ptr<io::ZeroCopyOutputStream> output(
-          context->OpenForInsert(path + ".pb.m", class_name));
-      io::Printer printer(output.get(), '$');
-      gen.GenerateImpl(&printer);
-    }
+  for (int i = 0; i < d->nested_type_count(); i++) {
+    doMessage(d->nested_type(i), path, options, context, error);
+  }
+}
 
-    for (int i = 0; i < d->nested_type_count(); i++) {
-      doMessage(d->nested_type(i), path, context, error);
-    }
+// Field constants for `d` and its nested messages.
+void doFieldConstants(const Descriptor* d,
+                      const GeneratorOptions& options,
+                      io::Printer* header,
+                      io::Printer* impl,
+                      string* error) {
+  MessageGenerator gen(d, options, error);
+  gen.GenerateFieldConstantsHeader(header);
+  gen.GenerateFieldConstantsImpl(impl);
+  for (int i = 0; i < d->nested_type_count(); i++) {
+    doFieldConstants(d->nested_type(i), options, header, impl, error);
   }
+}
 
-  virtual bool Generate(const FileDescriptor* file,
-                        const string& parameter,
-                        GeneratorContext* context,
-                        string* error) const {
-    string path = objc::FilePath(file);
+}  // anonymous namespace
 
-    for (int i = 0; i < file->message_type_count(); i++) {
-      doMessage(file->message_type(i), path, context, error);
-    }
+namespace objcjson {
+
+bool MyCodeGenerator::Generate(const FileDescriptor* file,
+                               const string& parameter,
+                               GeneratorContext* context,
+                               string* error) const {
+  string path = objc::FilePath(file);
 
-    if (!error->empty()) {
-      fprintf(stderr, "ERROR: %s\n", error->c_str());
+  GeneratorOptions options;
+  if (!ParseOptions(parameter, &options, error)) {
+    fprintf(stderr, "ERROR: %s\n", error->c_str());
+    return false;
+  }
+
+  // The support files are shared by every generated file, so only write
+  // them once per run.
+  if (options.emit_runtime && !runtime_written_) {
+    WriteRuntimeFile(context, "DXJSONRuntime.h", kJSONRuntimeHeader);
+    WriteRuntimeFile(context, "DXJSONRuntime.m", kJSONRuntimeSource);
+    runtime_written_ = true;
+  }
+
+  for (int i = 0; i < file->message_type_count(); i++) {
+    doMessage(file->message_type(i), path, options, context, error);
+  }
+
+  // The field constants go with the imports, so the classes after them
+  // (and services using them in other files) can name the Field types.
+  if (file->message_type_count() > 0) {
+    scoped_ptr<io::ZeroCopyOutputStream> header_output(
+        context->OpenForInsert(path + ".pb.h", "imports"));
+    scoped_ptr<io::ZeroCopyOutputStream> impl_output(
+        context->OpenForInsert(path + ".pb.m", "global_scope"));
+    io::Printer header(header_output.get(), '$');
+    io::Printer impl(impl_output.get(), '$');
+    header.Print("#import \"DXJSONRuntime.h\"\n\n");
+    for (int i = 0; i < file->message_type_count(); i++) {
+      doFieldConstants(file->message_type(i), options, &header, &impl, error);
     }
-    return error->empty();
   }
-};
 
-int main(int argc, char* argv[]) {
-  MyCodeGenerator generator;
-  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+  if (!error->empty()) {
+    fprintf(stderr, "ERROR: %s\n", error->c_str());
+  }
+  return error->empty();
 }
+
+}  // namespace objcjson
@@ -0,0 +1,30 @@
+// protoc-gen-objcjson: JSON coding for the Objective-C message classes,
+// inserted into the files from protoc-gen-objc.  main() is in json_main.cc,
+// so the generator can be linked into other programs (see bench/).
+
+#ifndef JSON_GENERATOR_H__
+#define JSON_GENERATOR_H__
+
+#include <string>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/descriptor.h>
+
+namespace objcjson {
+
+class MyCodeGenerator : public google::protobuf::compiler::CodeGenerator {
+ public:
+  MyCodeGenerator() : runtime_written_(false) {}
+  virtual ~MyCodeGenerator() {}
+
+  virtual bool Generate(const google::protobuf::FileDescriptor* file,
+                        const std::string& parameter,
+                        google::protobuf::compiler::GeneratorContext* context,
+                        std::string* error) const;
+
+ private:
+  mutable bool runtime_written_;
+};
+
+}  // namespace objcjson
+
+#endif  // JSON_GENERATOR_H__
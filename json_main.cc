@@ -0,0 +1,10 @@
+// Entry point of protoc-gen-objcjson.
+
+#include <google/protobuf/compiler/plugin.h>
+
+#include "json_generator.h"
+
+int main(int argc, char* argv[]) {
+  objcjson::MyCodeGenerator generator;
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
@@ -0,0 +1,229 @@
+// Support code shared by the generated JSON mapping.  This file is emitted
+// by protoc-gen-objcjson next to the generated sources.
+
+#import <Foundation/Foundation.h>
+
+// A growable byte buffer that generated -writeJSONTo: methods append UTF-8
+// JSON to, without building an NSDictionary first.
+typedef struct DXJSONWriter {
+  uint8_t *bytes;
+  size_t length;
+  size_t capacity;
+} DXJSONWriter;
+
+void DXJSONWriterInit(DXJSONWriter *w, size_t capacity);
+
+// Makes room for at least `extra` more bytes.
+void DXJSONWriterGrow(DXJSONWriter *w, size_t extra);
+
+// Hands the buffer over to an NSData without copying it.
+NSData *DXJSONWriterFinish(DXJSONWriter *w);
+
+static inline void DXJSONWriteBytes(DXJSONWriter *w,
+                                    const char *bytes,
+                                    size_t len) {
+  if (w->capacity - w->length < len) {
+    DXJSONWriterGrow(w, len);
+  }
+  memcpy(w->bytes + w->length, bytes, len);
+  w->length += len;
+}
+
+static inline void DXJSONWriteByte(DXJSONWriter *w, char c) {
+  if (w->length == w->capacity) {
+    DXJSONWriterGrow(w, 1);
+  }
+  w->bytes[w->length++] = c;
+}
+
+// `key` is a quoted key with a leading comma and trailing colon, such as
+// ",\"userId\":".  The comma is dropped for the first key of an object.
+static inline void DXJSONWriteKey(DXJSONWriter *w,
+                                  const char *key,
+                                  size_t len) {
+  if (w->bytes[w->length - 1] == '{') {
+    key++;
+    len--;
+  }
+  DXJSONWriteBytes(w, key, len);
+}
+
+void DXJSONWriteInt64(DXJSONWriter *w, int64_t v);
+void DXJSONWriteUInt64(DXJSONWriter *w, uint64_t v);
+void DXJSONWriteFloat(DXJSONWriter *w, float v);
+void DXJSONWriteDouble(DXJSONWriter *w, double v);
+void DXJSONWriteBool(DXJSONWriter *w, BOOL v);
+void DXJSONWriteString(DXJSONWriter *w, NSString *s);
+// Writes bytes fields as a base64 string, encoding straight into the buffer.
+void DXJSONWriteData(DXJSONWriter *w, NSData *data);
+
+// A cursor over UTF-8 JSON bytes that generated +parseFromJSONReader:
+// methods pull tokens from, filling builders directly.  Malformed input sets
+// `failed`; from then on every read returns a zero value and loops end.
+typedef struct DXJSONReader {
+  __unsafe_unretained NSData *data;
+  const uint8_t *start;
+  const uint8_t *p;
+  const uint8_t *end;
+  BOOL failed;
+  size_t errorOffset;
+  // YES just after a '{' or '[', where the next member or element takes no
+  // ',' before it.
+  BOOL first;
+} DXJSONReader;
+
+void DXJSONReaderInit(DXJSONReader *r, NSData *data);
+
+// NO unless only whitespace is left; sets `failed` if not.
+BOOL DXJSONReaderAtEnd(DXJSONReader *r);
+
+// Describes where the input went wrong.
+NSError *DXJSONReaderError(DXJSONReader *r);
+
+// Consumes `null` and returns YES if that's the next value.
+BOOL DXJSONReadNull(DXJSONReader *r);
+
+// Consume '{' and return YES, or consume `null` and return NO.
+BOOL DXJSONReadObjectStart(DXJSONReader *r);
+
+// Reads the next member's key and its ':', or consumes the closing '}' and
+// returns NO.  The key points into the input and is not unescaped, so keys
+// with escapes won't match any field and get skipped.
+BOOL DXJSONReadKey(DXJSONReader *r, const char **key, size_t *len);
+
+// Consume '[' and return YES, or consume `null` and return NO.
+BOOL DXJSONReadArrayStart(DXJSONReader *r);
+
+// YES if another element follows, NO after consuming the closing ']'.
+BOOL DXJSONReadArrayNext(DXJSONReader *r);
+
+// Numbers may also be quoted, as some servers do for 64-bit values.
+int64_t DXJSONReadInt64(DXJSONReader *r);
+uint64_t DXJSONReadUInt64(DXJSONReader *r);
+double DXJSONReadDouble(DXJSONReader *r);
+BOOL DXJSONReadBool(DXJSONReader *r);
+NSString *DXJSONReadString(DXJSONReader *r);
+
+// Decodes a base64 string straight from the input into the returned data.
+NSData *DXJSONReadData(DXJSONReader *r);
+
+void DXJSONSkipValue(DXJSONReader *r);
+
+// Map keys as returned by DXJSONReadKey(), for dx_map_key fields.
+NSString *DXJSONKeyString(const char *key, size_t len);
+int64_t DXJSONKeyInt64(const char *key, size_t len);
+uint64_t DXJSONKeyUInt64(const char *key, size_t len);
+
+// FNV-1a over the UTF-16 units of `key`, mixed with `seed`.  The JSON
+// plugin picks a seed per message that maps its keys to distinct slots, so
+// generated +parseFromDict: methods can switch on the result.
+uint32_t DXKeyHash(NSString *key, uint32_t seed);
+
+// Returns the object attached to `owner` under `key`, making it with `make`
+// the first time.  Safe to call from several threads.
+id DXCachedObject(id owner, const void *key, id (^make)(void));
+
+// Repeated message fields with at least this many elements are converted
+// on all cores by toDict and +parseFromDict:.  Defaults to 256; set it to
+// NSUIntegerMax to keep everything on the calling thread.
+extern NSUInteger DXParallelThreshold;
+
+// [block(0), ..., block(count - 1)] in order, without the nils.  Above
+// DXParallelThreshold the calls run in chunks with dispatch_apply, so
+// `block` must be safe to call from several threads.
+NSArray *DXParallelMap(NSUInteger count, id (^block)(NSUInteger i));
+
+// Base64 for bytes fields (RFC 4648, with padding).  Decoding also takes the
+// URL-safe alphabet, missing padding and line breaks.
+NSString *DXBase64String(NSData *data);
+NSData *DXDataFromBase64String(NSString *s);
+
+// Streaming variants for big blobs that arrive or leave in pieces.  Each
+// call converts what it can and carries the rest over to the next one.
+typedef struct DXBase64Encoder {
+  uint8_t pending[2];
+  int count;
+} DXBase64Encoder;
+
+// `out` must have room for DXBase64EncodedLength(len) + 4 bytes.
+size_t DXBase64EncoderUpdate(DXBase64Encoder *e,
+                             const uint8_t *in, size_t len, char *out);
+// Writes the last 0 to 4 characters, with padding.
+size_t DXBase64EncoderFinish(DXBase64Encoder *e, char *out);
+
+static inline size_t DXBase64EncodedLength(size_t len) {
+  return (len + 2) / 3 * 4;
+}
+
+typedef struct DXBase64Decoder {
+  uint32_t bits;
+  int count;
+  BOOL padded;
+  BOOL failed;
+} DXBase64Decoder;
+
+// `out` must have room for len / 4 * 3 + 3 bytes.  Returns the bytes
+// written; on bad input sets `failed` and stops.
+size_t DXBase64DecoderUpdate(DXBase64Decoder *d,
+                             const uint8_t *in, size_t len, uint8_t *out);
+// Writes the last 0 to 2 bytes.  Returns NO if the input was bad.
+BOOL DXBase64DecoderFinish(DXBase64Decoder *d, uint8_t *out, size_t *written);
+
+// The undecoded JSON of a lazily parsed message field: the NSDictionary or
+// NSArray from +parseFromDict:, or a slice of the response bytes from
+// +parseFromJSONReader:.  A slice keeps the whole response alive.
+@interface DXLazyValue : NSObject
+
+- (instancetype)initWithObject:(id)object;
+- (instancetype)initWithData:(NSData *)data range:(NSRange)range;
+
+// Runs `decode` on the first call and returns its result from then on.
+// Exactly one of `object` and `json` is non-nil.  JSON of the wrong shape
+// decodes to nil or an empty array and sets *error, which is kept on
+// `owner` for DXLazyDecodeError().  Thread-safe.
+- (id)valueForOwner:(id)owner
+        withDecoder:(id (^)(id object, NSData *json, NSError **error))decode;
+
+@end
+
+// The first error from decoding one of `msg`'s lazy fields, or nil.  Lazy
+// fields are decoded long after the response was accepted, so a bad one
+// reads as empty rather than failing the call.
+NSError *DXLazyDecodeError(id msg);
+
+// For JSON that parsed but isn't what its field holds, such as a number
+// where a message goes.
+NSError *DXJSONTypeError(void);
+
+// YES if `object` is an NSArray of `cls` and NSNull elements.
+BOOL DXIsArrayOf(id object, Class cls);
+
+// Skips the next value and keeps it as a lazy value.
+DXLazyValue *DXJSONReadLazyValue(DXJSONReader *r);
+
+// Lazy values hang off the parsed message, keyed by their accessor.
+DXLazyValue *DXGetLazyValue(id owner, SEL accessor);
+void DXSetLazyValue(id owner, SEL accessor, DXLazyValue *value);
+
+// Writing a message back out copies its lazy fields' JSON as it came in.
+id DXLazyValueJSONObject(DXLazyValue *value);
+void DXJSONWriteLazyValue(DXJSONWriter *w, DXLazyValue *value);
+
+// A lazy field of a generated class, for DXInstallLazyFields().  The names
+// are those protoc-gen-objc uses for the field foo.
+typedef struct DXLazyField {
+  const char *lazy;     // "lazyFoo", which its DXLazyValue hangs off
+  const char *storage;  // "foo", or "fooArray" for repeated fields
+  const char *has;      // "hasFoo", or NULL for repeated fields
+  const char *getters;  // the accessors reading the storage, space-separated
+} DXLazyField;
+
+// Makes the plain accessors of `cls` see lazily parsed fields: the first
+// call to one of a field's getters decodes its DXLazyValue into the
+// message's own storage and drops it, and -writeToCodedOutputStream: and
+// -serializedSize (so -data) decode every pending field first.  Builders
+// copy through the getters, so +builderWithPrototype: gets them too.
+// Call once per class, before any of its messages has lazy values.
+// Returns NO if one of those methods is missing or has a signature other
+// than protoc-gen-objc's; its field would then read as empty.
+BOOL DXInstallLazyFields(Class cls, const DXLazyField *fields, size_t count);
@@ -0,0 +1,1095 @@
+// Support code shared by the generated JSON mapping.
+
+#import "DXJSONRuntime.h"
+
+#import <objc/message.h>
+#import <objc/runtime.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void DXJSONWriterInit(DXJSONWriter *w, size_t capacity) {
+  w->bytes = malloc(capacity);
+  w->length = 0;
+  w->capacity = capacity;
+}
+
+void DXJSONWriterGrow(DXJSONWriter *w, size_t extra) {
+  size_t capacity = w->capacity * 2;
+  if (capacity < w->length + extra) {
+    capacity = w->length + extra;
+  }
+  w->bytes = realloc(w->bytes, capacity);
+  w->capacity = capacity;
+}
+
+NSData *DXJSONWriterFinish(DXJSONWriter *w) {
+  NSData *data = [NSData dataWithBytesNoCopy:w->bytes
+                                      length:w->length
+                                freeWhenDone:YES];
+  w->bytes = NULL;
+  w->length = w->capacity = 0;
+  return data;
+}
+
+void DXJSONWriteUInt64(DXJSONWriter *w, uint64_t v) {
+  char buf[20];
+  char *p = buf + sizeof(buf);
+  do {
+    *--p = '0' + (v % 10);
+    v /= 10;
+  } while (v != 0);
+  DXJSONWriteBytes(w, p, buf + sizeof(buf) - p);
+}
+
+void DXJSONWriteInt64(DXJSONWriter *w, int64_t v) {
+  if (v < 0) {
+    DXJSONWriteByte(w, '-');
+    DXJSONWriteUInt64(w, -(uint64_t)v);
+  } else {
+    DXJSONWriteUInt64(w, (uint64_t)v);
+  }
+}
+
+// Prints the shortest of the two precisions that reads back the same value.
+static void WriteReal(DXJSONWriter *w, double v, int short_digits,
+                      int long_digits, BOOL is_float) {
+  if (!isfinite(v)) {
+    // JSON has no NaN or infinity.
+    DXJSONWriteBytes(w, "null", 4);
+    return;
+  }
+  char buf[32];
+  int n = snprintf(buf, sizeof(buf), "%.*g", short_digits, v);
+  double back = strtod(buf, NULL);
+  if (is_float ? (float)back != (float)v : back != v) {
+    n = snprintf(buf, sizeof(buf), "%.*g", long_digits, v);
+  }
+  DXJSONWriteBytes(w, buf, n);
+}
+
+void DXJSONWriteFloat(DXJSONWriter *w, float v) {
+  WriteReal(w, v, 7, 9, YES);
+}
+
+void DXJSONWriteDouble(DXJSONWriter *w, double v) {
+  WriteReal(w, v, 15, 17, NO);
+}
+
+void DXJSONWriteBool(DXJSONWriter *w, BOOL v) {
+  if (v) {
+    DXJSONWriteBytes(w, "true", 4);
+  } else {
+    DXJSONWriteBytes(w, "false", 5);
+  }
+}
+
+static void WriteEscaped(DXJSONWriter *w, const uint8_t *s, size_t len) {
+  static const char kHex[] = "0123456789abcdef";
+  DXJSONWriteByte(w, '"');
+  size_t run = 0;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    DXJSONWriteBytes(w, (const char *)s + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"':  DXJSONWriteBytes(w, "\\\"", 2); break;
+      case '\\': DXJSONWriteBytes(w, "\\\\", 2); break;
+      case '\n': DXJSONWriteBytes(w, "\\n", 2); break;
+      case '\r': DXJSONWriteBytes(w, "\\r", 2); break;
+      case '\t': DXJSONWriteBytes(w, "\\t", 2); break;
+      default: {
+        char esc[6] = { '\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf] };
+        DXJSONWriteBytes(w, esc, 6);
+      }
+    }
+  }
+  DXJSONWriteBytes(w, (const char *)s + run, len - run);
+  DXJSONWriteByte(w, '"');
+}
+
+void DXJSONWriteString(DXJSONWriter *w, NSString *s) {
+  CFStringRef cf = (__bridge CFStringRef)s;
+  // Stored as ASCII, so there's one byte per UTF-16 unit.  The length comes
+  // from the string, not strlen(), since U+0000 is a valid character.
+  const char *fast = CFStringGetCStringPtr(cf, kCFStringEncodingASCII);
+  if (fast != NULL) {
+    WriteEscaped(w, (const uint8_t *)fast, CFStringGetLength(cf));
+    return;
+  }
+
+  // Not stored as ASCII; transcode to a scratch buffer first.
+  NSUInteger max = [s maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+  uint8_t stack[256];
+  uint8_t *tmp = max <= sizeof(stack) ? stack : malloc(max);
+  NSUInteger used = 0;
+  [s getBytes:tmp
+       maxLength:max
+      usedLength:&used
+        encoding:NSUTF8StringEncoding
+         options:0
+           range:NSMakeRange(0, s.length)
+  remainingRange:NULL];
+  WriteEscaped(w, tmp, used);
+  if (tmp != stack) {
+    free(tmp);
+  }
+}
+
+void DXJSONWriteData(DXJSONWriter *w, NSData *data) {
+  size_t need = DXBase64EncodedLength(data.length) + 2;
+  if (w->capacity - w->length < need) {
+    DXJSONWriterGrow(w, need);
+  }
+  char *out = (char *)w->bytes + w->length;
+  DXBase64Encoder e = { { 0, 0 }, 0 };
+  size_t n = DXBase64EncoderUpdate(&e, data.bytes, data.length, out + 1);
+  n += DXBase64EncoderFinish(&e, out + 1 + n);
+  out[0] = '"';
+  out[n + 1] = '"';
+  w->length += n + 2;
+}
+
+void DXJSONReaderInit(DXJSONReader *r, NSData *data) {
+  r->data = data;
+  r->start = r->p = data.bytes;
+  r->end = r->p + data.length;
+  r->failed = NO;
+  r->errorOffset = 0;
+  r->first = NO;
+}
+
+static void Fail(DXJSONReader *r) {
+  if (!r->failed) {
+    r->failed = YES;
+    r->errorOffset = r->p - r->start;
+  }
+  // Park at the end so that every loop stops.
+  r->p = r->end;
+}
+
+static void SkipSpace(DXJSONReader *r) {
+  while (r->p < r->end &&
+         (*r->p == ' ' || *r->p == '\n' || *r->p == '\r' || *r->p == '\t')) {
+    r->p++;
+  }
+}
+
+// Skips whitespace and consumes `c` if it is next.
+static BOOL Consume(DXJSONReader *r, uint8_t c) {
+  SkipSpace(r);
+  if (r->p < r->end && *r->p == c) {
+    r->p++;
+    return YES;
+  }
+  return NO;
+}
+
+static BOOL ConsumeLiteral(DXJSONReader *r, const char *lit, size_t len) {
+  SkipSpace(r);
+  if ((size_t)(r->end - r->p) >= len && memcmp(r->p, lit, len) == 0) {
+    r->p += len;
+    return YES;
+  }
+  return NO;
+}
+
+BOOL DXJSONReaderAtEnd(DXJSONReader *r) {
+  SkipSpace(r);
+  if (r->p != r->end) {
+    Fail(r);
+  }
+  return !r->failed;
+}
+
+NSError *DXJSONReaderError(DXJSONReader *r) {
+  NSString *desc = [NSString stringWithFormat:@"Malformed JSON at byte %lu",
+                                              (unsigned long)r->errorOffset];
+  return [NSError errorWithDomain:NSCocoaErrorDomain
+                             code:NSPropertyListReadCorruptError
+                         userInfo:@{NSLocalizedDescriptionKey: desc}];
+}
+
+BOOL DXJSONReadNull(DXJSONReader *r) {
+  return ConsumeLiteral(r, "null", 4);
+}
+
+BOOL DXJSONReadObjectStart(DXJSONReader *r) {
+  if (Consume(r, '{')) {
+    r->first = YES;
+    return YES;
+  }
+  if (!DXJSONReadNull(r)) {
+    Fail(r);
+  }
+  return NO;
+}
+
+// Returns the end of the string starting at r->p (just past the opening
+// quote) and whether it has escapes, or NULL if it isn't terminated.
+static const uint8_t *StringEnd(DXJSONReader *r, BOOL *escaped) {
+  const uint8_t *p = r->p;
+  *escaped = NO;
+  while (p < r->end) {
+    uint8_t c = *p;
+    if (c == '"') {
+      return p;
+    } else if (c == '\\') {
+      *escaped = YES;
+      p += 2;
+    } else {
+      p++;
+    }
+  }
+  return NULL;
+}
+
+BOOL DXJSONReadKey(DXJSONReader *r, const char **key, size_t *len) {
+  BOOL first = r->first;
+  r->first = NO;
+  if (Consume(r, '}')) {
+    return NO;
+  }
+  if ((!first && !Consume(r, ',')) || !Consume(r, '"')) {
+    Fail(r);
+    return NO;
+  }
+  BOOL escaped;
+  const uint8_t *end = StringEnd(r, &escaped);
+  if (end == NULL) {
+    Fail(r);
+    return NO;
+  }
+  *key = (const char *)r->p;
+  *len = end - r->p;
+  r->p = end + 1;
+  if (!Consume(r, ':')) {
+    Fail(r);
+    return NO;
+  }
+  return YES;
+}
+
+BOOL DXJSONReadArrayStart(DXJSONReader *r) {
+  if (Consume(r, '[')) {
+    r->first = YES;
+    return YES;
+  }
+  if (!DXJSONReadNull(r)) {
+    Fail(r);
+  }
+  return NO;
+}
+
+BOOL DXJSONReadArrayNext(DXJSONReader *r) {
+  BOOL first = r->first;
+  r->first = NO;
+  if (Consume(r, ']') || r->failed) {
+    return NO;
+  }
+  if (!first && !Consume(r, ',')) {
+    Fail(r);
+    return NO;
+  }
+  return YES;
+}
+
+// Copies the number token at r->p into buf and consumes it.  Quoted numbers
+// are accepted as well.
+static size_t NumberToken(DXJSONReader *r, char *buf, size_t size) {
+  BOOL quoted = Consume(r, '"');
+  if (!quoted) {
+    SkipSpace(r);
+  }
+  size_t n = 0;
+  while (r->p < r->end && n < size - 1) {
+    uint8_t c = *r->p;
+    if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+        c == 'e' || c == 'E') {
+      buf[n++] = c;
+      r->p++;
+    } else {
+      break;
+    }
+  }
+  buf[n] = '\0';
+  if (n == 0 || (quoted && !Consume(r, '"'))) {
+    Fail(r);
+    return 0;
+  }
+  return n;
+}
+
+static BOOL IsIntegral(const char *buf, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (buf[i] == '.' || buf[i] == 'e' || buf[i] == 'E') {
+      return NO;
+    }
+  }
+  return YES;
+}
+
+int64_t DXJSONReadInt64(DXJSONReader *r) {
+  char buf[64];
+  size_t n = NumberToken(r, buf, sizeof(buf));
+  if (n == 0) {
+    return 0;
+  }
+  return IsIntegral(buf, n) ? strtoll(buf, NULL, 10)
+                            : (int64_t)strtod(buf, NULL);
+}
+
+uint64_t DXJSONReadUInt64(DXJSONReader *r) {
+  char buf[64];
+  size_t n = NumberToken(r, buf, sizeof(buf));
+  if (n == 0) {
+    return 0;
+  }
+  return IsIntegral(buf, n) ? strtoull(buf, NULL, 10)
+                            : (uint64_t)strtod(buf, NULL);
+}
+
+double DXJSONReadDouble(DXJSONReader *r) {
+  char buf[64];
+  if (NumberToken(r, buf, sizeof(buf)) == 0) {
+    return 0;
+  }
+  return strtod(buf, NULL);
+}
+
+BOOL DXJSONReadBool(DXJSONReader *r) {
+  if (ConsumeLiteral(r, "true", 4)) {
+    return YES;
+  }
+  if (!ConsumeLiteral(r, "false", 5)) {
+    Fail(r);
+  }
+  return NO;
+}
+
+static int HexValue(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static BOOL ReadHex4(const uint8_t *p, const uint8_t *end, uint32_t *out) {
+  if (end - p < 4) {
+    return NO;
+  }
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    int h = HexValue(p[i]);
+    if (h < 0) {
+      return NO;
+    }
+    v = (v << 4) | h;
+  }
+  *out = v;
+  return YES;
+}
+
+static size_t PutUTF8(uint8_t *out, uint32_t cp) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3f);
+  out[2] = 0x80 | ((cp >> 6) & 0x3f);
+  out[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+// Unescapes [p, end) into out, which must hold end - p bytes; an escape never
+// produces more bytes than it takes up.  Returns the length, or -1.
+static ssize_t Unescape(const uint8_t *p, const uint8_t *end, uint8_t *out) {
+  uint8_t *o = out;
+  while (p < end) {
+    if (*p != '\\') {
+      *o++ = *p++;
+      continue;
+    }
+    if (end - p < 2) {
+      return -1;
+    }
+    uint8_t c = p[1];
+    p += 2;
+    switch (c) {
+      case '"': case '\\': case '/': *o++ = c; break;
+      case 'b': *o++ = '\b'; break;
+      case 'f': *o++ = '\f'; break;
+      case 'n': *o++ = '\n'; break;
+      case 'r': *o++ = '\r'; break;
+      case 't': *o++ = '\t'; break;
+      case 'u': {
+        uint32_t cp, lo;
+        if (!ReadHex4(p, end, &cp)) {
+          return -1;
+        }
+        p += 4;
+        if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 &&
+            p[0] == '\\' && p[1] == 'u' && ReadHex4(p + 2, end, &lo) &&
+            lo >= 0xdc00 && lo < 0xe000) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          p += 6;
+        }
+        o += PutUTF8(o, cp);
+        break;
+      }
+      default:
+        return -1;
+    }
+  }
+  return o - out;
+}
+
+NSString *DXJSONReadString(DXJSONReader *r) {
+  if (!Consume(r, '"')) {
+    Fail(r);
+    return nil;
+  }
+  BOOL escaped;
+  const uint8_t *end = StringEnd(r, &escaped);
+  if (end == NULL) {
+    Fail(r);
+    return nil;
+  }
+  const uint8_t *s = r->p;
+  r->p = end + 1;
+  NSString *str;
+  if (!escaped) {
+    str = [[NSString alloc] initWithBytes:s
+                                   length:end - s
+                                 encoding:NSUTF8StringEncoding];
+  } else {
+    NSMutableData *buf = [NSMutableData dataWithLength:end - s];
+    ssize_t n = Unescape(s, end, buf.mutableBytes);
+    str = n < 0 ? nil : [[NSString alloc] initWithBytes:buf.bytes
+                                                length:n
+                                              encoding:NSUTF8StringEncoding];
+  }
+  // Bad escapes or UTF-8.
+  if (str == nil) {
+    Fail(r);
+  }
+  return str;
+}
+
+static NSData *Base64Decode(const uint8_t *in, size_t len) {
+  uint8_t *out = malloc(len / 4 * 3 + 3);
+  DXBase64Decoder d = { 0, 0, NO, NO };
+  size_t n = DXBase64DecoderUpdate(&d, in, len, out);
+  size_t tail = 0;
+  if (!DXBase64DecoderFinish(&d, out + n, &tail)) {
+    free(out);
+    return nil;
+  }
+  return [NSData dataWithBytesNoCopy:out length:n + tail freeWhenDone:YES];
+}
+
+NSData *DXJSONReadData(DXJSONReader *r) {
+  if (!Consume(r, '"')) {
+    Fail(r);
+    return nil;
+  }
+  BOOL escaped;
+  const uint8_t *end = StringEnd(r, &escaped);
+  if (end == NULL) {
+    Fail(r);
+    return nil;
+  }
+  const uint8_t *s = r->p;
+  r->p = end + 1;
+
+  NSData *data;
+  if (!escaped) {
+    data = Base64Decode(s, end - s);
+  } else {
+    // Some encoders write '/' as "\/".
+    uint8_t *tmp = malloc(end - s);
+    ssize_t n = Unescape(s, end, tmp);
+    data = n < 0 ? nil : Base64Decode(tmp, n);
+    free(tmp);
+  }
+  if (data == nil) {
+    Fail(r);
+  }
+  return data;
+}
+
+void DXJSONSkipValue(DXJSONReader *r) {
+  SkipSpace(r);
+  if (r->p == r->end) {
+    Fail(r);
+    return;
+  }
+  switch (*r->p) {
+    case '{': {
+      r->p++;
+      r->first = YES;
+      const char *key;
+      size_t len;
+      while (DXJSONReadKey(r, &key, &len)) {
+        DXJSONSkipValue(r);
+      }
+      return;
+    }
+    case '[':
+      r->p++;
+      r->first = YES;
+      while (DXJSONReadArrayNext(r)) {
+        DXJSONSkipValue(r);
+      }
+      return;
+    case '"': {
+      r->p++;
+      BOOL escaped;
+      const uint8_t *end = StringEnd(r, &escaped);
+      if (end == NULL) {
+        Fail(r);
+      } else {
+        r->p = end + 1;
+      }
+      return;
+    }
+    case 't':
+    case 'f':
+      DXJSONReadBool(r);
+      return;
+    case 'n':
+      if (!DXJSONReadNull(r)) {
+        Fail(r);
+      }
+      return;
+    default: {
+      char buf[64];
+      NumberToken(r, buf, sizeof(buf));
+      return;
+    }
+  }
+}
+
+NSString *DXJSONKeyString(const char *key, size_t len) {
+  if (memchr(key, '\\', len) == NULL) {
+    return [[NSString alloc] initWithBytes:key
+                                    length:len
+                                  encoding:NSUTF8StringEncoding];
+  }
+  NSMutableData *buf = [NSMutableData dataWithLength:len];
+  ssize_t n = Unescape((const uint8_t *)key, (const uint8_t *)key + len,
+                       buf.mutableBytes);
+  if (n < 0) {
+    return nil;
+  }
+  return [[NSString alloc] initWithBytes:buf.bytes
+                                  length:n
+                                encoding:NSUTF8StringEncoding];
+}
+
+// Copies a key into a terminated buffer for strtoll and friends.
+static void KeyToCString(const char *key, size_t len, char *buf,
+                         size_t size) {
+  if (len >= size) {
+    len = size - 1;
+  }
+  memcpy(buf, key, len);
+  buf[len] = '\0';
+}
+
+int64_t DXJSONKeyInt64(const char *key, size_t len) {
+  char buf[32];
+  KeyToCString(key, len, buf, sizeof(buf));
+  return strtoll(buf, NULL, 10);
+}
+
+uint64_t DXJSONKeyUInt64(const char *key, size_t len) {
+  char buf[32];
+  KeyToCString(key, len, buf, sizeof(buf));
+  return strtoull(buf, NULL, 10);
+}
+
+uint32_t DXKeyHash(NSString *key, uint32_t seed) {
+  // Must match KeyHash() in json_generator.cc.
+  unichar buf[64];
+  NSUInteger length = key.length;
+  uint32_t h = 2166136261u ^ seed;
+  for (NSUInteger start = 0; start < length; start += 64) {
+    NSUInteger len = MIN(length - start, (NSUInteger)64);
+    [key getCharacters:buf range:NSMakeRange(start, len)];
+    for (NSUInteger i = 0; i < len; i++) {
+      h ^= buf[i];
+      h *= 16777619u;
+    }
+  }
+  return h;
+}
+
+id DXCachedObject(id owner, const void *key, id (^make)(void)) {
+  id obj = objc_getAssociatedObject(owner, key);
+  if (obj != nil) {
+    return obj;
+  }
+  @synchronized(owner) {
+    obj = objc_getAssociatedObject(owner, key);
+    if (obj == nil) {
+      obj = make();
+      objc_setAssociatedObject(owner, key, obj, OBJC_ASSOCIATION_RETAIN);
+    }
+  }
+  return obj;
+}
+
+NSUInteger DXParallelThreshold = 256;
+
+NSArray *DXParallelMap(NSUInteger count, id (^block)(NSUInteger i)) {
+  if (count < DXParallelThreshold) {
+    NSMutableArray *arr = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+      id obj = block(i);
+      if (obj != nil) {
+        [arr addObject:obj];
+      }
+    }
+    return arr;
+  }
+
+  // A few chunks per core evens out uneven elements without paying the
+  // dispatch overhead per element.  Each chunk fills its own slots, so the
+  // order is the same as the serial loop.
+  NSUInteger chunks = [NSProcessInfo processInfo].activeProcessorCount * 4;
+  NSUInteger per_chunk = (count + chunks - 1) / chunks;
+  chunks = (count + per_chunk - 1) / per_chunk;
+  __strong id *out = (__strong id *)calloc(count, sizeof(id));
+  dispatch_apply(chunks, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0),
+                 ^(size_t c) {
+    NSUInteger end = MIN((c + 1) * per_chunk, count);
+    for (NSUInteger i = c * per_chunk; i < end; i++) {
+      out[i] = block(i);
+    }
+  });
+
+  NSUInteger n = 0;
+  for (NSUInteger i = 0; i < count; i++) {
+    if (out[i] != nil) {
+      out[n++] = out[i];
+    }
+  }
+  NSArray *arr = [NSArray arrayWithObjects:out count:n];
+  for (NSUInteger i = 0; i < count; i++) {
+    out[i] = nil;
+  }
+  free(out);
+  return arr;
+}
+
+static const char kBase64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Value of each base64 character; -1 for bad ones, -2 for line breaks.
+static const int8_t kBase64Values[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -2, -1, -1, -2, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, 62, -1, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+  -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+  -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static inline void EncodeTriple(uint32_t v, char *out) {
+  out[0] = kBase64[(v >> 18) & 63];
+  out[1] = kBase64[(v >> 12) & 63];
+  out[2] = kBase64[(v >> 6) & 63];
+  out[3] = kBase64[v & 63];
+}
+
+size_t DXBase64EncoderUpdate(DXBase64Encoder *e,
+                             const uint8_t *in, size_t len, char *out) {
+  char *o = out;
+  // Complete the group left over from the last call first.
+  while (e->count > 0 && len > 0) {
+    if (e->count == 1) {
+      e->pending[1] = *in++;
+      len--;
+      e->count = 2;
+    } else {
+      EncodeTriple((e->pending[0] << 16) | (e->pending[1] << 8) | *in++, o);
+      len--;
+      o += 4;
+      e->count = 0;
+    }
+  }
+  while (len >= 3) {
+    EncodeTriple((in[0] << 16) | (in[1] << 8) | in[2], o);
+    o += 4;
+    in += 3;
+    len -= 3;
+  }
+  for (size_t i = 0; i < len; i++) {
+    e->pending[e->count++] = in[i];
+  }
+  return o - out;
+}
+
+size_t DXBase64EncoderFinish(DXBase64Encoder *e, char *out) {
+  if (e->count == 0) {
+    return 0;
+  }
+  uint32_t v = e->pending[0] << 16;
+  if (e->count == 2) {
+    v |= e->pending[1] << 8;
+  }
+  EncodeTriple(v, out);
+  out[3] = '=';
+  if (e->count == 1) {
+    out[2] = '=';
+  }
+  e->count = 0;
+  return 4;
+}
+
+size_t DXBase64DecoderUpdate(DXBase64Decoder *d,
+                             const uint8_t *in, size_t len, uint8_t *out) {
+  uint8_t *o = out;
+  size_t i = 0;
+  while (i < len && !d->failed) {
+    // Fast path: four characters at a time while we're on a boundary.
+    if (d->count == 0 && !d->padded) {
+      while (len - i >= 4) {
+        int a = kBase64Values[in[i]];
+        int b = kBase64Values[in[i + 1]];
+        int c = kBase64Values[in[i + 2]];
+        int e = kBase64Values[in[i + 3]];
+        if ((a | b | c | e) < 0) {
+          break;
+        }
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | e;
+        o[0] = v >> 16;
+        o[1] = v >> 8;
+        o[2] = v;
+        o += 3;
+        i += 4;
+      }
+      if (i == len) {
+        break;
+      }
+    }
+
+    uint8_t ch = in[i++];
+    int v = kBase64Values[ch];
+    if (v == -2) {
+      continue;
+    } else if (ch == '=') {
+      d->padded = YES;
+    } else if (v < 0 || d->padded) {
+      d->failed = YES;
+    } else {
+      d->bits = (d->bits << 6) | v;
+      if (++d->count == 4) {
+        o[0] = d->bits >> 16;
+        o[1] = d->bits >> 8;
+        o[2] = d->bits;
+        o += 3;
+        d->bits = 0;
+        d->count = 0;
+      }
+    }
+  }
+  return o - out;
+}
+
+BOOL DXBase64DecoderFinish(DXBase64Decoder *d, uint8_t *out,
+                           size_t *written) {
+  *written = 0;
+  if (d->failed || d->count == 1) {
+    return NO;
+  }
+  if (d->count == 2) {
+    out[0] = d->bits >> 4;
+    *written = 1;
+  } else if (d->count == 3) {
+    out[0] = d->bits >> 10;
+    out[1] = d->bits >> 2;
+    *written = 2;
+  }
+  d->bits = 0;
+  d->count = 0;
+  return YES;
+}
+
+NSString *DXBase64String(NSData *data) {
+  size_t len = DXBase64EncodedLength(data.length);
+  char *out = malloc(len + 4);
+  DXBase64Encoder e = { { 0, 0 }, 0 };
+  size_t n = DXBase64EncoderUpdate(&e, data.bytes, data.length, out);
+  n += DXBase64EncoderFinish(&e, out + n);
+  return [[NSString alloc] initWithBytesNoCopy:out
+                                        length:n
+                                      encoding:NSASCIIStringEncoding
+                                  freeWhenDone:YES];
+}
+
+NSData *DXDataFromBase64String(NSString *s) {
+  CFStringRef cf = (__bridge CFStringRef)s;
+  const char *fast = CFStringGetCStringPtr(cf, kCFStringEncodingASCII);
+  if (fast != NULL) {
+    return Base64Decode((const uint8_t *)fast, CFStringGetLength(cf));
+  }
+  NSData *ascii = [s dataUsingEncoding:NSASCIIStringEncoding];
+  return ascii == nil ? nil : Base64Decode(ascii.bytes, ascii.length);
+}
+
+static char kLazyDecodeErrorKey;
+
+// Keeps the first error only.  The lock is a global one, not the owner's:
+// DecodeLazyField() holds the owner's while it waits on a DXLazyValue.
+static void RecordLazyDecodeError(id owner, NSError *error) {
+  @synchronized([DXLazyValue class]) {
+    if (objc_getAssociatedObject(owner, &kLazyDecodeErrorKey) == nil) {
+      objc_setAssociatedObject(owner, &kLazyDecodeErrorKey, error,
+                               OBJC_ASSOCIATION_RETAIN);
+    }
+  }
+}
+
+NSError *DXLazyDecodeError(id msg) {
+  return objc_getAssociatedObject(msg, &kLazyDecodeErrorKey);
+}
+
+NSError *DXJSONTypeError(void) {
+  return [NSError
+      errorWithDomain:NSCocoaErrorDomain
+                 code:NSPropertyListReadCorruptError
+             userInfo:@{NSLocalizedDescriptionKey: @"Wrong JSON type"}];
+}
+
+BOOL DXIsArrayOf(id object, Class cls) {
+  if (![object isKindOfClass:[NSArray class]]) {
+    return NO;
+  }
+  for (id x in (NSArray *)object) {
+    if (x != [NSNull null] && ![x isKindOfClass:cls]) {
+      return NO;
+    }
+  }
+  return YES;
+}
+
+@implementation DXLazyValue {
+  id _object;
+  NSData *_data;
+  NSRange _range;
+  id _value;
+  BOOL _decoded;
+}
+
+- (instancetype)initWithObject:(id)object {
+  self = [super init];
+  if (self) {
+    _object = object;
+  }
+  return self;
+}
+
+- (instancetype)initWithData:(NSData *)data range:(NSRange)range {
+  self = [super init];
+  if (self) {
+    _data = data;
+    _range = range;
+  }
+  return self;
+}
+
+// The slice, without copying it out of the response.
+- (NSData *)JSONData {
+  return [NSData dataWithBytesNoCopy:(uint8_t *)_data.bytes + _range.location
+                              length:_range.length
+                        freeWhenDone:NO];
+}
+
+- (id)valueForOwner:(id)owner
+        withDecoder:(id (^)(id object, NSData *json, NSError **error))decode {
+  @synchronized(self) {
+    if (!_decoded) {
+      NSError *error = nil;
+      _value = decode(_object, _object != nil ? nil : [self JSONData], &error);
+      _decoded = YES;
+      if (error != nil) {
+        RecordLazyDecodeError(owner, error);
+      }
+    }
+    return _value;
+  }
+}
+
+- (id)object {
+  if (_object != nil) {
+    return _object;
+  }
+  return [NSJSONSerialization JSONObjectWithData:[self JSONData]
+                                         options:0
+                                           error:NULL];
+}
+
+- (void)writeTo:(DXJSONWriter *)w {
+  if (_object == nil) {
+    DXJSONWriteBytes(w, (const char *)_data.bytes + _range.location,
+                     _range.length);
+    return;
+  }
+  NSData *json = [NSJSONSerialization dataWithJSONObject:_object
+                                                 options:0
+                                                   error:NULL];
+  DXJSONWriteBytes(w, json.bytes, json.length);
+}
+
+@end
+
+DXLazyValue *DXJSONReadLazyValue(DXJSONReader *r) {
+  SkipSpace(r);
+  size_t begin = r->p - r->start;
+  DXJSONSkipValue(r);
+  if (r->failed) {
+    return nil;
+  }
+  NSRange range = NSMakeRange(begin, (r->p - r->start) - begin);
+  return [[DXLazyValue alloc] initWithData:r->data range:range];
+}
+
+DXLazyValue *DXGetLazyValue(id owner, SEL accessor) {
+  return objc_getAssociatedObject(owner, accessor);
+}
+
+void DXSetLazyValue(id owner, SEL accessor, DXLazyValue *value) {
+  if (value != nil) {
+    objc_setAssociatedObject(owner, accessor, value,
+                             OBJC_ASSOCIATION_RETAIN);
+  }
+}
+
+id DXLazyValueJSONObject(DXLazyValue *value) {
+  return [value object];
+}
+
+void DXJSONWriteLazyValue(DXJSONWriter *w, DXLazyValue *value) {
+  [value writeTo:w];
+}
+
+// Moves `field`'s pending value into the message, once.  The check outside
+// the lock keeps getters on decoded messages to one associated-object
+// lookup.
+static void DecodeLazyField(id msg, const DXLazyField *field) {
+  SEL lazy = sel_registerName(field->lazy);
+  if (objc_getAssociatedObject(msg, lazy) == nil) {
+    return;
+  }
+  @synchronized(msg) {
+    if (objc_getAssociatedObject(msg, lazy) == nil) {
+      return;
+    }
+    id value = ((id (*)(id, SEL))objc_msgSend)(msg, lazy);
+    NSString *storage = @(field->storage);
+    if (field->has == NULL) {
+      [msg setValue:[(NSArray *)value mutableCopy] forKey:storage];
+    } else if (value != nil) {
+      [msg setValue:value forKey:storage];
+      [msg setValue:@YES forKey:@(field->has)];
+    }
+    objc_setAssociatedObject(msg, lazy, nil, OBJC_ASSOCIATION_RETAIN);
+  }
+}
+
+// Replaces `sel` on `cls` (adding it, if inherited) with a version that
+// runs `before` first.  Only the signatures of protoc-gen-objc's getters,
+// -writeToCodedOutputStream: and -serializedSize are handled; NO if `sel`
+// is missing or has another.
+static BOOL WrapMethod(Class cls, SEL sel, void (^before)(id msg)) {
+  Method m = class_getInstanceMethod(cls, sel);
+  if (m == NULL) {
+    return NO;
+  }
+  IMP original = method_getImplementation(m);
+  char ret[8];
+  method_getReturnType(m, ret, sizeof(ret));
+  unsigned int args = method_getNumberOfArguments(m);
+  id block = nil;
+  if (args == 2 && ret[0] == '@') {
+    block = ^id (id msg) {
+      before(msg);
+      return ((id (*)(id, SEL))original)(msg, sel);
+    };
+  } else if (args == 2 && (ret[0] == 'B' || ret[0] == 'c')) {
+    block = ^BOOL (id msg) {
+      before(msg);
+      return ((BOOL (*)(id, SEL))original)(msg, sel);
+    };
+  } else if (args == 2 && ret[0] == 'i') {
+    block = ^int32_t (id msg) {
+      before(msg);
+      return ((int32_t (*)(id, SEL))original)(msg, sel);
+    };
+  } else if (args == 3 && ret[0] == '@') {
+    block = ^id (id msg, NSUInteger i) {
+      before(msg);
+      return ((id (*)(id, SEL, NSUInteger))original)(msg, sel, i);
+    };
+  } else if (args == 3 && ret[0] == 'v') {
+    block = ^(id msg, id arg) {
+      before(msg);
+      ((void (*)(id, SEL, id))original)(msg, sel, arg);
+    };
+  }
+  if (block == nil) {
+    return NO;
+  }
+  IMP wrapped = imp_implementationWithBlock(block);
+  if (!class_addMethod(cls, sel, wrapped, method_getTypeEncoding(m))) {
+    method_setImplementation(m, wrapped);
+  }
+  return YES;
+}
+
+BOOL DXInstallLazyFields(Class cls, const DXLazyField *fields, size_t count) {
+  BOOL ok = YES;
+  for (size_t i = 0; i < count; i++) {
+    const DXLazyField *field = &fields[i];
+    for (NSString *getter in [@(field->getters)
+             componentsSeparatedByString:@" "]) {
+      ok &= WrapMethod(cls, NSSelectorFromString(getter), ^(id msg) {
+        DecodeLazyField(msg, field);
+      });
+    }
+  }
+  void (^all)(id) = ^(id msg) {
+    for (size_t i = 0; i < count; i++) {
+      DecodeLazyField(msg, &fields[i]);
+    }
+  };
+  ok &= WrapMethod(cls, @selector(writeToCodedOutputStream:), all);
+  ok &= WrapMethod(cls, @selector(serializedSize), all);
+  return ok;
+}
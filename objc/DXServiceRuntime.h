@@ -0,0 +1,308 @@
+// Support code shared by the generated service clients.  This file is
+// emitted by protoc-gen-objcservice next to the generated sources.
+
+#import <Foundation/Foundation.h>
+
+extern NSString *const DXServiceErrorDomain;
+
+// Content types used for request and response bodies.
+extern NSString *const DXJSONContentType;
+extern NSString *const DXProtobufContentType;
+extern NSString *const DXNDJSONContentType;
+
+typedef void (^DXResponseBlock)(NSError *err,
+                                NSHTTPURLResponse *response,
+                                NSData *body);
+
+// Matches DXMethodOptions.Priority.
+typedef NS_ENUM(NSInteger, DXPriority) {
+  DXPriorityNormal = 0,
+  DXPriorityInteractive = 1,
+  DXPriorityBackground = 2,
+};
+
+// Per-call settings for the options: form of generated methods.
+@interface DXCallOptions : NSObject
+
+// Just these fields of the response, see DXFieldsQuery().
+@property (copy) NSArray<NSString *> *fields;
+
+// Seconds for the whole call; 0 for the method's deadline_ms.
+@property NSTimeInterval deadline;
+
+// Overrides the method's priority once set.
+@property (nonatomic) DXPriority priority;
+@property (readonly) BOOL hasPriority;
+
+@end
+
+// Lanes that requests wait in before they start, one per DXPriority, each
+// with its own NSURLSession and a limit on requests running at once.
+// Interactive requests have separate connections and no limit by default,
+// so they never wait behind the other lanes.
+@interface DXScheduler : NSObject
+
++ (DXScheduler *)sharedScheduler;
+
+// 0 for no limit.  Defaults: interactive 0, normal 8, background 2.
+- (void)setMaxRunning:(NSUInteger)max forPriority:(DXPriority)priority;
+
+- (NSURLSession *)sessionForPriority:(DXPriority)priority;
+
+// Starts `task` (created suspended from sessionForPriority:) once its lane
+// has room.  Its completion handler must call finished:priority:.
+- (void)enqueue:(NSURLSessionTask *)task priority:(DXPriority)priority;
+- (void)finished:(NSURLSessionTask *)task priority:(DXPriority)priority;
+
+@end
+
+// Anything in flight that can be stopped.
+@protocol DXCancellable <NSObject>
+- (void)cancel;
+@end
+
+@interface NSURLSessionTask (DXCancellable) <DXCancellable>
+@end
+
+// Handle returned by every generated method.  Cancelling stops the requests
+// behind the call and skips decoding; the callback never runs.  If the
+// deadline passes first, the requests are stopped the same way and the
+// callback gets DXDeadlineExceededError().
+@interface DXCall : NSObject <DXCancellable>
+
+@property (readonly) BOOL isCancelled;
+
+// Stops `op` along with the call, right away if the call is already
+// cancelled.
+- (void)add:(id<DXCancellable>)op;
+
+// Claims the call's one result; NO if it was cancelled or already has one.
+- (BOOL)complete;
+
+// After `seconds` (if > 0), claims the call, cancels it and runs `expired`.
+- (void)expireAfter:(NSTimeInterval)seconds expired:(dispatch_block_t)expired;
+
+@end
+
+NSError *DXDeadlineExceededError(void);
+
+// Retry and hedging settings for one method, from its DXMethodOptions.
+typedef struct DXCallPolicy {
+  BOOL idempotent;
+  NSUInteger maxRetries;
+  NSTimeInterval backoff;
+  NSTimeInterval maxBackoff;
+  NSTimeInterval hedgeAfter;  // 0 for none
+} DXCallPolicy;
+
+@interface DXTransport : NSObject
+
+// Sends one request to address + path through the DXScheduler lane for
+// `priority`.  A status of 400 or above is reported as an error in
+// DXServiceErrorDomain with the status as its code; the response and body
+// are still passed along so callers can look at them.
++ (NSURLSessionDataTask *)sendTo:(NSString *)address
+                            path:(NSString *)path
+                          method:(NSString *)method
+                         headers:(NSDictionary *)headers
+                            body:(NSData *)body
+                        priority:(DXPriority)priority
+                            done:(DXResponseBlock)done;
+
+// The same at DXPriorityNormal.
++ (NSURLSessionDataTask *)sendTo:(NSString *)address
+                            path:(NSString *)path
+                          method:(NSString *)method
+                         headers:(NSDictionary *)headers
+                            body:(NSData *)body
+                            done:(DXResponseBlock)done;
+
+// The same, but a body of at least `minBytes` (0 for never) is gzipped on
+// a background queue and sent with Content-Encoding: gzip.  If the server
+// answers 415 the body is sent again as is, and later bodies for `address`
+// aren't compressed.  Needs libz.
++ (id<DXCancellable>)sendTo:(NSString *)address
+                       path:(NSString *)path
+                     method:(NSString *)method
+                    headers:(NSDictionary *)headers
+                       body:(NSData *)body
+                   priority:(DXPriority)priority
+              compressAbove:(NSUInteger)minBytes
+                       done:(DXResponseBlock)done;
+
+// The same, but retried and hedged as `policy` says.  `done` is called
+// once, with the response that settled the call.
++ (id<DXCancellable>)sendTo:(NSString *)address
+                       path:(NSString *)path
+                     method:(NSString *)method
+                    headers:(NSDictionary *)headers
+                       body:(NSData *)body
+                   priority:(DXPriority)priority
+              compressAbove:(NSUInteger)minBytes
+                     policy:(DXCallPolicy)policy
+                       done:(DXResponseBlock)done;
+
+// The same, but a newline-delimited JSON response (DXNDJSONContentType) is
+// handed to `lines` as it arrives, a batch of whole lines per chunk, and
+// `done` gets a nil body.  `lines` and then `done` run in order on a serial
+// queue of the stream's own that targets `queue`, so streams are parsed
+// side by side; returning an error from `lines` stops the request with that
+// error.  Any other response is passed whole to `done` as usual.
++ (NSURLSessionDataTask *)streamFrom:(NSString *)address
+                                path:(NSString *)path
+                              method:(NSString *)method
+                             headers:(NSDictionary *)headers
+                                body:(NSData *)body
+                            priority:(DXPriority)priority
+                               queue:(dispatch_queue_t)queue
+                               lines:(NSError *(^)(NSArray<NSData *> *lines))lines
+                                done:(DXResponseBlock)done;
+
+@end
+
+typedef void (^DXBatchResultBlock)(NSError *err, id body);
+
+// Several calls sent as one POST to a batch endpoint.  The request body is
+//   {"calls": [{"method": "POST", "path": "/a", "body": {...}}, ...]}
+// with "body" left out for GETs, whose fields are in the path's query
+// string.  The server answers with one entry per call, in order:
+//   {"responses": [{"status": 200, "body": {...}}, ...]}
+// Each call's block gets its entry's body as parsed by NSJSONSerialization,
+// or an error for a status of 400 or above, a missing entry, or a failed
+// batch.
+@interface DXBatch : NSObject
+
+- (instancetype)initWithAddress:(NSString *)address path:(NSString *)path;
+
+// `body` is the call's request as JSON, or nil.
+- (void)addCall:(NSString *)method
+           path:(NSString *)path
+           body:(NSData *)body
+           done:(DXBatchResultBlock)done;
+
+@property (readonly) NSUInteger count;
+
+// Sends the calls added so far; the batch can't be reused afterwards.
+- (NSURLSessionDataTask *)send;
+
+@end
+
+typedef void (^DXResultBlock)(NSError *err, id result);
+
+// Decoded responses of GET methods with cache_ttl_ms or dedupe set, keyed
+// by their full URL, and the calls waiting on requests in flight.
+@interface DXResponseCache : NSObject
+
++ (DXResponseCache *)sharedCache;
+
+// Most responses kept; the least recently used go first.  Default 256.
+@property (nonatomic) NSUInteger capacity;
+
+// Calls `done` with a result cached less than `ttl` seconds ago, or joins a
+// request already in flight for `key` if `dedupe`, or else calls `start`,
+// whose `finish` hands the result to everyone waiting and caches it if it
+// succeeded and `ttl` > 0.  `done` runs on whichever thread has the result.
+- (void)fetch:(NSString *)key
+          ttl:(NSTimeInterval)ttl
+       dedupe:(BOOL)dedupe
+        start:(void (^)(DXResultBlock finish))start
+         done:(DXResultBlock)done;
+
+- (void)removeAllObjects;
+
+@end
+
+typedef void (^DXConditionalBlock)(NSError *err,
+                                   NSHTTPURLResponse *response,
+                                   NSData *body,
+                                   NSData *cached);
+
+// Last responses of GET methods with etag_cache set, kept in the caches
+// directory and keyed by address + path (with the query string).
+@interface DXETagCache : NSObject
+
++ (DXETagCache *)sharedCache;
+
+- (instancetype)initWithDirectory:(NSString *)directory;
+
+// GETs address + path, sending the validators stored for it; they're read
+// on a background queue.  On a 304, `cached` is the stored data and `body`
+// is nil; if the stored data has gone missing, the request is sent again
+// without validators.  Cancelling the returned call stops the request.
+- (DXCall *)getFrom:(NSString *)address
+               path:(NSString *)path
+           priority:(DXPriority)priority
+               done:(DXConditionalBlock)done;
+
+// Keeps `data`, the parsed response in the protobuf wire format, for the key
+// if `response` has an ETag or Last-Modified.
+- (void)storeData:(NSData *)data
+         response:(NSHTTPURLResponse *)response
+           forKey:(NSString *)key;
+
+- (NSData *)dataForKey:(NSString *)key;
+
+- (void)removeAllObjects;
+
+@end
+
+typedef void (^DXPageBlock)(NSError *err,
+                            id page,
+                            NSString *nextToken,
+                            NSUInteger size);
+
+// Fetches the page for `token` (nil for the first page) and passes it to
+// `done` with its next page token and its size in bytes.
+typedef DXCall *(^DXPageFetch)(NSString *token, DXPageBlock done);
+
+// Walks a paged method one page at a time.  Pages are requested one after
+// the other, since each needs the last one's token, but up to prefetchDepth
+// of them are fetched before the caller asks, so the next page is usually
+// on its way while the caller works on this one.
+@interface DXPageIterator<PageType> : NSObject <DXCancellable>
+
+// Callbacks run on `queue`, or right where the page turns up if nil.
+- (instancetype)initWithFetch:(DXPageFetch)fetch
+                prefetchDepth:(NSUInteger)depth
+                     maxBytes:(NSUInteger)maxBytes
+                        queue:(dispatch_queue_t)queue;
+
+// Pages fetched ahead of the caller, and a limit on their total size; 0
+// for no limit.  A page the caller is waiting for is always fetched.
+@property NSUInteger prefetchDepth;
+@property NSUInteger maxBytes;
+
+// The next page, or nil after the last one.  After an error, every call
+// gets the error.
+- (void)next:(void (^)(NSError *err, PageType page))done;
+
+// Calls `block` for every page until `stop` is set, then `done` with the
+// error that ended the walk, if any.
+- (void)forEach:(void (^)(PageType page, BOOL *stop))block
+           done:(void (^)(NSError *err))done;
+
+@end
+
+// "?a=1&b=x" for a request's -toDict, or "" if it's empty.  This is how GET
+// requests carry their fields in batches, and everywhere with the plugin
+// parameter get_query=true.  Keys are sorted, arrays become repeated keys,
+// and nested messages are sent as JSON.
+NSString *DXQueryString(NSDictionary *params);
+
+// "?fields=a,b" (or "&fields=a,b" if `path` already has a query) asking the
+// server for just those response fields, or "" if `fields` is empty.
+NSString *DXFieldsQuery(NSString *path, NSArray<NSString *> *fields);
+
+// `data` in the gzip format, or nil if zlib fails.
+NSData *DXGzip(NSData *data);
+
+// YES if the response body is in the protobuf wire format.
+BOOL DXResponseIsProtobuf(NSHTTPURLResponse *response);
+
+// Addresses that answered a protobuf body with 415.  Binary methods send
+// them JSON straight away rather than paying for a refused request first.
+BOOL DXRefusesProtobuf(NSString *address);
+void DXSetRefusesProtobuf(NSString *address);
+
+// dispatch_async(queue, block), or block() right here if queue is nil.
+void DXDispatch(dispatch_queue_t queue, dispatch_block_t block);
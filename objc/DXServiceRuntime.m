@@ -0,0 +1,1432 @@
+// Support code shared by the generated service clients.
+
+#import "DXServiceRuntime.h"
+
+#import <CommonCrypto/CommonDigest.h>
+#import <zlib.h>
+
+NSString *const DXServiceErrorDomain = @"DXServiceErrorDomain";
+NSString *const DXJSONContentType = @"application/json";
+NSString *const DXProtobufContentType = @"application/x-protobuf";
+NSString *const DXNDJSONContentType = @"application/x-ndjson";
+
+@implementation NSURLSessionTask (DXCancellable)
+@end
+
+@implementation DXCall {
+  NSMutableArray *_ops;
+  BOOL _cancelled;
+  BOOL _complete;
+}
+
+- (instancetype)init {
+  self = [super init];
+  if (self) {
+    _ops = [NSMutableArray new];
+  }
+  return self;
+}
+
+- (BOOL)isCancelled {
+  @synchronized(self) {
+    return _cancelled;
+  }
+}
+
+- (void)add:(id<DXCancellable>)op {
+  @synchronized(self) {
+    if (!_cancelled) {
+      if (!_complete) {
+        [_ops addObject:op];
+      }
+      return;
+    }
+  }
+  [op cancel];
+}
+
+- (BOOL)complete {
+  @synchronized(self) {
+    if (_cancelled || _complete) {
+      return NO;
+    }
+    _complete = YES;
+    [_ops removeAllObjects];
+    return YES;
+  }
+}
+
+- (void)cancel {
+  NSArray *ops;
+  @synchronized(self) {
+    if (_cancelled || _complete) {
+      return;
+    }
+    _cancelled = YES;
+    ops = _ops;
+    _ops = nil;
+  }
+  for (id<DXCancellable> op in ops) {
+    [op cancel];
+  }
+}
+
+- (void)expireAfter:(NSTimeInterval)seconds expired:(dispatch_block_t)expired {
+  if (seconds <= 0) {
+    return;
+  }
+  __weak DXCall *weakSelf = self;
+  dispatch_after(
+      dispatch_time(DISPATCH_TIME_NOW, (int64_t)(seconds * NSEC_PER_SEC)),
+      dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+    DXCall *call = weakSelf;
+    NSArray *ops;
+    @synchronized(call) {
+      if (call == nil || call->_cancelled || call->_complete) {
+        return;
+      }
+      call->_cancelled = YES;
+      ops = call->_ops;
+      call->_ops = nil;
+    }
+    for (id<DXCancellable> op in ops) {
+      [op cancel];
+    }
+    expired();
+  });
+}
+
+@end
+
+NSError *DXDeadlineExceededError(void) {
+  return [NSError errorWithDomain:NSURLErrorDomain
+                             code:NSURLErrorTimedOut
+                         userInfo:@{NSLocalizedDescriptionKey:
+                                        @"Deadline exceeded"}];
+}
+
+// YES if a request that failed like this may be sent again.  Requests that
+// never reached the server always can; the rest only if idempotent.
+static BOOL IsRetryable(NSError *err,
+                        NSHTTPURLResponse *http,
+                        BOOL idempotent) {
+  if ([err.domain isEqualToString:NSURLErrorDomain]) {
+    switch (err.code) {
+      case NSURLErrorCannotFindHost:
+      case NSURLErrorCannotConnectToHost:
+      case NSURLErrorDNSLookupFailed:
+      case NSURLErrorNotConnectedToInternet:
+        return YES;
+      case NSURLErrorTimedOut:
+      case NSURLErrorNetworkConnectionLost:
+        return idempotent;
+      default:
+        return NO;
+    }
+  }
+  // A 429 or 503 usually means the request wasn't acted on, but the server
+  // may still have started it, so these get no exception.
+  return idempotent && (http.statusCode == 429 || http.statusCode >= 500);
+}
+
+// One call under a DXCallPolicy: the first request, its retries and at
+// most one hedge at a time.  Requests in flight are kept in _tasks, keyed
+// by attempt number.
+@interface DXPolicyCall : NSObject <DXCancellable> {
+ @public
+  NSString *_address;
+  NSString *_path;
+  NSString *_method;
+  NSDictionary *_headers;
+  NSData *_body;
+  DXPriority _priority;
+  NSUInteger _compressAbove;
+  DXCallPolicy _policy;
+  DXResponseBlock _done;
+  NSMutableDictionary *_tasks;
+  NSUInteger _attempts;
+  NSUInteger _retries;
+  BOOL _finished;
+}
+@end
+
+@implementation DXPolicyCall
+
+- (void)send {
+  // The slot is taken before sending, since the response can come back
+  // before sendTo: returns.
+  NSNumber *attempt;
+  @synchronized(self) {
+    if (_finished) {
+      return;
+    }
+    attempt = @(++_attempts);
+    _tasks[attempt] = [NSNull null];
+  }
+  id<DXCancellable> task =
+      [DXTransport sendTo:_address
+                     path:_path
+                   method:_method
+                  headers:_headers
+                     body:_body
+                 priority:_priority
+            compressAbove:_compressAbove
+                     done:^(NSError *err, NSHTTPURLResponse *http,
+                            NSData *body) {
+    [self finish:attempt error:err response:http body:body];
+  }];
+  @synchronized(self) {
+    if (_finished) {
+      [task cancel];
+      return;
+    }
+    if (_tasks[attempt] != nil) {
+      _tasks[attempt] = task;
+    }
+  }
+
+  if (_policy.idempotent && _policy.hedgeAfter > 0) {
+    dispatch_after(
+        dispatch_time(DISPATCH_TIME_NOW,
+                      (int64_t)(_policy.hedgeAfter * NSEC_PER_SEC)),
+        dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+      @synchronized(self) {
+        if (_finished || _tasks[attempt] == nil || _tasks.count > 1) {
+          return;
+        }
+      }
+      [self send];
+    });
+  }
+}
+
+- (void)finish:(NSNumber *)attempt
+         error:(NSError *)err
+      response:(NSHTTPURLResponse *)http
+          body:(NSData *)body {
+  NSArray *losers;
+  @synchronized(self) {
+    if (_finished || _tasks[attempt] == nil) {
+      return;
+    }
+    [_tasks removeObjectForKey:attempt];
+    if (IsRetryable(err, http, _policy.idempotent)) {
+      if (_tasks.count > 0) {
+        // A hedge is still out; let it answer.
+        return;
+      }
+      if (_retries < _policy.maxRetries) {
+        // Full jitter: anywhere up to the capped exponential delay.
+        NSTimeInterval cap = MIN(_policy.maxBackoff,
+                                 _policy.backoff * (1 << MIN(_retries, 30)));
+        NSTimeInterval delay = cap * arc4random_uniform(1001) / 1000.0;
+        _retries++;
+        dispatch_after(
+            dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)),
+            dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+          [self send];
+        });
+        return;
+      }
+    }
+    _finished = YES;
+    losers = _tasks.allValues;
+    [_tasks removeAllObjects];
+  }
+  for (id task in losers) {
+    // A task not stored yet is cancelled by its send once it sees _finished.
+    if (task != [NSNull null]) {
+      [task cancel];
+    }
+  }
+  _done(err, http, body);
+}
+
+- (void)cancel {
+  NSArray *tasks;
+  @synchronized(self) {
+    if (_finished) {
+      return;
+    }
+    _finished = YES;
+    tasks = _tasks.allValues;
+    [_tasks removeAllObjects];
+  }
+  for (id task in tasks) {
+    if (task != [NSNull null]) {
+      [task cancel];
+    }
+  }
+}
+
+@end
+
+@implementation DXCallOptions
+
+- (void)setPriority:(DXPriority)priority {
+  _priority = priority;
+  _hasPriority = YES;
+}
+
+@end
+
+// One lane of the scheduler.
+@interface DXLane : NSObject {
+ @public
+  NSURLSession *_session;
+  NSMutableArray *_pending;
+  NSUInteger _running;
+  NSUInteger _max;
+}
+@end
+
+@implementation DXLane
+@end
+
+@implementation DXScheduler {
+  NSArray *_lanes;
+}
+
++ (DXScheduler *)sharedScheduler {
+  static DXScheduler *scheduler;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    scheduler = [DXScheduler new];
+  });
+  return scheduler;
+}
+
+static DXLane *NewLane(NSURLSession *session, NSUInteger max) {
+  DXLane *lane = [DXLane new];
+  lane->_session = session;
+  lane->_pending = [NSMutableArray new];
+  lane->_max = max;
+  return lane;
+}
+
+- (instancetype)init {
+  self = [super init];
+  if (self) {
+    NSURLSessionConfiguration *interactive =
+        [NSURLSessionConfiguration defaultSessionConfiguration];
+    interactive.networkServiceType = NSURLNetworkServiceTypeResponsiveData;
+    NSURLSessionConfiguration *background =
+        [NSURLSessionConfiguration defaultSessionConfiguration];
+    background.networkServiceType = NSURLNetworkServiceTypeBackground;
+    background.HTTPMaximumConnectionsPerHost = 2;
+    // Indexed by DXPriority.
+    _lanes = @[
+      NewLane([NSURLSession sharedSession], 8),
+      NewLane([NSURLSession sessionWithConfiguration:interactive], 0),
+      NewLane([NSURLSession sessionWithConfiguration:background], 2),
+    ];
+  }
+  return self;
+}
+
+- (DXLane *)lane:(DXPriority)priority {
+  if (priority < 0 || priority >= (NSInteger)_lanes.count) {
+    priority = DXPriorityNormal;
+  }
+  return _lanes[priority];
+}
+
+- (void)setMaxRunning:(NSUInteger)max forPriority:(DXPriority)priority {
+  DXLane *lane = [self lane:priority];
+  @synchronized(self) {
+    lane->_max = max;
+  }
+  [self startPending:lane];
+}
+
+- (NSURLSession *)sessionForPriority:(DXPriority)priority {
+  return [self lane:priority]->_session;
+}
+
+- (void)enqueue:(NSURLSessionTask *)task priority:(DXPriority)priority {
+  DXLane *lane = [self lane:priority];
+  @synchronized(self) {
+    [lane->_pending addObject:task];
+  }
+  [self startPending:lane];
+}
+
+// A task cancelled while it was waiting finishes without having run.
+- (void)finished:(NSURLSessionTask *)task priority:(DXPriority)priority {
+  DXLane *lane = [self lane:priority];
+  @synchronized(self) {
+    if ([lane->_pending indexOfObjectIdenticalTo:task] != NSNotFound) {
+      [lane->_pending removeObjectIdenticalTo:task];
+      return;
+    }
+    lane->_running--;
+  }
+  [self startPending:lane];
+}
+
+- (void)startPending:(DXLane *)lane {
+  NSMutableArray *ready = [NSMutableArray new];
+  @synchronized(self) {
+    while (lane->_pending.count > 0 &&
+           (lane->_max == 0 || lane->_running < lane->_max)) {
+      [ready addObject:lane->_pending[0]];
+      [lane->_pending removeObjectAtIndex:0];
+      lane->_running++;
+    }
+  }
+  for (NSURLSessionTask *task in ready) {
+    [task resume];
+  }
+}
+
+@end
+
+static void SetTaskPriority(NSURLSessionTask *task, DXPriority priority) {
+  switch (priority) {
+    case DXPriorityInteractive:
+      task.priority = NSURLSessionTaskPriorityHigh;
+      break;
+    case DXPriorityBackground:
+      task.priority = NSURLSessionTaskPriorityLow;
+      break;
+    default:
+      break;
+  }
+}
+
+// State of one streamed response.  The session's delegate queue, shared by
+// every stream, only splits lines; _lines and _done run on _queue.
+@interface DXStream : NSObject {
+ @public
+  DXPriority _priority;
+  dispatch_queue_t _queue;
+  NSError *(^_lines)(NSArray<NSData *> *);
+  DXResponseBlock _done;
+  BOOL _ndjson;
+  NSMutableData *_data;  // the partial last line, or the whole body
+  NSError *_error;       // only touched on _queue
+}
+@end
+
+@implementation DXStream
+@end
+
+// Delegate of the session that streamed requests go through; the
+// completion-handler API only hands over the finished body.
+@interface DXStreamDelegate : NSObject <NSURLSessionDataDelegate>
+@property (readonly) NSURLSession *session;
+- (void)add:(DXStream *)stream forTask:(NSURLSessionTask *)task;
+@end
+
+@implementation DXStreamDelegate {
+  NSMutableDictionary *_streams;
+}
+
++ (DXStreamDelegate *)sharedDelegate {
+  static DXStreamDelegate *delegate;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    delegate = [DXStreamDelegate new];
+  });
+  return delegate;
+}
+
+- (instancetype)init {
+  self = [super init];
+  if (self) {
+    _streams = [NSMutableDictionary new];
+    NSOperationQueue *queue = [NSOperationQueue new];
+    queue.maxConcurrentOperationCount = 1;
+    _session = [NSURLSession
+        sessionWithConfiguration:[NSURLSessionConfiguration
+                                     defaultSessionConfiguration]
+                        delegate:self
+                   delegateQueue:queue];
+  }
+  return self;
+}
+
+- (void)add:(DXStream *)stream forTask:(NSURLSessionTask *)task {
+  @synchronized(self) {
+    _streams[@(task.taskIdentifier)] = stream;
+  }
+}
+
+- (DXStream *)streamForTask:(NSURLSessionTask *)task {
+  @synchronized(self) {
+    return _streams[@(task.taskIdentifier)];
+  }
+}
+
+- (void)URLSession:(NSURLSession *)session
+              dataTask:(NSURLSessionDataTask *)task
+    didReceiveResponse:(NSURLResponse *)response
+     completionHandler:(void (^)(NSURLSessionResponseDisposition))handler {
+  DXStream *stream = [self streamForTask:task];
+  NSHTTPURLResponse *http = (NSHTTPURLResponse *)response;
+  NSString *type = [http.allHeaderFields objectForKey:@"Content-Type"];
+  stream->_ndjson = http.statusCode < 400 &&
+                    [type hasPrefix:DXNDJSONContentType];
+  stream->_data = [NSMutableData new];
+  handler(NSURLSessionResponseAllow);
+}
+
+// Passes the whole lines in `data` (and with `last`, the rest) to the
+// stream's block, keeping a partial last line for the next chunk.
+- (void)sendLines:(DXStream *)stream
+             task:(NSURLSessionTask *)task
+             last:(BOOL)last {
+  NSMutableData *data = stream->_data;
+  const char *bytes = data.bytes;
+  NSUInteger start = 0;
+  NSMutableArray *lines = [NSMutableArray new];
+  for (NSUInteger i = 0; i < data.length; i++) {
+    if (bytes[i] != '\n') {
+      continue;
+    }
+    NSUInteger end = i;
+    if (end > start && bytes[end - 1] == '\r') {
+      end--;
+    }
+    if (end > start) {
+      [lines addObject:[data subdataWithRange:NSMakeRange(start, end - start)]];
+    }
+    start = i + 1;
+  }
+  if (last && start < data.length) {
+    [lines addObject:[data subdataWithRange:
+                               NSMakeRange(start, data.length - start)]];
+    start = data.length;
+  }
+  [data replaceBytesInRange:NSMakeRange(0, start) withBytes:NULL length:0];
+
+  if (lines.count == 0) {
+    return;
+  }
+  dispatch_async(stream->_queue, ^{
+    if (stream->_error == nil) {
+      stream->_error = stream->_lines(lines);
+      if (stream->_error != nil) {
+        [task cancel];
+      }
+    }
+  });
+}
+
+- (void)URLSession:(NSURLSession *)session
+          dataTask:(NSURLSessionDataTask *)task
+    didReceiveData:(NSData *)data {
+  DXStream *stream = [self streamForTask:task];
+  [stream->_data appendData:data];
+  if (stream->_ndjson) {
+    [self sendLines:stream task:task last:NO];
+  }
+}
+
+- (void)URLSession:(NSURLSession *)session
+                    task:(NSURLSessionTask *)task
+    didCompleteWithError:(NSError *)err {
+  DXStream *stream;
+  @synchronized(self) {
+    stream = _streams[@(task.taskIdentifier)];
+    [_streams removeObjectForKey:@(task.taskIdentifier)];
+  }
+  [[DXScheduler sharedScheduler] finished:task priority:stream->_priority];
+
+  NSHTTPURLResponse *http = (NSHTTPURLResponse *)task.response;
+  NSData *body = stream->_data;
+  if (stream->_ndjson) {
+    if (err == nil) {
+      [self sendLines:stream task:task last:YES];
+    }
+    body = nil;
+  }
+  // After any lines still being parsed.
+  dispatch_async(stream->_queue, ^{
+    NSError *error = err;
+    if (stream->_error != nil) {
+      error = stream->_error;
+    } else if (error == nil && http.statusCode >= 400) {
+      error = [NSError errorWithDomain:DXServiceErrorDomain
+                                  code:http.statusCode
+                              userInfo:nil];
+    }
+    stream->_done(error, http, body);
+  });
+}
+
+@end
+
+@implementation DXTransport
+
++ (NSURLSessionDataTask *)sendTo:(NSString *)address
+                            path:(NSString *)path
+                          method:(NSString *)method
+                         headers:(NSDictionary *)headers
+                            body:(NSData *)body
+                            done:(DXResponseBlock)done {
+  return [self sendTo:address
+                 path:path
+               method:method
+              headers:headers
+                 body:body
+             priority:DXPriorityNormal
+                 done:done];
+}
+
++ (NSURLSessionDataTask *)sendTo:(NSString *)address
+                            path:(NSString *)path
+                          method:(NSString *)method
+                         headers:(NSDictionary *)headers
+                            body:(NSData *)body
+                        priority:(DXPriority)priority
+                            done:(DXResponseBlock)done {
+  NSURL *url = [NSURL URLWithString:[address stringByAppendingString:path]];
+  NSMutableURLRequest *req = [NSMutableURLRequest requestWithURL:url];
+  req.HTTPMethod = method;
+  req.HTTPBody = body;
+  [headers enumerateKeysAndObjectsUsingBlock:^(id key, id val, BOOL *stop) {
+    [req setValue:val forHTTPHeaderField:key];
+  }];
+
+  // The task doesn't run until the scheduler resumes it, so the handler
+  // always sees `task` set.
+  DXScheduler *scheduler = [DXScheduler sharedScheduler];
+  __block NSURLSessionDataTask *task = [[scheduler sessionForPriority:priority]
+      dataTaskWithRequest:req
+        completionHandler:^(NSData *data, NSURLResponse *res, NSError *err) {
+    [scheduler finished:task priority:priority];
+    task = nil;
+    NSHTTPURLResponse *http = (NSHTTPURLResponse *)res;
+    if (err == nil && http.statusCode >= 400) {
+      err = [NSError errorWithDomain:DXServiceErrorDomain
+                                code:http.statusCode
+                            userInfo:nil];
+    }
+    done(err, http, data);
+  }];
+  SetTaskPriority(task, priority);
+  [scheduler enqueue:task priority:priority];
+  return task;
+}
+
+// Addresses that answered a gzipped body with 415.
+static NSMutableSet *RefusesCompression(void) {
+  static NSMutableSet *addresses;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    addresses = [NSMutableSet new];
+  });
+  return addresses;
+}
+
++ (id<DXCancellable>)sendTo:(NSString *)address
+                       path:(NSString *)path
+                     method:(NSString *)method
+                    headers:(NSDictionary *)headers
+                       body:(NSData *)body
+                   priority:(DXPriority)priority
+              compressAbove:(NSUInteger)minBytes
+                       done:(DXResponseBlock)done {
+  NSMutableSet *refused = RefusesCompression();
+  BOOL compress = minBytes > 0 && body.length >= minBytes;
+  if (compress) {
+    @synchronized(refused) {
+      compress = ![refused containsObject:address];
+    }
+  }
+  if (!compress) {
+    return [self sendTo:address
+                   path:path
+                 method:method
+                headers:headers
+                   body:body
+               priority:priority
+                   done:done];
+  }
+
+  DXCall *op = [DXCall new];
+  dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+    if (op.isCancelled) {
+      return;
+    }
+    NSData *gzipped = DXGzip(body);
+    if (gzipped == nil) {
+      [op add:[self sendTo:address
+                      path:path
+                    method:method
+                   headers:headers
+                      body:body
+                  priority:priority
+                      done:done]];
+      return;
+    }
+    NSMutableDictionary *gzipHeaders = [headers mutableCopy];
+    if (gzipHeaders == nil) {
+      gzipHeaders = [NSMutableDictionary new];
+    }
+    gzipHeaders[@"Content-Encoding"] = @"gzip";
+    [op add:[self sendTo:address
+                    path:path
+                  method:method
+                 headers:gzipHeaders
+                    body:gzipped
+                priority:priority
+                    done:^(NSError *err, NSHTTPURLResponse *http,
+                           NSData *data) {
+      if (http.statusCode != 415) {
+        done(err, http, data);
+        return;
+      }
+      @synchronized(refused) {
+        [refused addObject:address];
+      }
+      [op add:[self sendTo:address
+                      path:path
+                    method:method
+                   headers:headers
+                      body:body
+                  priority:priority
+                      done:done]];
+    }]];
+  });
+  return op;
+}
+
++ (id<DXCancellable>)sendTo:(NSString *)address
+                       path:(NSString *)path
+                     method:(NSString *)method
+                    headers:(NSDictionary *)headers
+                       body:(NSData *)body
+                   priority:(DXPriority)priority
+              compressAbove:(NSUInteger)minBytes
+                     policy:(DXCallPolicy)policy
+                       done:(DXResponseBlock)done {
+  DXPolicyCall *call = [DXPolicyCall new];
+  call->_address = address;
+  call->_path = path;
+  call->_method = method;
+  call->_headers = headers;
+  call->_body = body;
+  call->_priority = priority;
+  call->_compressAbove = minBytes;
+  call->_policy = policy;
+  call->_done = done;
+  call->_tasks = [NSMutableDictionary new];
+  [call send];
+  return call;
+}
+
+
++ (NSURLSessionDataTask *)streamFrom:(NSString *)address
+                                path:(NSString *)path
+                              method:(NSString *)method
+                             headers:(NSDictionary *)headers
+                                body:(NSData *)body
+                            priority:(DXPriority)priority
+                               queue:(dispatch_queue_t)queue
+                               lines:(NSError *(^)(NSArray<NSData *> *lines))lines
+                                done:(DXResponseBlock)done {
+  NSURL *url = [NSURL URLWithString:[address stringByAppendingString:path]];
+  NSMutableURLRequest *req = [NSMutableURLRequest requestWithURL:url];
+  req.HTTPMethod = method;
+  req.HTTPBody = body;
+  [req setValue:[DXNDJSONContentType
+                    stringByAppendingString:@", application/json;q=0.5"]
+      forHTTPHeaderField:@"Accept"];
+  [headers enumerateKeysAndObjectsUsingBlock:^(id key, id val, BOOL *stop) {
+    [req setValue:val forHTTPHeaderField:key];
+  }];
+
+  DXStream *stream = [DXStream new];
+  stream->_priority = priority;
+  stream->_queue = dispatch_queue_create("DXStream", DISPATCH_QUEUE_SERIAL);
+  if (queue != nil) {
+    dispatch_set_target_queue(stream->_queue, queue);
+  }
+  stream->_lines = [lines copy];
+  stream->_done = [done copy];
+  DXStreamDelegate *delegate = [DXStreamDelegate sharedDelegate];
+  NSURLSessionDataTask *task = [delegate.session dataTaskWithRequest:req];
+  [delegate add:stream forTask:task];
+  SetTaskPriority(task, priority);
+  [[DXScheduler sharedScheduler] enqueue:task priority:priority];
+  return task;
+}
+@end
+
+static void AppendString(NSMutableData *out, NSString *s) {
+  NSData *json = [NSJSONSerialization dataWithJSONObject:@[ s ]
+                                                 options:0
+                                                   error:NULL];
+  // Strip the brackets around the one-element array.
+  [out appendBytes:(const char *)json.bytes + 1 length:json.length - 2];
+}
+
+static void AppendLiteral(NSMutableData *out, const char *s) {
+  [out appendBytes:s length:strlen(s)];
+}
+
+@implementation DXBatch {
+  NSString *_address;
+  NSString *_path;
+  NSMutableData *_body;
+  NSMutableArray *_done;
+}
+
+- (instancetype)initWithAddress:(NSString *)address path:(NSString *)path {
+  self = [super init];
+  if (self) {
+    _address = address;
+    _path = path;
+    _body = [NSMutableData dataWithCapacity:1024];
+    _done = [NSMutableArray new];
+    AppendLiteral(_body, "{\"calls\":[");
+  }
+  return self;
+}
+
+- (NSUInteger)count {
+  return _done.count;
+}
+
+// Request bodies are already JSON, so they're copied into the envelope as
+// they are rather than parsed and written again.
+- (void)addCall:(NSString *)method
+           path:(NSString *)path
+           body:(NSData *)body
+           done:(DXBatchResultBlock)done {
+  AppendLiteral(_body, _done.count == 0 ? "{\"method\":" : ",{\"method\":");
+  AppendString(_body, method);
+  AppendLiteral(_body, ",\"path\":");
+  AppendString(_body, path);
+  if (body != nil) {
+    AppendLiteral(_body, ",\"body\":");
+    [_body appendData:body];
+  }
+  AppendLiteral(_body, "}");
+  [_done addObject:[done copy]];
+}
+
+- (NSURLSessionDataTask *)send {
+  AppendLiteral(_body, "]}");
+  NSArray *done = _done;
+  _done = nil;
+  return [DXTransport sendTo:_address
+                        path:_path
+                      method:@"POST"
+                     headers:@{@"Content-Type": DXJSONContentType}
+                        body:_body
+                        done:^(NSError *err, NSHTTPURLResponse *http,
+                               NSData *body) {
+    NSArray *responses = nil;
+    if (err == nil) {
+      NSDictionary *envelope = [NSJSONSerialization JSONObjectWithData:body
+                                                               options:0
+                                                                 error:&err];
+      if ([envelope isKindOfClass:[NSDictionary class]]) {
+        responses = envelope[@"responses"];
+      }
+      if (![responses isKindOfClass:[NSArray class]]) {
+        responses = nil;
+      }
+    }
+    for (NSUInteger i = 0; i < done.count; i++) {
+      DXBatchResultBlock block = done[i];
+      NSDictionary *res = i < responses.count ? responses[i] : nil;
+      if (![res isKindOfClass:[NSDictionary class]]) {
+        block(err ?: [NSError errorWithDomain:NSURLErrorDomain
+                                         code:NSURLErrorBadServerResponse
+                                     userInfo:nil],
+              nil);
+        continue;
+      }
+      NSInteger status = [res[@"status"] integerValue];
+      if (status >= 400) {
+        block([NSError errorWithDomain:DXServiceErrorDomain
+                                  code:status
+                              userInfo:nil],
+              nil);
+        continue;
+      }
+      id resBody = res[@"body"];
+      block(nil, resBody == [NSNull null] ? nil : resBody);
+    }
+  }];
+}
+
+@end
+
+@interface DXCacheEntry : NSObject {
+ @public
+  id _result;
+  NSDate *_expires;
+}
+@end
+
+@implementation DXCacheEntry
+@end
+
+@implementation DXResponseCache {
+  NSMutableDictionary *_entries;
+  // Keys from least to most recently used.
+  NSMutableOrderedSet *_order;
+  // Key -> NSMutableArray of DXResultBlock waiting on the request.
+  NSMutableDictionary *_waiting;
+}
+
++ (DXResponseCache *)sharedCache {
+  static DXResponseCache *cache;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    cache = [DXResponseCache new];
+  });
+  return cache;
+}
+
+- (instancetype)init {
+  self = [super init];
+  if (self) {
+    _capacity = 256;
+    _entries = [NSMutableDictionary new];
+    _order = [NSMutableOrderedSet new];
+    _waiting = [NSMutableDictionary new];
+  }
+  return self;
+}
+
+- (void)fetch:(NSString *)key
+          ttl:(NSTimeInterval)ttl
+       dedupe:(BOOL)dedupe
+        start:(void (^)(DXResultBlock finish))start
+         done:(DXResultBlock)done {
+  id cached = nil;
+  @synchronized(self) {
+    DXCacheEntry *entry = _entries[key];
+    if (entry != nil && [entry->_expires timeIntervalSinceNow] > 0) {
+      [_order removeObject:key];
+      [_order addObject:key];
+      cached = entry->_result;
+    } else if (entry != nil) {
+      [_entries removeObjectForKey:key];
+      [_order removeObject:key];
+    }
+    if (cached == nil && dedupe) {
+      NSMutableArray *waiting = _waiting[key];
+      if (waiting != nil) {
+        [waiting addObject:[done copy]];
+        return;
+      }
+      _waiting[key] = [NSMutableArray arrayWithObject:[done copy]];
+    }
+  }
+  if (cached != nil) {
+    done(nil, cached);
+    return;
+  }
+
+  start(^(NSError *err, id result) {
+    NSArray *waiting = nil;
+    @synchronized(self) {
+      if (err == nil && result != nil && ttl > 0) {
+        [self store:result forKey:key ttl:ttl];
+      }
+      if (dedupe) {
+        waiting = _waiting[key];
+        [_waiting removeObjectForKey:key];
+      }
+    }
+    if (!dedupe) {
+      done(err, result);
+    }
+    for (DXResultBlock block in waiting) {
+      block(err, result);
+    }
+  });
+}
+
+// Called with the lock held.
+- (void)store:(id)result forKey:(NSString *)key ttl:(NSTimeInterval)ttl {
+  DXCacheEntry *entry = [DXCacheEntry new];
+  entry->_result = result;
+  entry->_expires = [NSDate dateWithTimeIntervalSinceNow:ttl];
+  _entries[key] = entry;
+  [_order removeObject:key];
+  [_order addObject:key];
+  while (_order.count > _capacity) {
+    [_entries removeObjectForKey:_order[0]];
+    [_order removeObjectAtIndex:0];
+  }
+}
+
+- (void)removeAllObjects {
+  @synchronized(self) {
+    [_entries removeAllObjects];
+    [_order removeAllObjects];
+  }
+}
+
+@end
+
+// Each key has two files named after its SHA-1: <hash>.pb with the
+// response in the protobuf wire format and <hash>.meta, a plist with its validators.  The data is
+// written first so a .meta always has its .pb.
+@implementation DXETagCache {
+  NSString *_directory;
+}
+
++ (DXETagCache *)sharedCache {
+  static DXETagCache *cache;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    NSString *caches = NSSearchPathForDirectoriesInDomains(
+        NSCachesDirectory, NSUserDomainMask, YES).firstObject;
+    // Versioned, so entries in an older format are never misread.
+    cache = [[DXETagCache alloc]
+        initWithDirectory:[caches stringByAppendingPathComponent:
+                                      @"DXETagCache-2"]];
+  });
+  return cache;
+}
+
+- (instancetype)initWithDirectory:(NSString *)directory {
+  self = [super init];
+  if (self) {
+    _directory = directory;
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:NULL];
+  }
+  return self;
+}
+
+- (NSString *)pathForKey:(NSString *)key extension:(NSString *)ext {
+  NSData *utf8 = [key dataUsingEncoding:NSUTF8StringEncoding];
+  unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+  CC_SHA1(utf8.bytes, (CC_LONG)utf8.length, digest);
+  NSMutableString *name = [NSMutableString new];
+  for (int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+    [name appendFormat:@"%02x", digest[i]];
+  }
+  [name appendString:ext];
+  return [_directory stringByAppendingPathComponent:name];
+}
+
+- (NSDictionary *)validatorsForKey:(NSString *)key {
+  NSDictionary *meta = [NSDictionary
+      dictionaryWithContentsOfFile:[self pathForKey:key extension:@".meta"]];
+  NSMutableDictionary *headers = [NSMutableDictionary new];
+  if (meta[@"ETag"] != nil) {
+    headers[@"If-None-Match"] = meta[@"ETag"];
+  }
+  if (meta[@"Last-Modified"] != nil) {
+    headers[@"If-Modified-Since"] = meta[@"Last-Modified"];
+  }
+  return headers.count > 0 ? headers : nil;
+}
+
+- (DXCall *)getFrom:(NSString *)address
+               path:(NSString *)path
+           priority:(DXPriority)priority
+               done:(DXConditionalBlock)done {
+  DXCall *op = [DXCall new];
+  dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+    [self getFrom:address
+             path:path
+         priority:priority
+      conditional:YES
+               op:op
+             done:done];
+  });
+  return op;
+}
+
+- (void)getFrom:(NSString *)address
+           path:(NSString *)path
+       priority:(DXPriority)priority
+    conditional:(BOOL)conditional
+             op:(DXCall *)op
+           done:(DXConditionalBlock)done {
+  if (op.isCancelled) {
+    return;
+  }
+  NSString *key = [address stringByAppendingString:path];
+  NSDictionary *headers = conditional ? [self validatorsForKey:key] : nil;
+  NSURLSessionDataTask *task = [DXTransport
+      sendTo:address
+        path:path
+      method:@"GET"
+     headers:headers
+        body:nil
+    priority:priority
+        done:^(NSError *err, NSHTTPURLResponse *http, NSData *body) {
+    if (err != nil || http.statusCode != 304) {
+      done(err, http, body, nil);
+      return;
+    }
+    NSData *cached = [self dataForKey:key];
+    if (cached == nil) {
+      [self getFrom:address
+               path:path
+           priority:priority
+        conditional:NO
+                 op:op
+               done:done];
+      return;
+    }
+    done(nil, http, nil, cached);
+  }];
+  [op add:task];
+}
+
+- (void)storeData:(NSData *)data
+         response:(NSHTTPURLResponse *)response
+           forKey:(NSString *)key {
+  NSDictionary *fields = response.allHeaderFields;
+  NSMutableDictionary *meta = [NSMutableDictionary new];
+  if (fields[@"ETag"] != nil) {
+    meta[@"ETag"] = fields[@"ETag"];
+  }
+  if (fields[@"Last-Modified"] != nil) {
+    meta[@"Last-Modified"] = fields[@"Last-Modified"];
+  }
+  NSString *metaPath = [self pathForKey:key extension:@".meta"];
+  if (meta.count == 0) {
+    [[NSFileManager defaultManager] removeItemAtPath:metaPath error:NULL];
+    return;
+  }
+  if ([data writeToFile:[self pathForKey:key extension:@".pb"]
+             atomically:YES]) {
+    [meta writeToFile:metaPath atomically:YES];
+  }
+}
+
+- (NSData *)dataForKey:(NSString *)key {
+  return [NSData dataWithContentsOfFile:[self pathForKey:key extension:@".pb"]];
+}
+
+- (void)removeAllObjects {
+  NSFileManager *fm = [NSFileManager defaultManager];
+  for (NSString *name in [fm contentsOfDirectoryAtPath:_directory error:NULL]) {
+    [fm removeItemAtPath:[_directory stringByAppendingPathComponent:name]
+                   error:NULL];
+  }
+}
+
+@end
+
+@implementation DXPageIterator {
+  DXPageFetch _fetch;
+  dispatch_queue_t _queue;
+  NSMutableArray *_pages;
+  NSMutableArray *_sizes;
+  NSUInteger _bytes;
+  NSMutableArray *_waiters;
+  NSString *_token;
+  BOOL _ended;
+  NSError *_error;
+  BOOL _cancelled;
+  // The fetch in flight: its DXCall, or a placeholder until fetch returns.
+  id _inflight;
+}
+
+@synthesize prefetchDepth = _prefetchDepth;
+@synthesize maxBytes = _maxBytes;
+
+- (instancetype)initWithFetch:(DXPageFetch)fetch
+                prefetchDepth:(NSUInteger)depth
+                     maxBytes:(NSUInteger)maxBytes
+                        queue:(dispatch_queue_t)queue {
+  self = [super init];
+  if (self) {
+    _fetch = [fetch copy];
+    _prefetchDepth = depth;
+    _maxBytes = maxBytes;
+    _queue = queue;
+    _pages = [NSMutableArray new];
+    _sizes = [NSMutableArray new];
+    _waiters = [NSMutableArray new];
+  }
+  return self;
+}
+
+- (NSUInteger)prefetchDepth {
+  @synchronized(self) {
+    return _prefetchDepth;
+  }
+}
+
+- (void)setPrefetchDepth:(NSUInteger)depth {
+  @synchronized(self) {
+    _prefetchDepth = depth;
+  }
+  [self pump];
+}
+
+- (NSUInteger)maxBytes {
+  @synchronized(self) {
+    return _maxBytes;
+  }
+}
+
+- (void)setMaxBytes:(NSUInteger)maxBytes {
+  @synchronized(self) {
+    _maxBytes = maxBytes;
+  }
+  [self pump];
+}
+
+- (void)next:(void (^)(NSError *err, id page))done {
+  @synchronized(self) {
+    if (_cancelled) {
+      return;
+    }
+    [_waiters addObject:[done copy]];
+  }
+  [self deliver];
+}
+
+- (void)forEach:(void (^)(id page, BOOL *stop))block
+           done:(void (^)(NSError *err))done {
+  [self next:^(NSError *err, id page) {
+    if (page == nil) {
+      done(err);
+      return;
+    }
+    BOOL stop = NO;
+    block(page, &stop);
+    if (stop) {
+      done(nil);
+      return;
+    }
+    [self forEach:block done:done];
+  }];
+}
+
+- (void)cancel {
+  id inflight;
+  @synchronized(self) {
+    _cancelled = YES;
+    [_waiters removeAllObjects];
+    [_pages removeAllObjects];
+    [_sizes removeAllObjects];
+    _bytes = 0;
+    inflight = _inflight;
+  }
+  if ([inflight isKindOfClass:[DXCall class]]) {
+    [inflight cancel];
+  }
+}
+
+// Hands buffered pages (or the end, or the error) to waiting callers, then
+// fetches more if there's room.
+- (void)deliver {
+  NSMutableArray *ready = [NSMutableArray new];
+  @synchronized(self) {
+    while (_waiters.count > 0) {
+      void (^waiter)(NSError *, id) = _waiters[0];
+      if (_pages.count > 0) {
+        id page = _pages[0];
+        _bytes -= [_sizes[0] unsignedIntegerValue];
+        [_pages removeObjectAtIndex:0];
+        [_sizes removeObjectAtIndex:0];
+        [ready addObject:^{
+          waiter(nil, page);
+        }];
+      } else if (_error != nil || _ended) {
+        NSError *err = _error;
+        [ready addObject:^{
+          waiter(err, nil);
+        }];
+      } else {
+        break;
+      }
+      [_waiters removeObjectAtIndex:0];
+    }
+  }
+  for (dispatch_block_t block in ready) {
+    DXDispatch(_queue, block);
+  }
+  [self pump];
+}
+
+- (void)pump {
+  id slot = [NSObject new];
+  NSString *token;
+  @synchronized(self) {
+    if (_inflight != nil || _ended || _error != nil || _cancelled) {
+      return;
+    }
+    BOOL room = _pages.count < _prefetchDepth &&
+                (_maxBytes == 0 || _bytes < _maxBytes);
+    if (_waiters.count == 0 && !room) {
+      return;
+    }
+    token = _token;
+    _inflight = slot;
+  }
+
+  DXCall *call = _fetch(token, ^(NSError *err, id page, NSString *next,
+                                 NSUInteger size) {
+    [self received:page next:next size:size error:err];
+  });
+
+  BOOL cancelled;
+  @synchronized(self) {
+    cancelled = _cancelled;
+    if (_inflight == slot) {
+      _inflight = call;
+    }
+  }
+  if (cancelled) {
+    [call cancel];
+  }
+}
+
+- (void)received:(id)page
+            next:(NSString *)next
+            size:(NSUInteger)size
+           error:(NSError *)err {
+  @synchronized(self) {
+    _inflight = nil;
+    if (_cancelled) {
+      return;
+    }
+    if (err != nil || page == nil) {
+      _error = err;
+      _ended = YES;
+    } else {
+      [_pages addObject:page];
+      [_sizes addObject:@(size)];
+      _bytes += size;
+      _token = next;
+      _ended = next.length == 0;
+    }
+  }
+  [self deliver];
+}
+
+@end
+
+NSData *DXGzip(NSData *data) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // 15 + 16 selects the gzip wrapper rather than zlib's.
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return nil;
+  }
+  NSMutableData *out =
+      [NSMutableData dataWithLength:deflateBound(&zs, data.length)];
+  zs.next_in = (Bytef *)data.bytes;
+  zs.avail_in = (uInt)data.length;
+  zs.next_out = out.mutableBytes;
+  zs.avail_out = (uInt)out.length;
+  int status = deflate(&zs, Z_FINISH);
+  deflateEnd(&zs);
+  if (status != Z_STREAM_END) {
+    return nil;
+  }
+  out.length = zs.total_out;
+  return out;
+}
+
+BOOL DXResponseIsProtobuf(NSHTTPURLResponse *response) {
+  NSString *type = [response.allHeaderFields objectForKey:@"Content-Type"];
+  return [type hasPrefix:DXProtobufContentType];
+}
+
+static NSMutableSet *RefusesProtobuf(void) {
+  static NSMutableSet *addresses;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    addresses = [NSMutableSet new];
+  });
+  return addresses;
+}
+
+BOOL DXRefusesProtobuf(NSString *address) {
+  NSMutableSet *refused = RefusesProtobuf();
+  @synchronized(refused) {
+    return [refused containsObject:address];
+  }
+}
+
+void DXSetRefusesProtobuf(NSString *address) {
+  NSMutableSet *refused = RefusesProtobuf();
+  @synchronized(refused) {
+    [refused addObject:address];
+  }
+}
+
+void DXDispatch(dispatch_queue_t queue, dispatch_block_t block) {
+  if (queue == nil) {
+    block();
+  } else {
+    dispatch_async(queue, block);
+  }
+}
+
+static NSString *QueryValue(id value) {
+  if ([value isKindOfClass:[NSString class]]) {
+    return value;
+  }
+  if ([value isKindOfClass:[NSNumber class]]) {
+    if (CFGetTypeID((__bridge CFTypeRef)value) == CFBooleanGetTypeID()) {
+      return [value boolValue] ? @"true" : @"false";
+    }
+    return [value stringValue];
+  }
+  NSData *json = [NSJSONSerialization dataWithJSONObject:value
+                                                 options:0
+                                                   error:NULL];
+  return [[NSString alloc] initWithData:json encoding:NSUTF8StringEncoding];
+}
+
+static NSString *QueryEscape(NSString *s) {
+  static NSCharacterSet *allowed;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    NSMutableCharacterSet *set =
+        [[NSCharacterSet URLQueryAllowedCharacterSet] mutableCopy];
+    [set removeCharactersInString:@"&=+?#"];
+    allowed = set;
+  });
+  return [s stringByAddingPercentEncodingWithAllowedCharacters:allowed];
+}
+
+NSString *DXQueryString(NSDictionary *params) {
+  if (params.count == 0) {
+    return @"";
+  }
+  NSMutableString *query = [NSMutableString new];
+  NSArray *keys =
+      [params.allKeys sortedArrayUsingSelector:@selector(compare:)];
+  for (NSString *key in keys) {
+    id value = params[key];
+    NSArray *values = nil;
+    if ([value isKindOfClass:[NSArray class]]) {
+      values = value;
+    } else {
+      values = @[value];
+    }
+    for (id v in values) {
+      [query appendString:query.length == 0 ? @"?" : @"&"];
+      [query appendString:QueryEscape(key)];
+      [query appendString:@"="];
+      [query appendString:QueryEscape(QueryValue(v))];
+    }
+  }
+  return query;
+}
+
+NSString *DXFieldsQuery(NSString *path, NSArray<NSString *> *fields) {
+  if (fields.count == 0) {
+    return @"";
+  }
+  BOOL has_query = [path rangeOfString:@"?"].location != NSNotFound;
+  NSString *list = [fields componentsJoinedByString:@","];
+  return [NSString stringWithFormat:@"%@fields=%@", has_query ? @"&" : @"?",
+                                    QueryEscape(list)];
+}
@@ -0,0 +1,389 @@
+// Protobuf compiler for C++ request routers, built from the same
+// dx_method_options paths the Objective-C clients call.
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include "runtime.h"
+#include "util.h"
+#include "google/protobuf/dx_options.pb.h"  // for method options
+
+using namespace google::protobuf;
+using namespace google::protobuf::compiler;
+
+// Settings from the plugin parameter, e.g. --cpprouter_out=runtime=false:.
+struct GeneratorOptions {
+  GeneratorOptions() : emit_runtime(true) {}
+
+  // Write DXRouter.h and DXTranscoder.h/.cc; pass runtime=false if they're
+  // already in the tree.
+  bool emit_runtime;
+};
+
+// One handler: an rpc, or the service's batch endpoint (method == NULL).
+struct Route {
+  const MethodDescriptor* method;
+  string name;
+  string http_method;
+  string path;
+  vector<string> args;
+};
+
+// A node of the route trie, matching the segment at its depth.  Each
+// path variable takes a whole segment and shares the one `param` child.
+struct RouteNode {
+  map<string, RouteNode> literals;
+  scoped_ptr<RouteNode> param;
+  vector<const Route*> routes;
+};
+
+// Generates the handler class and dispatch function for one service.
+class RouterGenerator {
+ public:
+  RouterGenerator(const ServiceDescriptor* descriptor, string* error)
+      : descriptor_(descriptor), error_(error), max_depth_(0) {
+    vars_["service"] = descriptor->name();
+    // Lines the dispatch function's parameters up under the first one.
+    vars_["indent"] = string(strlen("dx::RouteResult Dispatch(") +
+                             descriptor->name().size(), ' ');
+  }
+
+  // Reads every method's path into the trie; false on a bad or repeated
+  // route.
+  bool Build() {
+    routes_.resize(descriptor_->method_count() + 1);
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      const MethodDescriptor* method = descriptor_->method(i);
+      if (!method->options().HasExtension(dx_method_options)) {
+        error_->assign("Error: can't route method " + method->full_name() +
+                       ", doesn't have options set");
+        return false;
+      }
+      DXMethodOptions options =
+          method->options().GetExtension(dx_method_options);
+      if (method->name() == "Batch") {
+        error_->assign("Batch is taken by the batch endpoint's handler: " +
+                       method->full_name());
+        return false;
+      }
+      Route* route = &routes_[i];
+      route->method = method;
+      route->name = method->name();
+      route->http_method = options.http_method();
+      route->path = options.path();
+      if (!Add(route)) {
+        return false;
+      }
+    }
+
+    Route* batch = &routes_.back();
+    batch->method = NULL;
+    batch->name = "Batch";
+    batch->http_method = "POST";
+    batch->path = descriptor_->options()
+        .GetExtension(dx_service_options).batch_path();
+    return Add(batch);
+  }
+
+  void GenerateHandler(io::Printer* p) {
+    p->Print(vars_,
+             "// Handlers for $service$'s routes.  Override the ones you\n"
+             "// serve; the others return false, which Dispatch$service$()\n"
+             "// reports as kNotImplemented.  Path variables point into the\n"
+             "// path passed to Dispatch$service$().\n"
+             "template <typename Context>\n"
+             "class $service$Handler {\n"
+             " public:\n"
+             "  virtual ~$service$Handler() {}\n");
+    p->Indent();
+    for (int i = 0; i < routes_.size(); i++) {
+      const Route& route = routes_[i];
+      p->Print("\n// $http_method$ $path$\n",
+               "http_method", route.http_method, "path", route.path);
+      if (route.method != NULL) {
+        p->Print("// $input$ -> $output$\n",
+                 "input", route.method->input_type()->full_name(),
+                 "output", route.method->output_type()->full_name());
+      } else {
+        p->Print("// Several calls in one request, see DXBatch in"
+                 " DXServiceRuntime.h.\n");
+      }
+      p->Print("virtual bool $name$(Context& ctx", "name", route.name);
+      for (int j = 0; j < route.args.size(); j++) {
+        p->Print(", std::string_view $arg$", "arg", route.args[j]);
+      }
+      p->Print(") {\n"
+               "  return false;\n"
+               "}\n");
+    }
+    p->Outdent();
+    p->Print("};\n\n");
+  }
+
+  // The trie is written out as nested ifs, literals before variables, so
+  // matching is a few compares per segment and allocates nothing.  A path
+  // whose routes all take other methods only sets `path_matched`, so a
+  // variable sibling can still serve the method; kMethodNotAllowed comes
+  // once no branch does.
+  void GenerateDispatch(io::Printer* p) {
+    p->Print(vars_,
+             "// Calls the handler for the route matching `method` and"
+             " `path`.\n"
+             "// A query string in `path` is ignored.\n"
+             "template <typename Context>\n"
+             "dx::RouteResult Dispatch$service$($service$Handler<Context>&"
+             " handler,\n"
+             "$indent$std::string_view method,\n"
+             "$indent$std::string_view path,\n"
+             "$indent$Context& ctx) {\n");
+    p->Indent();
+    p->Print("std::string_view s[$max$];\n"
+             "size_t n = dx::SplitPath(path, s, $max$);\n"
+             "bool path_matched = false;\n",
+             "max", SimpleItoa(max_depth_));
+    vector<int> params;
+    GenerateNode(p, root_, 0, &params);
+    p->Print("return path_matched ? dx::RouteResult::kMethodNotAllowed\n"
+             "                    : dx::RouteResult::kNotFound;\n");
+    p->Outdent();
+    p->Print("}\n\n");
+  }
+
+ private:
+  // Splits route->path into segments and walks them down the trie.
+  bool Add(Route* route) {
+    vector<string> parts;
+    ParsePath(route->path, &parts, &route->args);
+    if (parts.empty() || parts[0].empty() || parts[0][0] != '/') {
+      error_->assign("Route path must start with '/': " + route->path);
+      return false;
+    }
+
+    RouteNode* node = &root_;
+    int depth = 0;
+    for (int k = 0; k < parts.size() || k < route->args.size(); k++) {
+      string literal = k < parts.size() ? parts[k] : "";
+      bool var_follows = k < route->args.size();
+      // Variables must take whole segments: "/a/:x/b", not "/a/x:y".
+      if ((var_follows &&
+           (literal.empty() || literal[literal.size() - 1] != '/')) ||
+          (k > 0 && !literal.empty() && literal[0] != '/')) {
+        error_->assign("Route variables must be whole path segments: " +
+                       route->path);
+        return false;
+      }
+
+      // The text between the slashes; the empty piece at either end is
+      // the boundary with a variable (or the leading '/').
+      vector<string> pieces;
+      string::size_type start = 0;
+      while (true) {
+        string::size_type end = literal.find('/', start);
+        pieces.push_back(literal.substr(start, end == string::npos
+                                                   ? string::npos
+                                                   : end - start));
+        if (end == string::npos) {
+          break;
+        }
+        start = end + 1;
+      }
+      int first = literal.empty() ? pieces.size() : 1;
+      int last = var_follows ? pieces.size() - 1 : pieces.size();
+      for (int i = first; i < last; i++) {
+        node = &node->literals[pieces[i]];
+        depth++;
+      }
+      if (var_follows) {
+        if (node->param.get() == NULL) {
+          node->param.reset(new RouteNode);
+        }
+        node = node->param.get();
+        depth++;
+      }
+    }
+
+    for (int i = 0; i < node->routes.size(); i++) {
+      if (node->routes[i]->http_method == route->http_method) {
+        error_->assign("Routes " + node->routes[i]->path + " and " +
+                       route->path + " overlap for " + route->http_method);
+        return false;
+      }
+    }
+    node->routes.push_back(route);
+    if (depth > max_depth_) {
+      max_depth_ = depth;
+    }
+    return true;
+  }
+
+  // Matches the segments from `depth` on; `params` has the indexes of the
+  // variables on the way here.
+  void GenerateNode(io::Printer* p, const RouteNode& node, int depth,
+                    vector<int>* params) {
+    string d = SimpleItoa(depth);
+    if (!node.routes.empty()) {
+      p->Print("if (n == $d$) {\n", "d", d);
+      p->Indent();
+      for (int i = 0; i < node.routes.size(); i++) {
+        const Route& route = *node.routes[i];
+        p->Print("if (method == \"$http_method$\") {\n"
+                 "  return dx::Handled(handler.$name$(ctx",
+                 "http_method", route.http_method, "name", route.name);
+        for (int j = 0; j < params->size(); j++) {
+          p->Print(", s[$i$]", "i", SimpleItoa((*params)[j]));
+        }
+        p->Print("));\n"
+                 "}\n");
+      }
+      p->Print("path_matched = true;\n");
+      p->Outdent();
+      p->Print("}\n");
+    }
+    if (node.literals.empty() && node.param.get() == NULL) {
+      return;
+    }
+
+    p->Print("if (n > $d$) {\n", "d", d);
+    p->Indent();
+    if (!node.literals.empty()) {
+      // Group the literals by length so most mismatches cost one compare.
+      map<int, vector<string> > by_size;
+      for (map<string, RouteNode>::const_iterator it = node.literals.begin();
+           it != node.literals.end(); ++it) {
+        by_size[it->first.size()].push_back(it->first);
+      }
+      p->Print("switch (s[$d$].size()) {\n", "d", d);
+      p->Indent();
+      for (map<int, vector<string> >::const_iterator it = by_size.begin();
+           it != by_size.end(); ++it) {
+        p->Print("case $size$:\n", "size", SimpleItoa(it->first));
+        p->Indent();
+        for (int i = 0; i < it->second.size(); i++) {
+          const string& literal = it->second[i];
+          p->Print("if (s[$d$] == \"$literal$\") {\n",
+                   "d", d, "literal", literal);
+          p->Indent();
+          GenerateNode(p, node.literals.find(literal)->second, depth + 1,
+                       params);
+          p->Outdent();
+          p->Print("}\n");
+        }
+        p->Print("break;\n");
+        p->Outdent();
+      }
+      p->Outdent();
+      p->Print("}\n");
+    }
+    if (node.param.get() != NULL) {
+      p->Print("if (!s[$d$].empty()) {\n", "d", d);
+      p->Indent();
+      params->push_back(depth);
+      GenerateNode(p, *node.param, depth + 1, params);
+      params->pop_back();
+      p->Outdent();
+      p->Print("}\n");
+    }
+    p->Outdent();
+    p->Print("}\n");
+  }
+
+  const ServiceDescriptor* descriptor_;
+  string* error_;
+  map<string, string> vars_;
+  vector<Route> routes_;
+  RouteNode root_;
+  int max_depth_;
+};
+
+class MyCodeGenerator : public CodeGenerator {
+ public:
+  MyCodeGenerator() : runtime_written_(false) {}
+  virtual ~MyCodeGenerator() {}
+
+  static bool ParseOptions(const string& parameter,
+                           GeneratorOptions* options,
+                           string* error) {
+    vector<pair<string, string> > params;
+    ParseGeneratorParameter(parameter, &params);
+    for (int i = 0; i < params.size(); i++) {
+      const string& key = params[i].first;
+      const string& value = params[i].second;
+      if (key == "runtime" && (value == "true" || value == "false")) {
+        options->emit_runtime = value == "true";
+      } else {
+        error->assign("Unknown parameter: " + key + "=" + value);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  virtual bool Generate(const FileDescriptor* file,
+                        const string& parameter,
+                        GeneratorContext* context,
+                        string* error) const {
+    GeneratorOptions options;
+    if (!ParseOptions(parameter, &options, error)) {
+      fprintf(stderr, "ERROR: %s\n", error->c_str());
+      return false;
+    }
+    if (file->service_count() == 0) {
+      return true;
+    }
+
+    if (options.emit_runtime && !runtime_written_) {
+      WriteRuntimeFile(context, "DXRouter.h", kRouterRuntimeHeader);
+      WriteRuntimeFile(context, "DXTranscoder.h", kTranscoderRuntimeHeader);
+      WriteRuntimeFile(context, "DXTranscoder.cc", kTranscoderRuntimeSource);
+      runtime_written_ = true;
+    }
+
+    string filename = Basename(file->name()) + ".router.h";
+    string guard = IncludeGuard(filename);
+    string ns = CppNamespace(file->package());
+
+    scoped_ptr<io::ZeroCopyOutputStream> output(context->Open(filename));
+    io::Printer printer(output.get(), '$');
+    printer.PrintRaw(kFileHeader);
+    printer.Print("#ifndef $guard$\n"
+                  "#define $guard$\n\n"
+                  "#include <string_view>\n\n"
+                  "#include \"DXRouter.h\"\n\n",
+                  "guard", guard);
+    if (!ns.empty()) {
+      printer.Print("namespace $ns$ {\n\n", "ns", ns);
+    }
+    for (int i = 0; i < file->service_count(); i++) {
+      RouterGenerator router(file->service(i), error);
+      if (!router.Build()) {
+        break;
+      }
+      router.GenerateHandler(&printer);
+      router.GenerateDispatch(&printer);
+    }
+    if (!ns.empty()) {
+      printer.Print("}  // namespace $ns$\n\n", "ns", ns);
+    }
+    printer.Print("#endif  // $guard$\n", "guard", guard);
+
+    if (!error->empty()) {
+      fprintf(stderr, "ERROR: %s\n", error->c_str());
+    }
+    return error->empty();
+  }
+
+ private:
+  mutable bool runtime_written_;
+};
+
+int main(int argc, char* argv[]) {
+  MyCodeGenerator generator;
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
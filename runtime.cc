@@ -0,0 +1,23 @@
+#include "runtime.h"
+
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include "util.h"
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+
+void WriteRuntimeFile(GeneratorContext* context,
+                      const std::string& filename,
+                      const char* contents) {
+  scoped_ptr<io::ZeroCopyOutputStream> output(context->Open(filename));
+  io::Printer printer(output.get(), '$');
+  printer.PrintRaw(kFileHeader);
+  printer.PrintRaw(contents);
+}
+
+}  // namespace compiler
+}  // namespace protobuf
+}  // namespace google
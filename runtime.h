@@ -0,0 +1,37 @@
+// Support files that the plugins emit next to the generated code.  The
+// contents are embedded from objc/ and cpp/ at build time.
+
+#ifndef PROTOBUF_FOR_PB_RUNTIME_H__
+#define PROTOBUF_FOR_PB_RUNTIME_H__
+
+#include <string>
+#include <google/protobuf/compiler/code_generator.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+
+extern const char kServiceRuntimeHeader[];
+extern const char kServiceRuntimeSource[];
+extern const char kJSONRuntimeHeader[];
+extern const char kJSONRuntimeSource[];
+extern const char kRouterRuntimeHeader[];
+extern const char kTranscoderRuntimeHeader[];
+extern const char kTranscoderRuntimeSource[];
+extern const char kClientRuntimeHeader[];
+extern const char kClientRuntimeSource[];
+extern const char kStandinServerHeader[];
+extern const char kStandinServerSource[];
+extern const char kLoadGenRuntimeHeader[];
+extern const char kLoadGenRuntimeSource[];
+
+// Writes a support file, prefixed with kFileHeader.
+void WriteRuntimeFile(GeneratorContext* context,
+                      const std::string& filename,
+                      const char* contents);
+
+}  // namespace compiler
+}  // namespace protobuf
+}  // namespace google
+
+#endif  // PROTOBUF_FOR_PB_RUNTIME_H__
@@ -4,26 +4,52 @@
 #include <stdio.h>
 #include <assert.h>
 #include <google/protobuf/compiler/code_generator.h>
-#include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/io/zero_copy_stream.h>
 
 #include "objc_helper.h"
+#include "runtime.h"
+#include "service_generator.h"
+#include "util.h"
 #include "google/protobuf/dx_options.pb.h"  // for method options
 
 using namespace google::protobuf;
 using namespace google::protobuf::compiler;
 
+namespace {
+
 static string MethodName(const MethodDescriptor* d) {
   return objc::LowerFirstChar(d->name());
 }
 
+// Settings from the plugin parameter, e.g.
+//   --objcservice_out=wire_format=binary:.
+struct GeneratorOptions {
+  GeneratorOptions()
+      : binary_wire_format(false), get_query(false), emit_runtime(true) {}
+
+  // Default for POST methods that don't set dx_method_options.wire_format.
+  bool binary_wire_format;
+
+  // GET methods go through the app's ProtoService with [request toDict]
+  // unless get_query=true, which sends them through DXTransport with the
+  // request's fields in the query string (see DXQueryString()).  That
+  // changes what GET endpoints see, so servers have to be ready for it.
+  // Retries, hedging, priorities, etag_cache and streaming on GETs need it.
+  bool get_query;
+
+  // Write DXServiceRuntime.h/.m; pass runtime=false if the app ships its own.
+  bool emit_runtime;
+};
+
 // Generate one method on a service.
 class MethodGenerator {
  public:
-  MethodGenerator(const MethodDescriptor* descriptor, string* error)
+  MethodGenerator(const MethodDescriptor* descriptor,
+                  const GeneratorOptions& generator_options,
+                  string* error)
       : descriptor_(descriptor), error_(error) {
     DXMethodOptions options =
         descriptor_->options().GetExtension(dx_method_options);
@@ -31,46 +57,383 @@ class MethodGenerator {
     vars_["input_class"] = objc::ClassName(descriptor->input_type());
     vars_["output_class"] = objc::ClassName(descriptor->output_type());
     vars_["http_method"] = options.http_method();
-
-    // Pull out all args from the path, we'll use them in the http path.
-    string path = options.path();
-    while (!path.empty()) {
-      int i = path.find(':');
-      int j = path.find('/', i + 1);
-      path_parts_.push_back(path.substr(0, i));
-      if (i == string::npos) {
+    vars_["deliver"] = "deliver";
+    protoservice_ = options.http_method() == "GET" &&
+                    !generator_options.get_query;
+    cached_ = options.cache_ttl_ms() > 0 || options.dedupe();
+    etag_ = options.etag_cache();
+    idempotent_ = options.has_idempotent() ? options.idempotent()
+                                           : options.http_method() == "GET";
+    policy_ = options.max_retries() > 0 || options.hedge_after_ms() > 0;
+    vars_["policy"] = policy_ ? " policy:policy" : "";
+    // The policy form of DXTransport always takes compressAbove:, where 0
+    // means never; compress_min_bytes 0 means every non-empty body.
+    compress_ = options.compress_request();
+    if (compress_ || policy_) {
+      uint32 min_bytes = options.compress_min_bytes();
+      vars_["compress"] = " compressAbove:" +
+          SimpleItoa(!compress_ ? 0 : min_bytes > 0 ? min_bytes : 1);
+    } else {
+      vars_["compress"] = "";
+    }
+    vars_["ttl"] = SimpleItoa(options.cache_ttl_ms()) + " / 1000.0";
+    vars_["dedupe"] = options.dedupe() ? "YES" : "NO";
+    vars_["deadline_ms"] = SimpleItoa(options.deadline_ms());
+    switch (options.priority()) {
+      case DXMethodOptions::INTERACTIVE:
+        vars_["priority"] = "DXPriorityInteractive";
+        break;
+      case DXMethodOptions::BACKGROUND:
+        vars_["priority"] = "DXPriorityBackground";
         break;
-      } else if (j == string::npos) {
-        method_args_.push_back(path.substr(i + 1));
+      default:
+        vars_["priority"] = "DXPriorityNormal";
         break;
-      } else {
-        method_args_.push_back(path.substr(i + 1, j - i - 1));
-        path = path.substr(j);
+    }
+    SetTrackCall(true);
+    paged_ = options.has_page_token_field() ||
+             options.has_next_page_token_field();
+    if (paged_) {
+      vars_["page_token"] = objc::UnderscoresToCapitalizedCamelCase(
+          options.page_token_field());
+      vars_["next_page_token"] = objc::LowerFirstChar(
+          objc::UnderscoresToCapitalizedCamelCase(
+              options.next_page_token_field()));
+      vars_["prefetch_depth"] = SimpleItoa(options.prefetch_depth());
+      vars_["prefetch_max_bytes"] = SimpleItoa(options.prefetch_max_bytes());
+    }
+
+    // Streamed methods send the elements of the response's one repeated
+    // message field.
+    streaming_ = options.streaming();
+    stream_field_ = NULL;
+    int repeated_messages = 0;
+    const Descriptor* output = descriptor->output_type();
+    for (int i = 0; i < output->field_count(); i++) {
+      const FieldDescriptor* field = output->field(i);
+      if (field->is_repeated() &&
+          field->type() == FieldDescriptor::TYPE_MESSAGE) {
+        stream_field_ = field;
+        repeated_messages++;
       }
     }
+    if (streaming_ && repeated_messages == 1) {
+      vars_["item_class"] = objc::ClassName(stream_field_->message_type());
+      vars_["stream_key"] = stream_field_->camelcase_name();
+    } else {
+      stream_field_ = NULL;
+    }
+
+    if (options.has_wire_format()) {
+      binary_ = options.wire_format() == DXMethodOptions::BINARY;
+    } else {
+      binary_ = generator_options.binary_wire_format &&
+          options.http_method() == "POST";
+    }
+
+    // Pull out all args from the path, we'll use them in the http path.
+    ParsePath(options.path(), &path_parts_, &method_args_);
   }
 
-  void MethodSignature(io::Printer* p) {
+  // Each method comes in four forms.  `fields` asks the server for just
+  // those fields of the response, and `deadline` (in seconds, 0 for the
+  // method's default) bounds the whole call.  The DXCallOptions form also
+  // overrides the method's priority; the others call it.
+  enum Variant { PLAIN, FIELDS, DEADLINE, OPTIONS };
+
+  void MethodSignature(io::Printer* p, Variant variant) {
     p->Print(vars_,
-             "- (void)$method_name$:($input_class$ *)request ");
+             "- (DXCall *)$method_name$:($input_class$ *)request ");
     for (int i = 0; i < method_args_.size(); i++) {
       p->Print("$var$:(NSString *)$var$ ", "var", method_args_[i]);
     }
+    if (variant == FIELDS || variant == DEADLINE) {
+      p->Print(vars_, "fields:(NSArray<$output_class$Field> *)fields ");
+    }
+    if (variant == DEADLINE) {
+      p->Print("deadline:(NSTimeInterval)deadline ");
+    }
+    if (variant == OPTIONS) {
+      p->Print("options:(DXCallOptions *)options ");
+    }
     p->Print(vars_,
              "done:(void (^)"
              "(NSError *err, $output_class$ *response))callback");
   }
 
   void GenerateHeader(io::Printer* p) {
-    MethodSignature(p);
+    MethodSignature(p, PLAIN);
+    p->Print(";\n\n");
+    MethodSignature(p, FIELDS);
+    p->Print(";\n\n");
+    MethodSignature(p, DEADLINE);
+    p->Print(";\n\n");
+    MethodSignature(p, OPTIONS);
     p->Print(";\n\n");
   }
 
   void GenerateImpl(io::Printer* p) {
+    if (!Validate()) {
+      return;
+    }
+
+    GenerateForwarder(p, PLAIN);
+    GenerateForwarder(p, FIELDS);
+    GenerateForwarder(p, DEADLINE);
+    MethodSignature(p, OPTIONS);
+    p->Print(" {\n");
+    p->Indent(); p->Indent();
+
+    GenerateSetup(p, "self", !protoservice_);
+    if (!protoservice_) {
+      p->Print(vars_,
+               "DXPriority priority = options.hasPriority ? options.priority"
+               " : $priority$;\n");
+    }
+    if (policy_) {
+      GeneratePolicy(p);
+    }
+    if (cached_) {
+      GenerateCachedCall(p);
+    } else if (binary_) {
+      GenerateBinaryCall(p);
+    } else {
+      GenerateJSONCall(p);
+    }
+    p->Print("return call;\n");
+
+    p->Outdent(); p->Outdent();
+    p->Print("}\n\n");
+  }
+
+  // Paged methods also get a ...Pages: form on the service (not the batch)
+  // that walks the pages with a DXPageIterator.
+  void GeneratePagesSignature(io::Printer* p) {
+    p->Print(vars_,
+             "- (DXPageIterator<$output_class$ *> *)$method_name$Pages:"
+             "($input_class$ *)request ");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print("$var$:(NSString *)$var$ ", "var", method_args_[i]);
+    }
+    p->Print("options:(DXCallOptions *)options");
+  }
+
+  void GeneratePagesHeader(io::Printer* p) {
+    if (!paged_) {
+      return;
+    }
+    GeneratePagesSignature(p);
+    p->Print(";\n\n");
+  }
+
+  // Each page is an ordinary call with the request's page token replaced.
+  void GeneratePagesImpl(io::Printer* p) {
+    if (!paged_ || !Validate()) {
+      return;
+    }
+    GeneratePagesSignature(p);
+    p->Print(vars_,
+             " {\n"
+             "    DXPageFetch fetch = ^DXCall *(NSString *token,"
+             " DXPageBlock done) {\n"
+             "        $input_class$ *pageRequest = request;\n"
+             "        if (token != nil) {\n"
+             "            pageRequest = [[[$input_class$"
+             " builderWithPrototype:request]"
+             " set$page_token$:token] build];\n"
+             "        }\n"
+             "        return [self $method_name$:pageRequest ");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print("$var$:$var$ ", "var", method_args_[i]);
+    }
+    p->Print(vars_,
+             "options:options"
+             " done:^(NSError *err, $output_class$ *response) {\n"
+             "            done(err, response, response.$next_page_token$,"
+             " [response serializedSize]);\n"
+             "        }];\n"
+             "    };\n"
+             "    return [[DXPageIterator alloc] initWithFetch:fetch"
+             " prefetchDepth:$prefetch_depth$"
+             " maxBytes:$prefetch_max_bytes$"
+             " queue:self.callbackQueue];\n"
+             "}\n\n");
+  }
+
+  // Streamed methods also get a ...Stream: form on the service.  Items are
+  // decoded in order as lines arrive, on the transport's queue rather than
+  // decodeQueue, and batches reach `items` on callbackQueue before
+  // `callback` runs.  The request is always JSON.
+  void GenerateStreamSignature(io::Printer* p) {
+    p->Print(vars_,
+             "- (DXCall *)$method_name$Stream:($input_class$ *)request ");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print("$var$:(NSString *)$var$ ", "var", method_args_[i]);
+    }
+    p->Print(vars_,
+             "options:(DXCallOptions *)options"
+             " items:(void (^)(NSArray<$item_class$ *> *items))items"
+             " done:(void (^)(NSError *err))callback");
+  }
+
+  void GenerateStreamHeader(io::Printer* p) {
+    if (!streaming_ || stream_field_ == NULL) {
+      return;
+    }
+    GenerateStreamSignature(p);
+    p->Print(";\n\n");
+  }
+
+  void GenerateStreamImpl(io::Printer* p) {
+    if (!streaming_ || !Validate()) {
+      return;
+    }
+    GenerateStreamSignature(p);
+    p->Print(" {\n");
+    p->Indent(); p->Indent();
+
+    GeneratePath(p, true);
+    p->Print(vars_,
+             "DXCall *call = [DXCall new];\n"
+             "dispatch_queue_t callbackQueue = self.callbackQueue;\n"
+             "void (^deliverItems)(NSArray *) = ^(NSArray *batch) {\n"
+             "    DXDispatch(callbackQueue, ^{\n"
+             "        if (!call.isCancelled) {\n"
+             "            items(batch);\n"
+             "        }\n"
+             "    });\n"
+             "};\n"
+             "void (^deliver)(NSError *) = ^(NSError *err) {\n"
+             "    if ([call complete]) {\n"
+             "        DXDispatch(callbackQueue, ^{\n"
+             "            callback(err);\n"
+             "        });\n"
+             "    }\n"
+             "};\n"
+             "[call expireAfter:(deadline > 0 ? deadline"
+             " : $deadline_ms$ / 1000.0) expired:^{\n"
+             "    DXDispatch(callbackQueue, ^{\n"
+             "        callback(DXDeadlineExceededError());\n"
+             "    });\n"
+             "}];\n"
+             "DXPriority priority = options.hasPriority ? options.priority"
+             " : $priority$;\n"
+             "\n");
+    if (vars_["http_method"] == "POST") {
+      p->Print(vars_,
+               "[call add:[DXTransport streamFrom:_address path:path"
+               " method:@\"$http_method$\""
+               " headers:@{@\"Content-Type\": DXJSONContentType}"
+               " body:[request toJSONData] priority:priority"
+               " queue:self.decodeQueue"
+               " lines:^NSError *(NSArray<NSData *> *lines) {\n");
+    } else {
+      p->Print(vars_,
+               "[call add:[DXTransport streamFrom:_address path:path"
+               " method:@\"$http_method$\""
+               " headers:nil body:nil priority:priority"
+               " queue:self.decodeQueue"
+               " lines:^NSError *(NSArray<NSData *> *lines) {\n");
+    }
+    p->Print(vars_,
+             "    NSMutableArray *batch ="
+             " [NSMutableArray arrayWithCapacity:lines.count];\n"
+             "    for (NSData *line in lines) {\n"
+             "        NSError *parseErr = nil;\n"
+             "        $item_class$ *item = [$item_class$ parseFromJSONData:line"
+             " error:&parseErr];\n"
+             "        if (item == nil) {\n"
+             "            return parseErr;\n"
+             "        }\n"
+             "        [batch addObject:item];\n"
+             "    }\n"
+             "    deliverItems(batch);\n"
+             "    return nil;\n"
+             "} done:^void (NSError *err, NSHTTPURLResponse *http,"
+             " NSData *body) {\n"
+             "    // A server that doesn't stream sends the whole response, which\n"
+             "    // must hold the items under their key.\n"
+             "    if (err == nil && body != nil) {\n"
+             "        NSDictionary *dict = [NSJSONSerialization"
+             " JSONObjectWithData:body options:0 error:&err];\n"
+             "        NSArray *arr = [dict isKindOfClass:[NSDictionary class]]"
+             " ? dict[@\"$stream_key$\"] : nil;\n"
+             "        if (err == nil && ![arr isKindOfClass:[NSArray class]]) {\n"
+             "            err = [NSError errorWithDomain:NSURLErrorDomain"
+             " code:NSURLErrorBadServerResponse userInfo:nil];\n"
+             "        }\n"
+             "        if (err == nil) {\n"
+             "            NSMutableArray *batch ="
+             " [NSMutableArray arrayWithCapacity:arr.count];\n"
+             "            for (id e in arr) {\n"
+             "                if (![e isKindOfClass:[NSDictionary class]]) {\n"
+             "                    err = [NSError errorWithDomain:NSURLErrorDomain"
+             " code:NSURLErrorBadServerResponse userInfo:nil];\n"
+             "                    break;\n"
+             "                }\n"
+             "                [batch addObject:[$item_class$ parseFromDict:e]];\n"
+             "            }\n"
+             "            if (err == nil) {\n"
+             "                deliverItems(batch);\n"
+             "            }\n"
+             "        }\n"
+             "    }\n"
+             "    deliver(err);\n"
+             "}]];\n"
+             "return call;\n");
+
+    p->Outdent(); p->Outdent();
+    p->Print("}\n\n");
+  }
+
+  // The same method on the service's batch class; it adds the call to the
+  // batch instead of sending it.  Batches are JSON, whatever wire_format says,
+  // and go out at the normal priority.
+  void GenerateBatchImpl(io::Printer* p) {
+    if (!Validate()) {
+      return;
+    }
+
+    GenerateForwarder(p, PLAIN);
+    GenerateForwarder(p, FIELDS);
+    GenerateForwarder(p, DEADLINE);
+    MethodSignature(p, OPTIONS);
+    p->Print(" {\n");
+    p->Indent(); p->Indent();
+
+    // Batched GETs always carry their fields in the query string; the
+    // batch endpoint is ours, not ProtoService's.
+    GenerateSetup(p, "_service", true);
+    p->Print("[_batch addCall:@\"$http_method$\" path:path"
+             " body:$body$"
+             " done:^void (NSError *err, id body) {\n",
+             "http_method", vars_["http_method"],
+             "body", vars_["http_method"] == "POST" ? "[request toJSONData]"
+                                                  : "nil");
+    p->Print(vars_,
+             "    if (err != nil) {\n"
+             "        deliver(err, nil);\n"
+             "        return;\n"
+             "    }\n"
+             "    DXDispatch(decodeQueue, ^{\n"
+             "        if (call.isCancelled) {\n"
+             "            return;\n"
+             "        }\n"
+             "        deliver(nil, [$output_class$ parseFromDict:body]);\n"
+             "    });\n"
+             "}];\n"
+             "return call;\n");
+
+    p->Outdent(); p->Outdent();
+    p->Print("}\n\n");
+  }
+
+ private:
+  bool Validate() {
     if (!descriptor_->options().HasExtension(dx_method_options)) {
       error_->assign("Error: can't generate method %s, "
                      "doesn't have options set");
-      return;
+      return false;
     }
 
     DXMethodOptions options =
@@ -79,14 +442,144 @@ class MethodGenerator {
     if (options.http_method() != "GET" &&
         options.http_method() != "POST") {
       error_->assign("Invalid http method");
-      return;
+      return false;
+    }
+
+    if (binary_ && options.http_method() != "POST") {
+      error_->assign("Binary wire format needs a POST method: " +
+                     descriptor_->full_name());
+      return false;
     }
 
-    MethodSignature(p);
+    if ((cached_ || etag_) && options.http_method() != "GET") {
+      error_->assign("cache_ttl_ms, dedupe and etag_cache need a GET method: " +
+                     descriptor_->full_name());
+      return false;
+    }
+    if (compress_ && options.http_method() != "POST") {
+      error_->assign("compress_request needs a POST method: " +
+                     descriptor_->full_name());
+      return false;
+    }
+    if (options.hedge_after_ms() > 0 && !idempotent_) {
+      error_->assign("hedge_after_ms needs an idempotent method: " +
+                     descriptor_->full_name());
+      return false;
+    }
+    // DXETagCache sends its request once, so the policy would be dropped.
+    if (etag_ && (policy_ || options.has_backoff_ms() ||
+                  options.has_max_backoff_ms())) {
+      error_->assign("etag_cache can't be combined with max_retries, "
+                     "hedge_after_ms, backoff_ms or max_backoff_ms: " +
+                     descriptor_->full_name());
+      return false;
+    }
+    if (protoservice_ && (etag_ || streaming_ || policy_ ||
+                          options.has_priority())) {
+      error_->assign("etag_cache, streaming, max_retries, hedge_after_ms and "
+                     "priority on a GET need the get_query=true plugin "
+                     "parameter: " + descriptor_->full_name());
+      return false;
+    }
+    if (streaming_ && stream_field_ == NULL) {
+      error_->assign("streaming needs a response with exactly one repeated "
+                     "message field: " + descriptor_->full_name());
+      return false;
+    }
+    if (paged_ && !(IsStringField(descriptor_->input_type(),
+                                  options.page_token_field()) &&
+                    IsStringField(descriptor_->output_type(),
+                                  options.next_page_token_field()))) {
+      error_->assign("page_token_field and next_page_token_field must name "
+                     "string fields of the request and response: " +
+                     descriptor_->full_name());
+      return false;
+    }
+    return true;
+  }
+
+  static bool IsStringField(const Descriptor* message, const string& name) {
+    const FieldDescriptor* field = message->FindFieldByName(name);
+    return field != NULL && !field->is_repeated() &&
+           field->type() == FieldDescriptor::TYPE_STRING;
+  }
+
+  // The DXCallPolicy for methods with retries or hedging.
+  void GeneratePolicy(io::Printer* p) {
+    DXMethodOptions options =
+        descriptor_->options().GetExtension(dx_method_options);
+    p->Print("DXCallPolicy policy = {\n"
+             "    .idempotent = $idempotent$,\n"
+             "    .maxRetries = $retries$,\n"
+             "    .backoff = $backoff$ / 1000.0,\n"
+             "    .maxBackoff = $max_backoff$ / 1000.0,\n"
+             "    .hedgeAfter = $hedge$ / 1000.0,\n"
+             "};\n\n",
+             "idempotent", idempotent_ ? "YES" : "NO",
+             "retries", SimpleItoa(options.max_retries()),
+             "backoff", SimpleItoa(options.backoff_ms()),
+             "max_backoff", SimpleItoa(options.max_backoff_ms()),
+             "hedge", SimpleItoa(options.hedge_after_ms()));
+  }
+
+  // The shorter forms pack their arguments into a DXCallOptions.
+  void GenerateForwarder(io::Printer* p, Variant variant) {
+    MethodSignature(p, variant);
     p->Print(" {\n");
-    p->Indent(); p->Indent();
+    string options = "nil";
+    if (variant != PLAIN) {
+      options = "options";
+      p->Print("    DXCallOptions *options = [DXCallOptions new];\n"
+               "    options.fields = fields;\n");
+      if (variant == DEADLINE) {
+        p->Print("    options.deadline = deadline;\n");
+      }
+    }
+    p->Print(vars_, "    return [self $method_name$:request ");
+    for (int i = 0; i < method_args_.size(); i++) {
+      p->Print("$var$:$var$ ", "var", method_args_[i]);
+    }
+    p->Print("options:$options$ done:callback];\n"
+             "}\n\n",
+             "options", options);
+  }
 
-    p->Print("NSMutableString *path = [NSMutableString new];\n");
+  // Builds `path` and the deliver() block, taking the queues from the
+  // service in `service`.  `query` is as for GeneratePath().
+  void GenerateSetup(io::Printer* p, const string& service, bool query) {
+    GeneratePath(p, query);
+
+    // Everything below reports through deliver(), which drops the result
+    // of a cancelled or expired call and otherwise hops to the service's
+    // callbackQueue.
+    p->Print("DXCall *call = [DXCall new];\n"
+             "dispatch_queue_t decodeQueue = $service$.decodeQueue;\n"
+             "dispatch_queue_t callbackQueue = $service$.callbackQueue;\n",
+             "service", service);
+    p->Print(vars_,
+             "void (^deliver)(NSError *, $output_class$ *) ="
+             " ^(NSError *err, $output_class$ *res) {\n"
+             "    if ([call complete]) {\n"
+             "        DXDispatch(callbackQueue, ^{\n"
+             "            callback(err, res);\n"
+             "        });\n"
+             "    }\n"
+             "};\n"
+             "[call expireAfter:(deadline > 0 ? deadline"
+             " : $deadline_ms$ / 1000.0) expired:^{\n"
+             "    DXDispatch(callbackQueue, ^{\n"
+             "        callback(DXDeadlineExceededError(), nil);\n"
+             "    });\n"
+             "}];\n"
+             "\n");
+  }
+
+  // Builds `path` from the method's args, the request (for GETs, if
+  // `query`) and the fields in `options`.
+  void GeneratePath(io::Printer* p, bool query) {
+    p->Print("NSArray *fields = options.fields;\n"
+             "NSTimeInterval deadline = options.deadline;\n"
+             "NSMutableString *path = [NSMutableString new];\n");
     for (int i = 0; i < method_args_.size(); i++) {
       p->Print("[path appendString:@\"$pp$\"];\n", "pp", path_parts_[i]);
       p->Print("[path appendString:$v$];\n", "v", method_args_[i]);
@@ -94,79 +587,291 @@ class MethodGenerator {
     if (path_parts_.size() > method_args_.size()) {
       p->Print("[path appendString:@\"$pp$\"];\n", "pp", path_parts_.back());
     }
+    // GET requests carry their fields in the query string.
+    if (query && vars_["http_method"] == "GET") {
+      p->Print("[path appendString:DXQueryString([request toDict])];\n");
+    }
+    p->Print("[path appendString:DXFieldsQuery(path, fields)];\n");
     p->Print("\n");
+  }
 
-    // This is with NSData binary buffers:
-    /*
+  // Skips decoding once the call is cancelled.  Not for requests shared
+  // through DXResponseCache, whose other waiters still want the result.
+  void GenerateCancelCheck(io::Printer* p) {
+    if (track_call_) {
+      p->Print("if (call.isCancelled) {\n"
+               "    return;\n"
+               "}\n");
+    }
+  }
+
+  // Whether `call` owns the requests sent from here on, in which case
+  // sends are wrapped in "[call add:...]" so cancelling stops them.
+  void SetTrackCall(bool track) {
+    track_call_ = track;
+    vars_["add_open"] = track ? "[call add:" : "";
+    vars_["add_close"] = track ? "]" : "";
+  }
+
+  // Sends the request through the shared DXResponseCache, which answers
+  // from the cache, joins an identical call in flight, or runs the JSON
+  // call with its own finish block standing in for deliver().
+  void GenerateCachedCall(io::Printer* p) {
+    // ProtoService calls don't have the request in the path, so it goes
+    // in the key.
+    p->Print("NSString *cacheKey = [_address stringByAppendingString:path];\n");
+    if (protoservice_) {
+      p->Print("cacheKey = [cacheKey"
+               " stringByAppendingString:DXQueryString([request toDict])];\n");
+    }
+    p->Print(vars_,
+             "[[DXResponseCache sharedCache]"
+             " fetch:cacheKey"
+             " ttl:$ttl$ dedupe:$dedupe$"
+             " start:^void (DXResultBlock finish) {\n");
+    p->Indent(); p->Indent();
+    vars_["deliver"] = "finish";
+    SetTrackCall(false);
+    GenerateJSONCall(p);
+    SetTrackCall(true);
+    vars_["deliver"] = "deliver";
+    p->Outdent(); p->Outdent();
+    p->Print(vars_,
+             "} done:^void (NSError *err, id res) {\n"
+             "    deliver(err, res);\n"
+             "}];\n");
+  }
+
+  // POST bodies are written straight to JSON bytes with -toJSONData, and
+  // responses are parsed from the bytes with +parseFromJSONData:error:.
+  void GenerateJSONCall(io::Printer* p) {
+    if (etag_) {
+      GenerateETagCall(p);
+      return;
+    }
+    if (protoservice_) {
+      GenerateProtoServiceCall(p);
+      return;
+    }
+    if (vars_["http_method"] == "POST") {
+      p->Print(
+          vars_,
+          "$add_open$[DXTransport sendTo:_address path:path"
+          " method:@\"$http_method$\""
+          " headers:@{@\"Content-Type\": DXJSONContentType}"
+          " body:[request toJSONData] priority:priority$compress$$policy$"
+          " done:^void (NSError *err, NSHTTPURLResponse *http, NSData *body) {\n");
+    } else {
+      p->Print(
+          vars_,
+          "$add_open$[DXTransport sendTo:_address path:path"
+          " method:@\"$http_method$\""
+          " headers:nil body:nil priority:priority$compress$$policy$"
+          " done:^void (NSError *err, NSHTTPURLResponse *http, NSData *body) {\n");
+    }
+    p->Indent(); p->Indent();
+    p->Print(vars_,
+             "if (err != nil) {\n"
+             "    $deliver$(err, nil);\n"
+             "    return;\n"
+             "}\n");
+    GenerateParseJSONBody(p);
+    p->Outdent(); p->Outdent();
+    p->Print(vars_, "}]$add_close$;\n");
+  }
+
+  // A GET through the app's ProtoService, which takes the request as a
+  // dictionary and hands back the parsed JSON.  It can't be cancelled, so
+  // deliver() just drops the result of a cancelled call.
+  void GenerateProtoServiceCall(io::Printer* p) {
+    p->Print(vars_,
+             "[ProtoService makeCallTo:_address path:path"
+             " method:@\"$http_method$\""
+             " request:[request toDict]"
+             " done:^void (NSError *err, id response) {\n"
+             "    if (err != nil) {\n"
+             "        $deliver$(err, nil);\n"
+             "        return;\n"
+             "    }\n"
+             "    DXDispatch(decodeQueue, ^{\n");
+    p->Indent(); p->Indent(); p->Indent(); p->Indent();
+    GenerateCancelCheck(p);
+    p->Outdent(); p->Outdent(); p->Outdent(); p->Outdent();
+    p->Print(vars_,
+             "        $deliver$(nil, [$output_class$ parseFromDict:response]);\n"
+             "    });\n"
+             "}];\n");
+  }
+
+  // Decodes a JSON response body in `body` on the decode queue and passes it
+  // to the callback.
+  void GenerateParseJSONBody(io::Printer* p) {
+    p->Print("DXDispatch(decodeQueue, ^{\n");
+    p->Indent(); p->Indent();
+    GenerateCancelCheck(p);
     p->Print(
         vars_,
-        "NSOutputStream *dataStream = [NSOutputStream outputStreamToMemory];\n"
-        "[dataStream open];\n"
-        "[request writeToOutputStream:dataStream];\n"
-        "[dataStream close];\n"
-        "NSData *buf = [dataStream propertyForKey:"
-        "NSStreamDataWrittenToMemoryStreamKey];\n"
-        "\n"
-        "[ProtoService doCall:path server:_address request:buf"
-        " done:^void (NSError *err, id response) {\n"
-        "    if (err != nil) {\n"
-        "        callback(err, nil);\n"
-        "        return;\n"
-        "    }\n"
-        "    $output_class$ *res = [$output_class$ parseFromData:response];\n"
-        "    callback(nil, res);\n"
-        "}];\n"
-        "");
-    */
+        "NSError *parseErr = nil;\n"
+        "$output_class$ *res = [$output_class$ parseFromJSONData:body"
+        " error:&parseErr];\n"
+        "$deliver$(parseErr, res);\n");
+    p->Outdent(); p->Outdent();
+    p->Print("});\n");
+  }
 
-    // This is with NSDicationaries:
-    p->Print(
-        "[ProtoService makeCallTo:_address path:path method:@\"$method$\""
-        " request:[request toDict]"
-        " done:^void (NSError *err, id response) {\n"
-        "    if (err != nil) {\n"
-        "        callback(err, nil);\n"
-        "        return;\n"
-        "    }\n"
-        "    $output_class$ *res = [$output_class$ parseFromDict:response];\n"
-        "    callback(nil, res);\n"
-        "}];\n",
-        "output_class", vars_["output_class"],
-        "method", options.http_method());
+  // A GET through DXETagCache.  A 200 is parsed from JSON and stored in the
+  // protobuf wire format, so a 304 is rebuilt with +parseFromData: and never
+  // goes near the JSON parser.
+  void GenerateETagCall(io::Printer* p) {
+    p->Print(vars_,
+             "DXETagCache *etags = [DXETagCache sharedCache];\n"
+             "$add_open$[etags getFrom:_address path:path"
+             " priority:priority done:^void (NSError *err, NSHTTPURLResponse *http,"
+             " NSData *body, NSData *cached) {\n"
+             "    if (err != nil) {\n"
+             "        $deliver$(err, nil);\n"
+             "        return;\n"
+             "    }\n"
+             "    DXDispatch(decodeQueue, ^{\n");
+    p->Indent(); p->Indent(); p->Indent(); p->Indent();
+    GenerateCancelCheck(p);
+    p->Outdent(); p->Outdent(); p->Outdent(); p->Outdent();
+    p->Print(vars_,
+             "        if (cached != nil) {\n"
+             "            $deliver$(nil, [$output_class$"
+             " parseFromData:cached]);\n"
+             "            return;\n"
+             "        }\n"
+             "        NSError *parseErr = nil;\n"
+             "        $output_class$ *res = [$output_class$"
+             " parseFromJSONData:body error:&parseErr];\n"
+             "        if (res != nil) {\n"
+             "            [etags storeData:[res data] response:http"
+             " forKey:[_address stringByAppendingString:path]];\n"
+             "        }\n"
+             "        $deliver$(parseErr, res);\n"
+             "    });\n"
+             "}]$add_close$;\n");
+  }
 
+  // This is with NSData binary buffers.  We ask for protobuf back but take
+  // JSON too.  If the server doesn't accept protobuf bodies (415) we resend
+  // the request as JSON, and send JSON to that address from then on.
+  void GenerateBinaryCall(io::Printer* p) {
+    p->Print("dispatch_block_t sendJSON = ^{\n");
+    p->Indent(); p->Indent();
+    GenerateJSONCall(p);
     p->Outdent(); p->Outdent();
-    p->Print("}\n\n");
+    p->Print("};\n"
+             "if (DXRefusesProtobuf(_address)) {\n"
+             "    sendJSON();\n"
+             "    return call;\n"
+             "}\n");
+    p->Print(
+        vars_,
+        "NSDictionary *headers = @{\n"
+        "    @\"Content-Type\": DXProtobufContentType,\n"
+        "    @\"Accept\": @\"application/x-protobuf, application/json;q=0.5\",\n"
+        "};\n"
+        "$add_open$[DXTransport sendTo:_address path:path"
+        " method:@\"$http_method$\""
+        " headers:headers body:[request data] priority:priority$compress$$policy$"
+        " done:^void (NSError *err, NSHTTPURLResponse *http, NSData *body) {\n");
+    p->Indent(); p->Indent();
+    p->Print("if (http.statusCode == 415) {\n"
+             "    DXSetRefusesProtobuf(_address);\n"
+             "    sendJSON();\n"
+             "    return;\n"
+             "}\n");
+    p->Print(
+        vars_,
+        "if (err != nil) {\n"
+        "    deliver(err, nil);\n"
+        "    return;\n"
+        "}\n"
+        "if (DXResponseIsProtobuf(http)) {\n"
+        "    DXDispatch(decodeQueue, ^{\n");
+    p->Indent(); p->Indent(); p->Indent(); p->Indent();
+    GenerateCancelCheck(p);
+    p->Outdent(); p->Outdent(); p->Outdent(); p->Outdent();
+    p->Print(
+        vars_,
+        "        deliver(nil, [$output_class$ parseFromData:body]);\n"
+        "    });\n"
+        "    return;\n"
+        "}\n");
+    GenerateParseJSONBody(p);
+    p->Outdent(); p->Outdent();
+    p->Print(vars_, "}]$add_close$;\n");
   }
 
- private:
   const MethodDescriptor* descriptor_;
   string* error_;
   map<string, string> vars_;
   vector<string> path_parts_;
   vector<string> method_args_;
+  bool binary_;
+  bool protoservice_;
+  bool cached_;
+  bool etag_;
+  bool idempotent_;
+  bool policy_;
+  bool compress_;
+  bool track_call_;
+  bool paged_;
+  bool streaming_;
+  const FieldDescriptor* stream_field_;
 };
 
 // Generate code for a service.
 class ServiceGenerator {
  public:
-  ServiceGenerator(const ServiceDescriptor* descriptor, string* error)
-      : descriptor_(descriptor), error_(error) {
+  ServiceGenerator(const ServiceDescriptor* descriptor,
+                   const GeneratorOptions& options,
+                   string* error)
+      : descriptor_(descriptor), options_(options), error_(error) {
     vars_["class"] = objc::ClassName(descriptor);
+    vars_["batch_path"] = descriptor->options()
+        .GetExtension(dx_service_options).batch_path();
   }
 
   void GenerateHeader(io::Printer* p) {
     p->Print(vars_,
+             "@class $class$Batch;\n\n"
              "@interface $class$ : NSObject\n\n"
              "@property (readonly) NSString *address;\n\n"
+             "// Responses are decoded on decodeQueue (a global background\n"
+             "// queue by default) and callbacks run on callbackQueue (the\n"
+             "// main queue by default).  Set either to nil to stay on the\n"
+             "// queue the step before it ran on.\n"
+             "@property (strong) dispatch_queue_t decodeQueue;\n"
+             "@property (strong) dispatch_queue_t callbackQueue;\n\n"
              "+ ($class$ *)newInstance:(NSString *)address;\n\n"
              "- (id)initWithAddress:(NSString *)address;\n\n"
              "");
 
     for (int i = 0; i < descriptor_->method_count(); i++) {
-      MethodGenerator(descriptor_->method(i), error_).GenerateHeader(p);
+      MethodGenerator method(descriptor_->method(i), options_, error_);
+      method.GenerateHeader(p);
+      method.GeneratePagesHeader(p);
+      method.GenerateStreamHeader(p);
     }
 
-    p->Print("@end\n\n");
+    p->Print(vars_,
+             "// Collects calls to send as one request to $batch_path$.\n"
+             "- ($class$Batch *)batch;\n\n"
+             "@end\n\n");
+
+    // The batch takes the same methods as the service, and send runs them.
+    p->Print(vars_,
+             "@interface $class$Batch : NSObject\n\n"
+             "- (id)initWithService:($class$ *)service;\n\n");
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      MethodGenerator(descriptor_->method(i), options_, error_)
+          .GenerateHeader(p);
+    }
+    p->Print("- (void)send;\n\n"
+             "@end\n\n");
   }
 
   void GenerateImpl(io::Printer* p) {
@@ -181,70 +886,138 @@ class ServiceGenerator {
         "    self = [self init];\n"
         "    if (self) {\n"
         "      _address = address;\n"
+        "      _decodeQueue ="
+        " dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);\n"
+        "      _callbackQueue = dispatch_get_main_queue();\n"
         "    }\n"
         "    return self;\n"
         "}\n\n");
 
     for (int i = 0; i < descriptor_->method_count(); i++) {
-      MethodGenerator(descriptor_->method(i), error_).GenerateImpl(p);
+      MethodGenerator method(descriptor_->method(i), options_, error_);
+      method.GenerateImpl(p);
+      method.GeneratePagesImpl(p);
+      method.GenerateStreamImpl(p);
     }
 
-    p->Print("@end\n\n");
+    p->Print(vars_,
+             "- ($class$Batch *)batch {\n"
+             "    return [[$class$Batch alloc] initWithService:self];\n"
+             "}\n\n"
+             "@end\n\n");
+
+    p->Print(vars_,
+             "@implementation $class$Batch {\n"
+             "    $class$ *_service;\n"
+             "    DXBatch *_batch;\n"
+             "}\n\n"
+             "- (id)initWithService:($class$ *)service {\n"
+             "    self = [self init];\n"
+             "    if (self) {\n"
+             "      _service = service;\n"
+             "      _batch = [[DXBatch alloc]"
+             " initWithAddress:service.address path:@\"$batch_path$\"];\n"
+             "    }\n"
+             "    return self;\n"
+             "}\n\n");
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      MethodGenerator(descriptor_->method(i), options_, error_)
+          .GenerateBatchImpl(p);
+    }
+    p->Print("- (void)send {\n"
+             "    [_batch send];\n"
+             "}\n\n"
+             "@end\n\n");
   }
 
  private:
   const ServiceDescriptor* descriptor_;
+  const GeneratorOptions& options_;
   string* error_;
   map<string, string> vars_;
 };
 
-
-class MyCodeGenerator : public CodeGenerator {
- public:
-  virtual ~MyCodeGenerator() {}
-
-  virtual bool Generate(const FileDescriptor* file,
-                        const string& parameter,
-                        GeneratorContext* context,
-                        string* error) const {
-    string path = objc::FilePath(file);
-
-    // Generate .h file.
-    {
-      scoped_ptr<io::ZeroCopyOutputStream> output(
-          context->OpenForInsert(path + ".pb.h", "global_scope"));
-      io::Printer printer(output.get(), '$');
-      for (int i = 0; i < file->service_count(); i++) {
-        ServiceGenerator(file->service(i), error).GenerateHeader(&printer);
-      }
+bool ParseOptions(const string& parameter,
+                  GeneratorOptions* options,
+                  string* error) {
+  vector<pair<string, string> > params;
+  ParseGeneratorParameter(parameter, &params);
+  for (int i = 0; i < params.size(); i++) {
+    const string& key = params[i].first;
+    const string& value = params[i].second;
+    if (key == "wire_format" && (value == "json" || value == "binary")) {
+      options->binary_wire_format = value == "binary";
+    } else if (key == "get_query" && (value == "true" || value == "false")) {
+      options->get_query = value == "true";
+    } else if (key == "runtime" && (value == "true" || value == "false")) {
+      options->emit_runtime = value == "true";
+    } else {
+      error->assign("Unknown parameter: " + key + "=" + value);
+      return false;
     }
+  }
+  return true;
+}
 
-    // Generate .m file.
-    {
-      scoped_ptr<io::ZeroCopyOutputStream> output(
-          context->OpenForInsert(path + ".pb.m", "global_scope"));
-      io::Printer printer(output.get(), '$');
-      for (int i = 0; i < file->service_count(); i++) {
-        ServiceGenerator(file->service(i), error).GenerateImpl(&printer);
-      }
+}  // anonymous namespace
+
+namespace objcservice {
+
+bool MyCodeGenerator::Generate(const FileDescriptor* file,
+                               const string& parameter,
+                               GeneratorContext* context,
+                               string* error) const {
+  string path = objc::FilePath(file);
+
+  GeneratorOptions options;
+  if (!ParseOptions(parameter, &options, error)) {
+    fprintf(stderr, "ERROR: %s\n", error->c_str());
+    return false;
+  }
+
+  // The support files are shared by every generated file, so only write
+  // them once per run.
+  if (options.emit_runtime && !runtime_written_) {
+    WriteRuntimeFile(context, "DXServiceRuntime.h", kServiceRuntimeHeader);
+    WriteRuntimeFile(context, "DXServiceRuntime.m", kServiceRuntimeSource);
+    runtime_written_ = true;
+  }
+
+  // Generate .h file.
+  {
+    scoped_ptr<io::ZeroCopyOutputStream> output(
+        context->OpenForInsert(path + ".pb.h", "global_scope"));
+    io::Printer printer(output.get(), '$');
+    for (int i = 0; i < file->service_count(); i++) {
+      ServiceGenerator(file->service(i), options, error).GenerateHeader(&printer);
     }
+  }
 
-    // Stick in import.
-    {
-      scoped_ptr<io::ZeroCopyOutputStream> output(
-          context->OpenForInsert(path + ".pb.m", "imports"));
-      io::Printer printer(output.get(), '$');
-      printer.Print("#import \"ProtoService.h\"\n");
+  // Generate .m file.
+  {
+    scoped_ptr<io::ZeroCopyOutputStream> output(
+        context->OpenForInsert(path + ".pb.m", "global_scope"));
+    io::Printer printer(output.get(), '$');
+    for (int i = 0; i < file->service_count(); i++) {
+      ServiceGenerator(file->service(i), options, error).GenerateImpl(&printer);
     }
+  }
 
-    if (!error->empty()) {
-      fprintf(stderr, "ERROR: %s\n", error->c_str());
+  // Stick in import.
+  {
+    scoped_ptr<io::ZeroCopyOutputStream> output(
+        context->OpenForInsert(path + ".pb.m", "imports"));
+    io::Printer printer(output.get(), '$');
+    if (!options.get_query) {
+      printer.Print("#import \"ProtoService.h\"\n");
     }
-    return error->empty();
+    printer.Print("#import \"DXServiceRuntime.h\"\n");
   }
-};
 
-int main(int argc, char* argv[]) {
-  MyCodeGenerator generator;
-  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+  if (!error->empty()) {
+    fprintf(stderr, "ERROR: %s\n", error->c_str());
+  }
+  return error->empty();
 }
+
+}  // namespace objcservice
@@ -0,0 +1,30 @@
+// protoc-gen-objcservice: Objective-C clients for services, inserted into
+// the files from protoc-gen-objc.  main() is in service_main.cc, so the
+// generator can be linked into other programs (see bench/).
+
+#ifndef SERVICE_GENERATOR_H__
+#define SERVICE_GENERATOR_H__
+
+#include <string>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/descriptor.h>
+
+namespace objcservice {
+
+class MyCodeGenerator : public google::protobuf::compiler::CodeGenerator {
+ public:
+  MyCodeGenerator() : runtime_written_(false) {}
+  virtual ~MyCodeGenerator() {}
+
+  virtual bool Generate(const google::protobuf::FileDescriptor* file,
+                        const std::string& parameter,
+                        google::protobuf::compiler::GeneratorContext* context,
+                        std::string* error) const;
+
+ private:
+  mutable bool runtime_written_;
+};
+
+}  // namespace objcservice
+
+#endif  // SERVICE_GENERATOR_H__
@@ -0,0 +1,10 @@
+// Entry point of protoc-gen-objcservice.
+
+#include <google/protobuf/compiler/plugin.h>
+
+#include "service_generator.h"
+
+int main(int argc, char* argv[]) {
+  objcservice::MyCodeGenerator generator;
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
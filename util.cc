@@ -1,4 +1,5 @@
 #include "util.h"
+#include <ctype.h>
 #include <stdio.h>
 
 namespace google {
@@ -21,6 +22,43 @@ std::string SimpleItoa(int x) {
   return std::string(buf);
 }
 
+void ParsePath(const std::string& path,
+               std::vector<std::string>* parts,
+               std::vector<std::string>* args) {
+  std::string rest = path;
+  while (!rest.empty()) {
+    std::string::size_type i = rest.find(':');
+    std::string::size_type j = rest.find('/', i + 1);
+    parts->push_back(rest.substr(0, i));
+    if (i == std::string::npos) {
+      break;
+    } else if (j == std::string::npos) {
+      args->push_back(rest.substr(i + 1));
+      break;
+    } else {
+      args->push_back(rest.substr(i + 1, j - i - 1));
+      rest = rest.substr(j);
+    }
+  }
+}
+
+std::string IncludeGuard(const std::string& filename) {
+  std::string guard = filename + "__";
+  for (int i = 0; i < guard.size(); i++) {
+    guard[i] = isalnum(guard[i]) ? toupper(guard[i]) : '_';
+  }
+  return guard;
+}
+
+std::string CppNamespace(const std::string& package) {
+  std::string ns = package;
+  for (std::string::size_type i = ns.find('.'); i != std::string::npos;
+       i = ns.find('.', i)) {
+    ns.replace(i, 1, "::");
+  }
+  return ns;
+}
+
 }  // namespace compiler
 }  // namespace protobuf
 }  // namespace google
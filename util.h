@@ -5,6 +5,7 @@
 #define PROTOBUF_FOR_PB_UTIL_H__
 
 #include <string>
+#include <vector>
 
 namespace google {
 namespace protobuf {
@@ -14,6 +15,18 @@ std::string Basename(const std::string& fn);
 
 std::string SimpleItoa(int x);
 
+// Splits a dx_method_options path like "/user/:userId/balance" into the
+// literal text around its variables ("/user/", "/balance") and the
+// variable names ("userId").
+void ParsePath(const std::string& path,
+               std::vector<std::string>* parts,
+               std::vector<std::string>* args);
+
+// For the C++ generators: "foo/bar.router.h" becomes
+// "FOO_BAR_ROUTER_H__", and the package "a.b" becomes "a::b".
+std::string IncludeGuard(const std::string& filename);
+std::string CppNamespace(const std::string& package);
+
 extern const char kFileHeader[];
 
 }  // namespace compiler